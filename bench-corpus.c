@@ -0,0 +1,132 @@
+/*
+ * Request headers as sent by real browsers and tools, for the benchmarks.
+*/
+#include <ashttpd.h>
+#include <bench-corpus.h>
+
+const char * const bench_corpus[] = {
+	/* Chrome, first visit */
+	"GET / HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", "
+		"\"Not-A.Brand\";v=\"99\"\r\n"
+	"sec-ch-ua-mobile: ?0\r\n"
+	"sec-ch-ua-platform: \"Linux\"\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+		"(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+		"image/avif,image/webp,image/apng,*/*;q=0.8,"
+		"application/signed-exchange;v=b3;q=0.7\r\n"
+	"Sec-Fetch-Site: none\r\n"
+	"Sec-Fetch-Mode: navigate\r\n"
+	"Sec-Fetch-User: ?1\r\n"
+	"Sec-Fetch-Dest: document\r\n"
+	"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+	"Accept-Language: en-GB,en-US;q=0.9,en;q=0.8\r\n"
+	"\r\n",
+
+	/* Chrome, subresource with analytics cookies */
+	"GET /static/css/main.4f3b2a1c.css HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"sec-ch-ua-platform: \"Linux\"\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+		"(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+	"sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", "
+		"\"Not-A.Brand\";v=\"99\"\r\n"
+	"sec-ch-ua-mobile: ?0\r\n"
+	"Accept: text/css,*/*;q=0.1\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"Sec-Fetch-Mode: no-cors\r\n"
+	"Sec-Fetch-Dest: style\r\n"
+	"Referer: https://www.example.com/\r\n"
+	"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+	"Accept-Language: en-GB,en-US;q=0.9,en;q=0.8\r\n"
+	"Cookie: _ga=GA1.1.1234567890.1712345678; "
+		"_ga_ABCDEF1234=GS1.1.1712345678.3.1.1712349999.0.0.0; "
+		"_gid=GA1.2.987654321.1712345678; "
+		"_fbp=fb.1.1712345678901.1234567890; "
+		"OptanonConsent=isGpcEnabled=0&datestamp=Mon+Apr+08+2024+"
+		"10%3A21%3A33+GMT%2B0100+(British+Summer+Time)&version=202402.1.0"
+		"&browserGpcFlag=0&isIABGlobal=false&hosts=&consentId=0a1b2c3d-"
+		"4e5f-6a7b-8c9d-0e1f2a3b4c5d&interactionCount=1&landingPath=NotLa"
+		"ndingPage&groups=C0001%3A1%2CC0002%3A1%2CC0003%3A1%2CC0004%3A1; "
+		"OptanonAlertBoxClosed=2024-04-08T09:21:33.123Z; "
+		"session=eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9.eyJzdWIiOiIxMjM0NTY"
+		"3ODkwIiwibmFtZSI6IkpvaG4gRG9lIiwiaWF0IjoxNTE2MjM5MDIyfQ.SflKxwRJ"
+		"SMeKKF2QT4fwpMeJf36POk6yJV_adQssw5c\r\n"
+	"If-None-Match: 8f3b2a1c4d5e6f708192a3b4c5d6e7f801234567\r\n"
+	"\r\n",
+
+	/* Firefox */
+	"GET /blog/2024/04/some-article-title?utm_source=newsletter"
+		"&utm_medium=email HTTP/1.1\r\n"
+	"Host: www.example.org\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) "
+		"Gecko/20100101 Firefox/125.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+		"*/*;q=0.8\r\n"
+	"Accept-Language: en-GB,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+	"DNT: 1\r\n"
+	"Connection: keep-alive\r\n"
+	"Cookie: theme=dark; lang=en; cookieconsent_status=dismiss\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"Sec-Fetch-Dest: document\r\n"
+	"Sec-Fetch-Mode: navigate\r\n"
+	"Sec-Fetch-Site: cross-site\r\n"
+	"Priority: u=0, i\r\n"
+	"\r\n",
+
+	/* Safari, image */
+	"GET /images/hero@2x.jpg HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Accept: image/webp,image/avif,image/jxl,image/heic,"
+		"image/heic-sequence,video/*;q=0.8,image/png,image/svg+xml,"
+		"image/*;q=0.8,*/*;q=0.5\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"Sec-Fetch-Dest: image\r\n"
+	"Accept-Language: en-GB,en;q=0.9\r\n"
+	"Sec-Fetch-Mode: no-cors\r\n"
+	"User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) "
+		"AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.4.1 "
+		"Safari/605.1.15\r\n"
+	"Referer: https://www.example.com/\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n",
+
+	/* Mobile Chrome, video seek */
+	"GET /media/intro.mp4 HTTP/1.1\r\n"
+	"Host: cdn.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"Accept-Encoding: identity;q=1, *;q=0\r\n"
+	"User-Agent: Mozilla/5.0 (Linux; Android 10; K) AppleWebKit/537.36 "
+		"(KHTML, like Gecko) Chrome/124.0.0.0 Mobile Safari/537.36\r\n"
+	"Accept: */*\r\n"
+	"Sec-Fetch-Site: same-site\r\n"
+	"Sec-Fetch-Mode: no-cors\r\n"
+	"Sec-Fetch-Dest: video\r\n"
+	"Referer: https://www.example.com/\r\n"
+	"Accept-Language: en-GB,en-US;q=0.9,en;q=0.8\r\n"
+	"Range: bytes=1048576-\r\n"
+	"If-Range: \"5d8c72a5edda8\"\r\n"
+	"\r\n",
+
+	/* curl */
+	"GET /robots.txt HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"User-Agent: curl/8.5.0\r\n"
+	"Accept: */*\r\n"
+	"\r\n",
+
+	/* old school HTTP/1.0 */
+	"GET /index.html HTTP/1.0\r\n"
+	"Connection: Close\r\n"
+	"\r\n",
+};
+
+const unsigned int bench_nr_corpus =
+	sizeof(bench_corpus)/sizeof(*bench_corpus);
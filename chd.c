@@ -0,0 +1,358 @@
+/*
+ * Compress, Hash and Displace (Belazzougui, Botelho, Dietzfelbinger). Keys
+ * are split in to buckets of about CHD_LAMBDA, then biggest bucket first,
+ * each bucket gets the first displacement pair which lands all of its keys
+ * on free slots. With as many slots as keys there are few free slots left
+ * for the last buckets, so rather than trying every d_add the first key is
+ * put on each free slot in turn. For 14 million URIs building the hash takes
+ * about 15 seconds, on top of the rest of mkroot.
+*/
+#include <compiler.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <fobuf.h>
+#include <vec.h>
+#include <webroot-format.h>
+
+#include "trie.h"
+#include "chd.h"
+
+#define CHD_LAMBDA	5
+#define CHD_MAX_MUL	64 /* displacement multipliers to try per seed */
+#define CHD_MAX_SEED	32
+
+#if 0
+#define dprintf printf
+#else
+#define dprintf(x...) do {} while(0)
+#endif
+
+struct chd {
+	const struct trie_entry	*c_ent;
+	struct webroot_hdisp	*c_disp;
+	struct webroot_hslot	*c_slot;
+	uint32_t		*c_slot_ent; /* entry in each slot */
+	uint64_t		c_strtab_sz;
+	uint32_t		c_num_keys;
+	uint32_t		c_num_buckets;
+	uint32_t		c_seed;
+};
+
+/* scratch space for one attempt at building it */
+struct chd_build {
+	uint64_t		(*b_hash)[2];
+	uint32_t		*b_bucket; /* keys by bucket */
+	uint32_t		*b_start; /* of each bucket in b_bucket */
+	uint32_t		*b_order; /* buckets, biggest first */
+	uint64_t		*b_taken;
+	uint32_t		b_nr_words;
+};
+
+static void build_free(struct chd_build *b)
+{
+	free(b->b_hash);
+	free(b->b_bucket);
+	free(b->b_start);
+	free(b->b_order);
+	free(b->b_taken);
+}
+
+static int build_alloc(struct chd *c, struct chd_build *b)
+{
+	memset(b, 0, sizeof(*b));
+	b->b_hash = malloc(sizeof(*b->b_hash) * c->c_num_keys);
+	b->b_bucket = malloc(sizeof(*b->b_bucket) * c->c_num_keys);
+	b->b_start = malloc(sizeof(*b->b_start) * (c->c_num_buckets + 1));
+	b->b_order = malloc(sizeof(*b->b_order) * c->c_num_buckets);
+	b->b_nr_words = (c->c_num_keys + 63) / 64;
+	b->b_taken = malloc(sizeof(*b->b_taken) * b->b_nr_words);
+	if ( NULL == b->b_hash || NULL == b->b_bucket ||
+			NULL == b->b_start || NULL == b->b_order ||
+			NULL == b->b_taken ) {
+		build_free(b);
+		return 0;
+	}
+	return 1;
+}
+
+static int taken(const struct chd_build *b, uint32_t pos)
+{
+	return !!(b->b_taken[pos >> 6] & (1ULL << (pos & 63)));
+}
+
+/* First free slot at or after pos, the bits past the end are taken */
+static uint32_t next_free(const struct chd_build *b, uint32_t pos)
+{
+	uint32_t w = pos >> 6;
+	uint64_t bits;
+
+	bits = ~b->b_taken[w] & (~0ULL << (pos & 63));
+	while ( !bits ) {
+		if ( ++w >= b->b_nr_words )
+			return b->b_nr_words * 64;
+		bits = ~b->b_taken[w];
+	}
+
+	return (w << 6) + __builtin_ctzll(bits);
+}
+
+/* Counting sort the keys in to their buckets, then the buckets by size */
+static unsigned int sort_buckets(struct chd *c, struct chd_build *b)
+{
+	unsigned int *cnt, max = 0, i;
+	uint32_t *start = b->b_start;
+
+	memset(start, 0, sizeof(*start) * (c->c_num_buckets + 1));
+	for(i = 0; i < c->c_num_keys; i++) {
+		uint32_t bkt;
+
+		bkt = webroot_hash_bucket(b->b_hash[i], c->c_num_buckets);
+		start[bkt + 1]++;
+		if ( start[bkt + 1] > max )
+			max = start[bkt + 1];
+	}
+	for(i = 0; i < c->c_num_buckets; i++)
+		start[i + 1] += start[i];
+
+	/* b_order is borrowed as the fill pointer of each bucket */
+	memcpy(b->b_order, start, sizeof(*start) * c->c_num_buckets);
+	for(i = 0; i < c->c_num_keys; i++) {
+		uint32_t bkt;
+
+		bkt = webroot_hash_bucket(b->b_hash[i], c->c_num_buckets);
+		b->b_bucket[b->b_order[bkt]++] = i;
+	}
+
+	cnt = calloc(max + 2, sizeof(*cnt));
+	if ( NULL == cnt )
+		return 0;
+	for(i = 0; i < c->c_num_buckets; i++)
+		cnt[max - (start[i + 1] - start[i]) + 1]++;
+	for(i = 0; i < max + 1; i++)
+		cnt[i + 1] += cnt[i];
+	for(i = 0; i < c->c_num_buckets; i++)
+		b->b_order[cnt[max - (start[i + 1] - start[i])]++] = i;
+	free(cnt);
+
+	dprintf("%u keys, %u buckets, biggest %u\n",
+		c->c_num_keys, c->c_num_buckets, max);
+	return max;
+}
+
+static int place_bucket(struct chd *c, struct chd_build *b, uint32_t bkt,
+			uint32_t *base)
+{
+	const uint32_t *keys = b->b_bucket + b->b_start[bkt];
+	unsigned int n = b->b_start[bkt + 1] - b->b_start[bkt];
+	struct webroot_hdisp d;
+	uint32_t pos, end;
+	unsigned int i, j;
+
+	d.d_mul = d.d_add = 0;
+	if ( !n )
+		goto out;
+
+	for(d.d_mul = 0; d.d_mul < CHD_MAX_MUL; d.d_mul++) {
+		d.d_add = 0;
+		for(i = 0; i < n; i++) {
+			base[i] = webroot_hash_slot(b->b_hash[keys[i]], &d,
+							c->c_num_keys);
+			for(j = 0; j < i; j++)
+				if ( base[j] == base[i] )
+					break;
+			if ( j < i )
+				break;
+		}
+		if ( i < n )
+			continue;
+
+		/* All keys move together with d_add, so put the first one
+		 * on each free slot in turn, and see if the rest fit.
+		 */
+		for(pos = base[0], end = c->c_num_keys; ; pos++) {
+			if ( pos < end )
+				pos = next_free(b, pos);
+			if ( pos >= end ) {
+				if ( end != c->c_num_keys || !base[0] )
+					break;
+				pos = next_free(b, 0);
+				end = base[0];
+				if ( pos >= end )
+					break;
+			}
+
+			d.d_add = (pos >= base[0]) ? pos - base[0] :
+					pos + c->c_num_keys - base[0];
+			for(i = 1; i < n; i++) {
+				uint32_t p = base[i] + d.d_add;
+				if ( p >= c->c_num_keys )
+					p -= c->c_num_keys;
+				if ( taken(b, p) )
+					break;
+			}
+			if ( i == n )
+				goto found;
+		}
+	}
+
+	return 0;
+
+found:
+	for(i = 0; i < n; i++) {
+		const struct trie_entry *e = c->c_ent + keys[i];
+
+		pos = base[i] + d.d_add;
+		if ( pos >= c->c_num_keys )
+			pos -= c->c_num_keys;
+		assert(pos == webroot_hash_slot(b->b_hash[keys[i]], &d,
+							c->c_num_keys));
+		b->b_taken[pos >> 6] |= (1ULL << (pos & 63));
+		c->c_slot[pos].s_oid = e->t_oid;
+		c->c_slot[pos].s_len = e->t_str.v_len;
+		c->c_slot[pos].s_tag = webroot_hash_tag(b->b_hash[keys[i]]);
+		c->c_slot_ent[pos] = keys[i];
+	}
+out:
+	c->c_disp[bkt] = d;
+	return 1;
+}
+
+static int try_seed(struct chd *c, struct chd_build *b)
+{
+	unsigned int i, max;
+	uint32_t *base;
+	int ret = 0;
+
+	for(i = 0; i < c->c_num_keys; i++) {
+		const struct trie_entry *e = c->c_ent + i;
+		webroot_hash(e->t_str.v_ptr, e->t_str.v_len,
+				c->c_seed, b->b_hash[i]);
+	}
+
+	max = sort_buckets(c, b);
+	if ( !max )
+		return 0;
+
+	base = malloc(sizeof(*base) * max);
+	if ( NULL == base )
+		return 0;
+
+	memset(b->b_taken, 0, sizeof(*b->b_taken) * b->b_nr_words);
+	if ( c->c_num_keys & 63 )
+		b->b_taken[b->b_nr_words - 1] = ~0ULL << (c->c_num_keys & 63);
+	for(i = 0; i < c->c_num_buckets; i++) {
+		if ( !place_bucket(c, b, b->b_order[i], base) ) {
+			dprintf("seed %u: stuck on bucket %u of %u\n",
+				c->c_seed, i, c->c_num_buckets);
+			goto out;
+		}
+	}
+
+	ret = 1;
+out:
+	free(base);
+	return ret;
+}
+
+chd_t chd_new(const struct trie_entry *ent, unsigned int cnt)
+{
+	struct chd_build b;
+	struct chd *c;
+	unsigned int i;
+
+	c = calloc(1, sizeof(*c));
+	if ( NULL == c )
+		return NULL;
+
+	c->c_ent = ent;
+	c->c_num_keys = cnt;
+	c->c_num_buckets = (cnt + CHD_LAMBDA - 1) / CHD_LAMBDA;
+
+	for(i = 0; i < cnt; i++) {
+		if ( ent[i].t_str.v_len > 0xffff )
+			goto out_free;
+		c->c_strtab_sz += ent[i].t_str.v_len;
+	}
+
+	if ( !cnt )
+		return c;
+
+	c->c_disp = malloc(sizeof(*c->c_disp) * c->c_num_buckets);
+	c->c_slot = malloc(sizeof(*c->c_slot) * c->c_num_keys);
+	c->c_slot_ent = malloc(sizeof(*c->c_slot_ent) * c->c_num_keys);
+	if ( NULL == c->c_disp || NULL == c->c_slot || NULL == c->c_slot_ent )
+		goto out_free;
+
+	if ( !build_alloc(c, &b) )
+		goto out_free;
+
+	for(c->c_seed = 0; c->c_seed < CHD_MAX_SEED; c->c_seed++) {
+		if ( try_seed(c, &b) ) {
+			build_free(&b);
+			return c;
+		}
+	}
+
+	build_free(&b);
+out_free:
+	chd_free(c);
+	return NULL;
+}
+
+/* Keys go in slot order */
+int chd_write(chd_t c, fobuf_t buf)
+{
+	struct webroot_hslot s;
+	uint64_t off = 0;
+	uint32_t i;
+
+	if ( !fobuf_write(buf, c->c_disp,
+			sizeof(*c->c_disp) * c->c_num_buckets) )
+		return 0;
+
+	for(i = 0; i < c->c_num_keys; i++) {
+		s = c->c_slot[i];
+		s.s_key = off;
+		off += s.s_len;
+		if ( !fobuf_write(buf, &s, sizeof(s)) )
+			return 0;
+	}
+
+	for(i = 0; i < c->c_num_keys; i++) {
+		const struct trie_entry *e = c->c_ent + c->c_slot_ent[i];
+		if ( !fobuf_write(buf, e->t_str.v_ptr, e->t_str.v_len) )
+			return 0;
+	}
+
+	return 1;
+}
+
+uint64_t chd_size(chd_t c)
+{
+	return sizeof(struct webroot_hdisp) * c->c_num_buckets +
+		sizeof(struct webroot_hslot) * c->c_num_keys +
+		c->c_strtab_sz;
+}
+
+void chd_header(chd_t c, struct webroot_hdr *hdr)
+{
+	hdr->h_hash_seed = c->c_seed;
+	hdr->h_hash_buckets = c->c_num_buckets;
+	hdr->h_hash_keys = c->c_num_keys;
+	hdr->h_hash_strtab_sz = c->c_strtab_sz;
+}
+
+void chd_free(chd_t c)
+{
+	if ( c ) {
+		free(c->c_disp);
+		free(c->c_slot);
+		free(c->c_slot_ent);
+		free(c);
+	}
+}
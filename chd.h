@@ -0,0 +1,14 @@
+#ifndef _CHD_H
+#define _CHD_H
+
+/* Builds the minimal perfect hash of the trie entries for mkroot, see
+ * webroot-format.h for the layout.
+ */
+typedef struct chd *chd_t;
+chd_t chd_new(const struct trie_entry *t, unsigned int cnt);
+int chd_write(chd_t c, fobuf_t buf);
+uint64_t chd_size(chd_t c);
+void chd_header(chd_t c, struct webroot_hdr *hdr);
+void chd_free(chd_t c);
+
+#endif /* _CHD_H */
@@ -0,0 +1,172 @@
+/*
+ * Precompression for mkroot. Everything is done at the highest level the
+ * encoder has since it only happens once, when the webroot is built.
+*/
+#include <compiler.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <webroot-format.h>
+#include "compress.h"
+
+static const char * const enc_names[WEBROOT_NUM_ENC] = {
+	[WEBROOT_ENC_GZIP] = "gzip",
+	[WEBROOT_ENC_BROTLI] = "br",
+	[WEBROOT_ENC_ZSTD] = "zstd",
+};
+
+const char *compress_name(unsigned int enc)
+{
+	assert(enc < WEBROOT_NUM_ENC);
+	return enc_names[enc];
+}
+
+int compress_available(unsigned int enc)
+{
+	switch(enc) {
+	case WEBROOT_ENC_GZIP:
+		return 1;
+#ifdef HAVE_BROTLI
+	case WEBROOT_ENC_BROTLI:
+		return 1;
+#endif
+#ifdef HAVE_ZSTD
+	case WEBROOT_ENC_ZSTD:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+static int do_gzip(const uint8_t *in, size_t len, uint8_t *out, size_t *sz)
+{
+	z_stream z;
+	int ret;
+
+	memset(&z, 0, sizeof(z));
+
+	/* +16 for a gzip header rather than zlib */
+	if ( deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16,
+				9, Z_DEFAULT_STRATEGY) != Z_OK )
+		return 0;
+
+	z.next_in = (Bytef *)in;
+	z.avail_in = len;
+	z.next_out = out;
+	z.avail_out = *sz;
+
+	ret = deflate(&z, Z_FINISH);
+	*sz = z.total_out;
+	deflateEnd(&z);
+
+	return (ret == Z_STREAM_END);
+}
+
+static size_t gzip_bound(size_t len)
+{
+	z_stream z;
+	size_t ret;
+
+	memset(&z, 0, sizeof(z));
+	if ( deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16,
+				9, Z_DEFAULT_STRATEGY) != Z_OK )
+		return 0;
+	ret = deflateBound(&z, len);
+	deflateEnd(&z);
+	return ret;
+}
+
+#ifdef HAVE_BROTLI
+static int do_brotli(const uint8_t *in, size_t len, uint8_t *out, size_t *sz)
+{
+	return BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW,
+					BROTLI_MODE_TEXT, len, in, sz, out);
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int do_zstd(const uint8_t *in, size_t len, uint8_t *out, size_t *sz)
+{
+	size_t ret;
+
+	ret = ZSTD_compress(out, *sz, in, len, ZSTD_maxCLevel());
+	if ( ZSTD_isError(ret) )
+		return 0;
+
+	*sz = ret;
+	return 1;
+}
+#endif
+
+/* On success *out is malloc'd and owned by the caller */
+int compress_buf(unsigned int enc, const uint8_t *in, size_t len,
+			uint8_t **out, size_t *out_len)
+{
+	uint8_t *buf;
+	size_t sz;
+	int ret;
+
+	switch(enc) {
+	case WEBROOT_ENC_GZIP:
+		sz = gzip_bound(len);
+		break;
+#ifdef HAVE_BROTLI
+	case WEBROOT_ENC_BROTLI:
+		sz = BrotliEncoderMaxCompressedSize(len);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case WEBROOT_ENC_ZSTD:
+		sz = ZSTD_compressBound(len);
+		break;
+#endif
+	default:
+		return 0;
+	}
+
+	if ( !sz )
+		return 0;
+
+	buf = malloc(sz);
+	if ( NULL == buf )
+		return 0;
+
+	switch(enc) {
+	case WEBROOT_ENC_GZIP:
+		ret = do_gzip(in, len, buf, &sz);
+		break;
+#ifdef HAVE_BROTLI
+	case WEBROOT_ENC_BROTLI:
+		ret = do_brotli(in, len, buf, &sz);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case WEBROOT_ENC_ZSTD:
+		ret = do_zstd(in, len, buf, &sz);
+		break;
+#endif
+	default:
+		abort();
+	}
+
+	if ( !ret ) {
+		free(buf);
+		return 0;
+	}
+
+	*out = buf;
+	*out_len = sz;
+	return 1;
+}
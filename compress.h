@@ -0,0 +1,12 @@
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+/* Build time compression for mkroot, encodings are the WEBROOT_ENC_*
+ * indices. Encoders which weren't built in just fail.
+ */
+const char *compress_name(unsigned int enc);
+int compress_available(unsigned int enc);
+int compress_buf(unsigned int enc, const uint8_t *in, size_t len,
+			uint8_t **out, size_t *out_len);
+
+#endif /* _COMPRESS_H */
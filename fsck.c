@@ -16,6 +16,8 @@
 #include "webroot-common.h"
 
 static const char *cmd = "fsckroot";
+static unsigned int hash_bad;
+static unsigned int trie_bad;
 
 static void calc_hists(struct _webroot *r,
 			const struct trie_dedge *re,
@@ -87,10 +89,23 @@ static size_t dump_root(struct _webroot *r, const char *outfn)
 static void print_obj(struct _webroot *r, const struct trie_dedge *re,
 			const char *uri, size_t uri_len)
 {
+	struct ro_vec v;
+
 	printf("%.*s\n", (int)uri_len, uri);
 	printf(" - OID: %u (%s)\n",
 		re->re_oid,
 		(re->re_oid < r->r_num_redirect) ? "redir" : "file");
+
+	v.v_ptr = (const uint8_t *)uri;
+	v.v_len = uri_len;
+	if ( webroot_hash_query(r, &v) != re->re_oid ) {
+		printf(" - MISSING FROM HASH\n");
+		hash_bad++;
+	}
+	if ( webroot_trie_query(r, &v) != re->re_oid ) {
+		printf(" - TRIE SEARCH MISSED\n");
+		trie_bad++;
+	}
 	if ( re->re_oid < r->r_num_redirect ) {
 		const struct webroot_redirect *redir;
 
@@ -105,14 +120,27 @@ static void print_obj(struct _webroot *r, const struct trie_dedge *re,
 		}
 	}else{
 		const struct webroot_file *file;
+		const struct webroot_enc *e;
+		unsigned int i;
 
 		file = r->r_file + (re->re_oid - r->r_num_redirect);
 
 		printf(" - mime type: %.*s\n",
 			(int)file->f_type_len,
 			(char *)r->r_map + file->f_type);
-		printf(" - off/len = 0x%"PRIx64" 0x%"PRIx64"\n",
-			file->f_off, file->f_len);
+		printf(" - off/len = 0x%"PRIx64" 0x%"PRIx64"%s\n",
+			file->f_off, file->f_len,
+			(file->f_off + file->f_len <= r->r_map_sz) ?
+				" (inline)" : "");
+		for(i = 0; i < WEBROOT_NUM_ENC; i++) {
+			e = &file->f_enc[i];
+			if ( !e->e_len )
+				continue;
+			printf(" - encoding %u: off/len = 0x%"PRIx64" 0x%"PRIx64
+				"%s\n", i, e->e_off, e->e_len,
+				(e->e_off + e->e_len <= r->r_map_sz) ?
+					" (inline)" : "");
+		}
 	}
 }
 
@@ -210,6 +238,10 @@ static int do_fsck(const char *fn)
 	buf = malloc(max_len);
 	print_deets(r, buf);
 	free(buf);
+	printf("%s: hash: %u keys in %u buckets, %u bad\n", cmd,
+		r->r_hash_keys, r->r_hash_buckets, hash_bad);
+	printf("%s: trie: %u edges, %u bad\n", cmd,
+		r->r_num_edges, trie_bad);
 
 	dump_hist(hist, max_len);
 	dump_fanout_hist(hist2, 0x100);
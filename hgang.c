@@ -9,8 +9,38 @@
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <list.h>
 #include <hgang.h>
 
+/* Slabs are a power of two in size and aligned to it, so that the slab
+ * an object belongs to is just a mask away. They're mapped directly so
+ * that reclaimed slabs really go back to the system.
+ */
+#define HGANG_MIN_SLAB		(1UL << 16)
+
+/* Huge slabs are at least this, and aligned to it so that THP can back
+ * them with whole huge pages
+ */
+#define HGANG_HUGE_SIZE		(1UL << 21)
+
+/* Partially used slabs are kept in buckets by occupancy so that the
+ * fullest can be allocated from first, leaving the others to drain.
+ */
+#define HGANG_NR_BUCKETS	4
+#define SLAB_EMPTY		HGANG_NR_BUCKETS
+#define SLAB_FULL		(HGANG_NR_BUCKETS + 1)
+#define SLAB_CUR		(HGANG_NR_BUCKETS + 2)
+
+/* Shared pools: objects per magazine, magazines per pool (only free
+ * objects are ever in magazines so this is plenty) and pools per process
+ * since each thread has a magazine cache for every shared pool.
+ */
+#define HGANG_MAG_ROUNDS	64
+#define HGANG_MAX_MAGS		(1U << 16)
+#define HGANG_MAX_SHARED	32
+
 #if MPOOL_POISON
 #define POISON(ptr, len) memset(ptr, MPOOL_POISON_PATTERN, len)
 #else
@@ -23,16 +53,75 @@
 struct _hgang {
 	/** Object size. */
 	size_t obj_size;
-	/** Pointer to next available object */
-	uint8_t *next_obj;
-	/** Size of each block including hgang_hdr overhead. */
+	/** Size of each slab including hgang_hdr overhead, power of 2. */
 	size_t slab_size;
-	/** List of blocks. */
-	struct _hgang_hdr *slabs;
-	/** List of free'd objects. */
-	void *free;
+	/** Objects per slab. */
+	unsigned long per_slab;
+	/** Slab being allocated from, it's on none of the lists. */
+	struct _hgang_hdr *cur;
+	/** Partially used slabs, by occupancy. */
+	struct list_head partial[HGANG_NR_BUCKETS];
+	/** Completely free slabs, most recently emptied first. */
+	struct list_head empty;
+	/** Every slab. */
+	struct list_head slabs;
+	/** Number of objects handed out by the slab layer. */
+	unsigned long nr_live;
+	/** Number of slabs. */
+	unsigned long nr_slabs;
+	/** Number of slabs on the empty list, and its low water mark since
+	 * the last reclaim.
+	 */
+	unsigned long nr_empty;
+	unsigned long empty_low;
+	/** HGANG_HUGETLB / HGANG_THP / HGANG_SHARED */
+	unsigned int flags;
+
+	/* The rest is only for HGANG_SHARED pools */
+
+	/** Index in to each threads magazine caches. */
+	unsigned int id;
+	/** Depot stacks of full and empty magazines, tag:index. */
+	uint64_t full;
+	uint64_t empty_mags;
+	/** Objects and magazines in the full depot, and the low water mark
+	 * of the latter since the last reclaim.
+	 */
+	unsigned long nr_depot;
+	unsigned long nr_full;
+	unsigned long full_low;
+	/** Protects the slab layer and magazine allocation. */
+	pthread_mutex_t lock;
+	/** Every magazine ever allocated, by index (0 is unused). */
+	struct hgang_mag **mags;
+	unsigned int nr_mags;
+};
+
+/** A magazine is a stack of free objects which moves between a threads
+ * cache and the pools depot as a unit.
+ * \ingroup g_hgang
+ */
+struct hgang_mag {
+	/** Index of the magazine below this one in a depot stack. */
+	uint32_t m_next;
+	/** Our own index in the pools mags table. */
+	uint32_t m_idx;
+	/** Number of objects in m_obj. */
+	unsigned int m_rounds;
+	void *m_obj[HGANG_MAG_ROUNDS];
+};
+
+/** Each thread has two magazines per shared pool, so a run of frees
+ * after a run of allocations doesn't go straight to the depot.
+ * \ingroup g_hgang
+ */
+struct hgang_cache {
+	struct hgang_mag *c_loaded;
+	struct hgang_mag *c_prev;
 };
 
+static __thread struct hgang_cache caches[HGANG_MAX_SHARED];
+static unsigned int nr_shared;
 
 size_t hgang_object_size(hgang_t h)
 {
@@ -43,15 +132,32 @@ size_t hgang_object_size(hgang_t h)
  * \ingroup g_hgang
 */
 struct _hgang_hdr {
-	/** Pointer to next item in the list */
-	struct _hgang_hdr *next;
+	/** On one of the partial lists or the empty list */
+	struct list_head list;
+	/** On the list of all slabs */
+	struct list_head all;
+	/** Free'd objects in this slab. */
+	void *free;
+	/** Next never used object */
+	uint8_t *carve;
+	/** Objects in use. */
+	unsigned int nr_used;
+	/** Bucket, or SLAB_EMPTY / SLAB_FULL / SLAB_CUR */
+	unsigned short state;
+	/** Slab came from hugetlbfs. */
+	unsigned short hugetlb;
 	/** Data up to the slab_size */
 	uint8_t data[0];
 };
 
+/* Objects start a cache line in, so those whose size is a multiple of a
+ * cache line each start on one
+ */
+#define HGANG_HDR_SIZE	((sizeof(struct _hgang_hdr) + 63) & ~63UL)
+
 static uint8_t *first_byte(struct _hgang_hdr *hdr)
 {
-	return (uint8_t *)hdr + sizeof(*hdr);
+	return (uint8_t *)hdr + HGANG_HDR_SIZE;
 }
 
 static uint8_t *last_byte(struct _hgang *h, struct _hgang_hdr *hdr)
@@ -59,28 +165,40 @@ static uint8_t *last_byte(struct _hgang *h, struct _hgang_hdr *hdr)
 	return (uint8_t *)hdr + h->slab_size;
 }
 
-static int obj_in_slab(struct _hgang *h, struct _hgang_hdr *hdr, void *obj)
+static struct _hgang_hdr *slab_of(struct _hgang *h, void *obj)
 {
-	return ((uint8_t *)obj >= first_byte(hdr) &&
-		(uint8_t *)obj + h->obj_size <= last_byte(h, hdr));
+	return (struct _hgang_hdr *)((uintptr_t)obj & ~(h->slab_size - 1));
 }
 
-/** Initialise an hgang.
+static size_t pow2(size_t sz)
+{
+	size_t ret;
+
+	for(ret = 1; ret < sz; ret <<= 1)
+		/* nothing */;
+	return ret;
+}
+
+/** Initialise an hgang with huge page backed slabs.
  * \ingroup g_hgang
  *
- * @param h an hgang structure to use
  * @param obj_size size of objects to allocate
  * @param slab_size size of slabs in number of objects (set to zero for auto)
+ * @param flags HGANG_HUGETLB, HGANG_THP and/or HGANG_SHARED
  *
- * Creates a new empty memory pool descriptor with the passed values
- * set. The resultant hgang has no alignment requirement set.
+ * As hgang_new() but slabs are rounded up to a multiple of the huge page
+ * size. HGANG_HUGETLB tries MAP_HUGETLB first, which only works if huge
+ * pages were reserved, and otherwise falls back to asking for transparent
+ * huge pages with madvise().
  *
  * @return zero on error, non-zero for success
- * (may only return 0 if the obj_size is 0).
  */
-hgang_t hgang_new(size_t obj_size, unsigned slab_size)
+hgang_t hgang_new_flags(size_t obj_size, unsigned slab_size,
+			unsigned int flags)
 {
 	struct _hgang *h;
+	unsigned int i;
+	size_t min;
 
 	/* quick sanity checks */
 	if ( obj_size == 0 )
@@ -95,88 +213,591 @@ hgang_t hgang_new(size_t obj_size, unsigned slab_size)
 
 	h->obj_size = obj_size;
 
-	if ( slab_size ) {
-		h->slab_size = sizeof(struct _hgang_hdr) + 
-				(slab_size * obj_size);
-	}else{
-		/* XXX: totally arbitrary... */
-		if ( h->obj_size < 8192 ) {
-			h->slab_size = sizeof(struct _hgang_hdr) +
-				(8192 - (8192 % h->obj_size));
-		}else{
-			h->slab_size = sizeof(struct _hgang_hdr) +
-				(4 * h->obj_size);
+	/* slab_size is a minimum, whatever's left over after rounding up
+	 * just means more objects per slab
+	 */
+	if ( 0 == slab_size )
+		slab_size = 4;
+
+	min = (flags & (HGANG_HUGETLB|HGANG_THP)) ?
+		HGANG_HUGE_SIZE : HGANG_MIN_SLAB;
+	h->slab_size = pow2(HGANG_HDR_SIZE + slab_size * obj_size);
+	if ( h->slab_size < min )
+		h->slab_size = min;
+	h->per_slab = (h->slab_size - HGANG_HDR_SIZE) / obj_size;
+
+	h->cur = NULL;
+	for(i = 0; i < HGANG_NR_BUCKETS; i++)
+		INIT_LIST_HEAD(&h->partial[i]);
+	INIT_LIST_HEAD(&h->empty);
+	INIT_LIST_HEAD(&h->slabs);
+	h->nr_live = 0;
+	h->nr_slabs = 0;
+	h->nr_empty = 0;
+	h->empty_low = 0;
+	h->flags = flags;
+
+	if ( flags & HGANG_SHARED ) {
+		h->id = __atomic_fetch_add(&nr_shared, 1, __ATOMIC_RELAXED);
+		if ( h->id >= HGANG_MAX_SHARED )
+			goto out_free;
+
+		/* only the pages which get used get faulted in */
+		h->mags = calloc(HGANG_MAX_MAGS, sizeof(*h->mags));
+		if ( NULL == h->mags )
+			goto out_free;
+
+		h->full = h->empty_mags = 0;
+		h->nr_depot = 0;
+		h->nr_full = 0;
+		h->full_low = 0;
+		h->nr_mags = 0;
+		pthread_mutex_init(&h->lock, NULL);
+	}
+
+	return h;
+
+out_free:
+	free(h);
+	return NULL;
+}
+
+/** Initialise an hgang.
+ * \ingroup g_hgang
+ *
+ * @param obj_size size of objects to allocate
+ * @param slab_size size of slabs in number of objects (set to zero for auto)
+ *
+ * Creates a new empty memory pool descriptor with the passed values
+ * set. The resultant hgang has no alignment requirement set.
+ *
+ * @return zero on error, non-zero for success
+ * (may only return 0 if the obj_size is 0).
+ */
+hgang_t hgang_new(size_t obj_size, unsigned slab_size)
+{
+	return hgang_new_flags(obj_size, slab_size, 0);
+}
+
+/* Mapping aligned to its own size, if the kernel doesn't hand us one
+ * then map twice as much and trim either side
+ */
+static uint8_t *map_aligned(size_t sz, int flags)
+{
+	uint8_t *ptr, *ret;
+	size_t len;
+
+	flags |= MAP_PRIVATE|MAP_ANONYMOUS;
+
+	ptr = mmap(NULL, sz, PROT_READ|PROT_WRITE, flags, -1, 0);
+	if ( ptr == MAP_FAILED )
+		return NULL;
+	if ( 0 == ((uintptr_t)ptr & (sz - 1)) )
+		return ptr;
+	munmap(ptr, sz);
+
+	len = sz * 2;
+	ptr = mmap(NULL, len, PROT_READ|PROT_WRITE, flags, -1, 0);
+	if ( ptr == MAP_FAILED )
+		return NULL;
+
+	ret = (uint8_t *)(((uintptr_t)ptr + sz - 1) & ~(sz - 1));
+	if ( ret > ptr )
+		munmap(ptr, ret - ptr);
+	if ( ret + sz < ptr + len )
+		munmap(ret + sz, (ptr + len) - (ret + sz));
+	return ret;
+}
+
+static struct _hgang_hdr *slab_alloc(struct _hgang *h)
+{
+	struct _hgang_hdr *hdr;
+
+#ifdef MAP_HUGETLB
+	if ( h->flags & HGANG_HUGETLB ) {
+		hdr = (struct _hgang_hdr *)map_aligned(h->slab_size,
+							MAP_HUGETLB);
+		if ( hdr ) {
+			hdr->hugetlb = 1;
+			return hdr;
 		}
 	}
+#endif
 
-	h->slabs = NULL;
-	h->free = NULL;
+	hdr = (struct _hgang_hdr *)map_aligned(h->slab_size, 0);
+	if ( NULL == hdr )
+		return NULL;
 
-	return h;
+#ifdef MADV_HUGEPAGE
+	/* not fatal, THP may be disabled */
+	if ( h->flags & (HGANG_HUGETLB|HGANG_THP) )
+		madvise(hdr, h->slab_size, MADV_HUGEPAGE);
+#endif
+	hdr->hugetlb = 0;
+	return hdr;
+}
+
+static void slab_free(struct _hgang *h, struct _hgang_hdr *hdr)
+{
+	list_del(&hdr->all);
+	h->nr_slabs--;
+	munmap(hdr, h->slab_size);
+}
+
+static unsigned int slab_bucket(struct _hgang *h, struct _hgang_hdr *hdr)
+{
+	return (hdr->nr_used * HGANG_NR_BUCKETS) / h->per_slab;
+}
+
+/* Next slab to carve up, the fullest of the partial ones, then the most
+ * recently emptied, only then a new one.
+ */
+static struct _hgang_hdr *slab_next(struct _hgang *h)
+{
+	struct _hgang_hdr *hdr;
+	int i;
+
+	for(i = HGANG_NR_BUCKETS - 1; i >= 0; i--) {
+		if ( !list_empty(&h->partial[i]) ) {
+			hdr = list_entry(h->partial[i].next,
+					struct _hgang_hdr, list);
+			list_del(&hdr->list);
+			return hdr;
+		}
+	}
+
+	if ( !list_empty(&h->empty) ) {
+		hdr = list_entry(h->empty.next, struct _hgang_hdr, list);
+		list_del(&hdr->list);
+		if ( --h->nr_empty < h->empty_low )
+			h->empty_low = h->nr_empty;
+		return hdr;
+	}
+
+	hdr = slab_alloc(h);
+	if ( hdr == NULL )
+		return NULL;
+
+	POISON(first_byte(hdr), h->slab_size - HGANG_HDR_SIZE);
+
+	hdr->free = NULL;
+	hdr->carve = first_byte(hdr);
+	hdr->nr_used = 0;
+	list_add(&hdr->all, &h->slabs);
+	h->nr_slabs++;
+	return hdr;
 }
 
 /** Slow path for hgang allocations.
  * \ingroup g_hgang
  * @param h a valid hgang structure returned from hgang_init()
  *
- * Allocate a new object, returns NULL if out of memory. Note that this
+ * The current slab is full, so move on to another. Note that this
  * is the slow path, the fast path for common case (no new allocation
- * needed) is handled in the inline fucntion hgang_alloc() in hgang.hdr.
+ * needed) is handled in slab_get().
  *
  * @return a new object
  */
 static void *hgang_alloc_slow(struct _hgang *h)
 {
 	struct _hgang_hdr *hdr;
-	void *ptr, *ret;
-	
-	hdr = ptr = malloc(h->slab_size);
-	if ( hdr == NULL )
-		return NULL;
+	void *ret;
 
-	POISON(ptr, h->slab_size);
+	if ( h->cur )
+		h->cur->state = SLAB_FULL;
 
-	/* Set first object */
-	ret = ptr + sizeof(*hdr);
-	h->next_obj = ret + h->obj_size;
+	hdr = h->cur = slab_next(h);
+	if ( NULL == hdr )
+		return NULL;
 
-	/* prepend to slab list */
-	hdr->next = h->slabs;
-	h->slabs = hdr;
+	hdr->state = SLAB_CUR;
+	if ( hdr->free ) {
+		ret = hdr->free;
+		hdr->free = *(void **)ret;
+	}else{
+		ret = hdr->carve;
+		hdr->carve += h->obj_size;
+	}
 
+	hdr->nr_used++;
+	h->nr_live++;
 	return ret;
 }
 
+/* Object from the slab layer, for shared pools the lock must be held */
+static void *slab_get(struct _hgang *h)
+{
+	struct _hgang_hdr *hdr = h->cur;
+	void *ret;
+
+	if ( likely(hdr) ) {
+		if ( hdr->free ) {
+			ret = hdr->free;
+			hdr->free = *(void **)ret;
+		}else if ( hdr->carve + h->obj_size <= last_byte(h, hdr) ) {
+			ret = hdr->carve;
+			hdr->carve += h->obj_size;
+		}else{
+			return hgang_alloc_slow(h);
+		}
+		hdr->nr_used++;
+		h->nr_live++;
+		return ret;
+	}
+
+	return hgang_alloc_slow(h);
+}
+
+static void slab_put(struct _hgang *h, void *obj)
+{
+	struct _hgang_hdr *hdr = slab_of(h, obj);
+	unsigned int b;
+
+	assert(hdr->nr_used);
+	*(void **)obj = hdr->free;
+	hdr->free = obj;
+	hdr->nr_used--;
+	h->nr_live--;
+
+	if ( hdr->state == SLAB_CUR )
+		return;
+
+	if ( 0 == hdr->nr_used ) {
+		if ( hdr->state != SLAB_FULL )
+			list_del(&hdr->list);
+		list_add(&hdr->list, &h->empty);
+		hdr->state = SLAB_EMPTY;
+		h->nr_empty++;
+		return;
+	}
+
+	b = slab_bucket(h, hdr);
+	if ( b == hdr->state )
+		return;
+
+	if ( hdr->state != SLAB_FULL )
+		list_del(&hdr->list);
+	list_add(&hdr->list, &h->partial[b]);
+	hdr->state = b;
+}
+
+/* Lock-free stacks of magazines, ABA is dealt with by a tag which is
+ * bumped on every push and pop. Magazines are never freed until the pool
+ * is, so it's always safe to look at m_next of a stale head.
+ */
+static void depot_push(struct _hgang *h, uint64_t *stack,
+			struct hgang_mag *m)
+{
+	uint64_t old, new;
+
+	old = __atomic_load_n(stack, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&m->m_next, (uint32_t)old, __ATOMIC_RELAXED);
+		new = (((old >> 32) + 1) << 32) | m->m_idx;
+	}while ( !__atomic_compare_exchange_n(stack, &old, new, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED) );
+}
+
+static struct hgang_mag *depot_pop(struct _hgang *h, uint64_t *stack)
+{
+	struct hgang_mag *m;
+	uint64_t old, new;
+
+	old = __atomic_load_n(stack, __ATOMIC_ACQUIRE);
+	do {
+		if ( 0 == (uint32_t)old )
+			return NULL;
+		m = __atomic_load_n(&h->mags[(uint32_t)old], __ATOMIC_ACQUIRE);
+		new = (((old >> 32) + 1) << 32) |
+			__atomic_load_n(&m->m_next, __ATOMIC_RELAXED);
+	}while ( !__atomic_compare_exchange_n(stack, &old, new, 1,
+					__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE) );
+
+	return m;
+}
+
+static void depot_put_full(struct _hgang *h, struct hgang_mag *m)
+{
+	__atomic_fetch_add(&h->nr_depot, m->m_rounds, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->nr_full, 1, __ATOMIC_RELAXED);
+	depot_push(h, &h->full, m);
+}
+
+static struct hgang_mag *depot_get_full(struct _hgang *h)
+{
+	unsigned long nr, low;
+	struct hgang_mag *m;
+
+	m = depot_pop(h, &h->full);
+	if ( NULL == m )
+		return NULL;
+
+	__atomic_fetch_sub(&h->nr_depot, m->m_rounds, __ATOMIC_RELAXED);
+	nr = __atomic_sub_fetch(&h->nr_full, 1, __ATOMIC_RELAXED);
+
+	/* only approximate, it's a hint for reclaim */
+	low = __atomic_load_n(&h->full_low, __ATOMIC_RELAXED);
+	while ( nr < low && !__atomic_compare_exchange_n(&h->full_low,
+				&low, nr, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+		/* nothing */;
+	return m;
+}
+
+/* An empty magazine from the depot, or a new one */
+static struct hgang_mag *mag_empty(struct _hgang *h)
+{
+	struct hgang_mag *m;
+
+	m = depot_pop(h, &h->empty_mags);
+	if ( m )
+		return m;
+
+	pthread_mutex_lock(&h->lock);
+	if ( h->nr_mags + 1 < HGANG_MAX_MAGS ) {
+		m = malloc(sizeof(*m));
+		if ( m ) {
+			m->m_idx = ++h->nr_mags;
+			m->m_rounds = 0;
+			__atomic_store_n(&h->mags[m->m_idx], m,
+						__ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&h->lock);
+	return m;
+}
+
+static void mag_stash(struct _hgang *h, struct hgang_mag *m)
+{
+	if ( NULL == m )
+		return;
+	if ( m->m_rounds )
+		depot_put_full(h, m);
+	else
+		depot_push(h, &h->empty_mags, m);
+}
+
+static void *mag_alloc_slow(struct _hgang *h, struct hgang_cache *c)
+{
+	struct hgang_mag *m;
+	void *ret;
+
+	/* previous magazine has objects, swap */
+	if ( c->c_prev && c->c_prev->m_rounds ) {
+		m = c->c_loaded;
+		c->c_loaded = c->c_prev;
+		c->c_prev = m;
+		return c->c_loaded->m_obj[--c->c_loaded->m_rounds];
+	}
+
+	/* trade an empty magazine for a full one from the depot */
+	m = depot_get_full(h);
+	if ( m ) {
+		mag_stash(h, c->c_prev);
+		c->c_prev = c->c_loaded;
+		c->c_loaded = m;
+		return m->m_obj[--m->m_rounds];
+	}
+
+	/* depot is dry, fill a magazine from the slabs in one go */
+	if ( NULL == c->c_loaded ) {
+		c->c_loaded = mag_empty(h);
+		if ( NULL == c->c_loaded ) {
+			pthread_mutex_lock(&h->lock);
+			ret = slab_get(h);
+			pthread_mutex_unlock(&h->lock);
+			return ret;
+		}
+	}
+
+	m = c->c_loaded;
+	pthread_mutex_lock(&h->lock);
+	while ( m->m_rounds < HGANG_MAG_ROUNDS ) {
+		ret = slab_get(h);
+		if ( NULL == ret )
+			break;
+		m->m_obj[m->m_rounds++] = ret;
+	}
+	pthread_mutex_unlock(&h->lock);
+
+	if ( 0 == m->m_rounds )
+		return NULL;
+	return m->m_obj[--m->m_rounds];
+}
+
+static void mag_free_slow(struct _hgang *h, struct hgang_cache *c, void *obj)
+{
+	struct hgang_mag *m;
+
+	/* previous magazine has room, swap */
+	if ( c->c_prev && c->c_prev->m_rounds < HGANG_MAG_ROUNDS ) {
+		m = c->c_loaded;
+		c->c_loaded = c->c_prev;
+		c->c_prev = m;
+		c->c_loaded->m_obj[c->c_loaded->m_rounds++] = obj;
+		return;
+	}
+
+	/* both full, the previous one goes to the depot */
+	m = mag_empty(h);
+	if ( m ) {
+		mag_stash(h, c->c_prev);
+		c->c_prev = c->c_loaded;
+		c->c_loaded = m;
+		m->m_obj[m->m_rounds++] = obj;
+		return;
+	}
+
+	pthread_mutex_lock(&h->lock);
+	slab_put(h, obj);
+	pthread_mutex_unlock(&h->lock);
+}
+
 /** Allocate an object from an hgang.
  * \ingroup g_hgang
  * @param h a valid hgang structure returned from hgang_init()
  *
  * Allocate a new object, returns NULL if out of memory. This is the
- * fast path. It never calls malloc directly.
+ * fast path. It never calls malloc directly, for shared pools it's a pop
+ * off the threads loaded magazine.
  *
  * @return a new object
  */
 void *hgang_alloc(hgang_t h)
 {
-	/* Try a free'd object first */
-	if ( unlikely(h->free) ) {
-		void *ret = h->free;
-		h->free = *(void **)h->free;
-		return ret;
+	if ( h->flags & HGANG_SHARED ) {
+		struct hgang_cache *c = &caches[h->id];
+		struct hgang_mag *m = c->c_loaded;
+
+		if ( likely(m && m->m_rounds) )
+			return m->m_obj[--m->m_rounds];
+		return mag_alloc_slow(h, c);
 	}
 
-	/* If there is space in the slab, allocate */
-	if ( h->slabs != NULL ) {
-		void *ret = h->next_obj;
+	return slab_get(h);
+}
 
-		if ( obj_in_slab(h, h->slabs, ret) ) {
-			h->next_obj += h->obj_size;
-			return ret;
+/** Free an individual object.
+ * \ingroup g_hgang
+ * @param h hgang object that obj was allocated from.
+ * @param obj pointer to object to free.
+ *
+ * When an hgang object is free'd it goes back on its slabs free list,
+ * once every object in a slab is free the slab can be reclaimed. Objects
+ * from a shared pool may be returned by any thread, they go in to that
+ * threads magazine.
+*/
+void hgang_return(hgang_t h, void *obj)
+{
+	if ( unlikely(obj == NULL) )
+		return;
+	assert(h->obj_size >= sizeof(void *));
+	POISON(obj, h->obj_size);
+
+	if ( h->flags & HGANG_SHARED ) {
+		struct hgang_cache *c = &caches[h->id];
+		struct hgang_mag *m = c->c_loaded;
+
+		if ( likely(m && m->m_rounds < HGANG_MAG_ROUNDS) ) {
+			m->m_obj[m->m_rounds++] = obj;
+			return;
 		}
+		mag_free_slow(h, c, obj);
+		return;
 	}
 
-	/* Otherwise go to slow path (calls malloc) */
-	return hgang_alloc_slow(h);
+	slab_put(h, obj);
+}
+
+/** Give this threads cached objects back to a shared pool.
+ * \ingroup g_hgang
+ * @param h hgang object
+ *
+ * For threads which are exiting or going idle, otherwise the objects in
+ * their magazines are only available to them.
+ */
+void hgang_flush(hgang_t h)
+{
+	struct hgang_cache *c;
+
+	if ( !(h->flags & HGANG_SHARED) )
+		return;
+
+	c = &caches[h->id];
+	mag_stash(h, c->c_loaded);
+	mag_stash(h, c->c_prev);
+	c->c_loaded = c->c_prev = NULL;
+}
+
+/* Empty magazines which sat in the depot for a whole interval back in to
+ * the slabs, so that the slabs can drain
+ */
+static void depot_drain(struct _hgang *h)
+{
+	unsigned long n;
+	struct hgang_mag *m;
+
+	n = __atomic_load_n(&h->full_low, __ATOMIC_RELAXED);
+	n = (n + 1) / 2;
+
+	while ( n-- && (m = depot_pop(h, &h->full)) ) {
+		__atomic_fetch_sub(&h->nr_depot, m->m_rounds,
+					__ATOMIC_RELAXED);
+		__atomic_fetch_sub(&h->nr_full, 1, __ATOMIC_RELAXED);
+
+		pthread_mutex_lock(&h->lock);
+		while ( m->m_rounds )
+			slab_put(h, m->m_obj[--m->m_rounds]);
+		pthread_mutex_unlock(&h->lock);
+
+		depot_push(h, &h->empty_mags, m);
+	}
+
+	__atomic_store_n(&h->full_low,
+			__atomic_load_n(&h->nr_full, __ATOMIC_RELAXED),
+			__ATOMIC_RELAXED);
+}
+
+/** Give memory back after a spike.
+ * \ingroup g_hgang
+ * @param h hgang object
+ *
+ * Meant to be called periodically, or when idle. Only slabs which stayed
+ * empty since the last call are candidates and only half of them are
+ * unmapped each time, so that a pool which is cycling doesn't thrash and
+ * one which has shrunk gets there in a few calls. For shared pools, full
+ * magazines which weren't needed in the depot are taken apart first.
+ *
+ * @return number of slabs released
+ */
+unsigned long hgang_reclaim(hgang_t h)
+{
+	struct _hgang_hdr *hdr;
+	unsigned long n, ret = 0;
+
+	if ( h->flags & HGANG_SHARED ) {
+		depot_drain(h);
+		pthread_mutex_lock(&h->lock);
+	}
+
+	n = (h->empty_low + 1) / 2;
+	if ( n > h->nr_empty )
+		n = h->nr_empty;
+
+	/* least recently emptied first */
+	for(; ret < n; ret++) {
+		hdr = list_entry(h->empty.prev, struct _hgang_hdr, list);
+		list_del(&hdr->list);
+		h->nr_empty--;
+		slab_free(h, hdr);
+	}
+
+	h->empty_low = h->nr_empty;
+
+	if ( h->flags & HGANG_SHARED )
+		pthread_mutex_unlock(&h->lock);
+
+	return ret;
 }
 
 /** Destroy an hgang object.
@@ -184,41 +805,67 @@ void *hgang_alloc(hgang_t h)
  * @param h a valid hgang structure returned from hgang_init()
  *
  * Frees up all allocated memory from the #hgang and resets all members
- * to invalid values.
+ * to invalid values. Other threads must be finished with a shared pool.
  */
 void hgang_free(hgang_t h)
 {
-	struct _hgang_hdr *hdr, *f;
+	struct _hgang_hdr *hdr, *tmp;
+	unsigned int i;
 
 	if ( NULL == h )
 		return;
 
-	for(hdr = h->slabs; (f = hdr); free(f)) {
-		hdr = hdr->next;
-		POISON(f, h->slab_size);
+	if ( h->flags & HGANG_SHARED ) {
+		caches[h->id].c_loaded = caches[h->id].c_prev = NULL;
+		for(i = 1; i <= h->nr_mags; i++)
+			free(h->mags[i]);
+		free(h->mags);
+		pthread_mutex_destroy(&h->lock);
+	}
+
+	list_for_each_entry_safe(hdr, tmp, &h->slabs, all) {
+		POISON(first_byte(hdr), h->slab_size - HGANG_HDR_SIZE);
+		slab_free(h, hdr);
 	}
 
 	POISON(h, sizeof(*h));
 	free(h);
 }
 
-/** Free an individual object.
+/** Report how much memory a pool is holding.
  * \ingroup g_hgang
- * @param h hgang object that obj was allocated from.
- * @param obj pointer to object to free.
  *
- * When an hgang object is free'd it's added to a linked list of
- * free objects which hgang_alloc() scans before trying to commit
- * further memory resources.
-*/
-void hgang_return(hgang_t h, void *obj)
+ * @param h hgang object
+ * @param st filled in with the current numbers
+ *
+ * Free objects are those in the slabs which aren't handed out, everything
+ * else is live. For shared pools objects in the depot are counted as
+ * cached, those sitting in threads magazines count as live.
+ */
+void hgang_stats(hgang_t h, struct hgang_stats *st)
 {
-	if ( unlikely(obj == NULL) )
-		return;
-	assert(h->obj_size >= sizeof(void *));
-	POISON(obj, h->obj_size);
-	*(void **)obj = h->free;
-	h->free = obj;
+	struct _hgang_hdr *hdr;
+
+	if ( h->flags & HGANG_SHARED )
+		pthread_mutex_lock(&h->lock);
+
+	memset(st, 0, sizeof(*st));
+	st->hs_obj_size = h->obj_size;
+	st->hs_slab_size = h->slab_size;
+	st->hs_slabs = h->nr_slabs;
+	st->hs_empty = h->nr_empty;
+	st->hs_free = h->nr_slabs * h->per_slab - h->nr_live;
+
+	if ( h->flags & HGANG_SHARED )
+		st->hs_cached = __atomic_load_n(&h->nr_depot, __ATOMIC_RELAXED);
+
+	st->hs_live = h->nr_live - st->hs_cached;
+
+	list_for_each_entry(hdr, &h->slabs, all)
+		st->hs_hugetlb += hdr->hugetlb;
+
+	if ( h->flags & HGANG_SHARED )
+		pthread_mutex_unlock(&h->lock);
 }
 
 /** Allocate an object initialized to zero.
@@ -258,22 +905,10 @@ int hgang_foreach(hgang_t h, hgang_cb_t cb, void *priv)
 	struct _hgang_hdr *hdr;
 	uint8_t *obj;
 
-	if ( NULL == h->slabs )
-		return 1;
-	
-	assert(NULL != h->free);
-	
-	hdr = h->slabs;
-	for(obj = first_byte(hdr);
-			(uint8_t *)obj + h->obj_size <= h->next_obj; 
-			obj += h->obj_size) {
-		if ( !(*cb)(priv, obj) )
-			return 0;
-	}
+	assert(!(h->flags & HGANG_SHARED));
 
-	for(hdr = hdr->next; hdr; hdr = hdr->next) {
-		for(obj = first_byte(hdr);
-				obj_in_slab(h, hdr, obj);
+	list_for_each_entry(hdr, &h->slabs, all) {
+		for(obj = first_byte(hdr); obj < hdr->carve;
 				obj += h->obj_size) {
 			if ( !(*cb)(priv, obj) )
 				return 0;
@@ -1,55 +1,123 @@
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <ashttpd.h>
 #include <hgang.h>
 #include <ashttpd-buf.h>
 
+/* Shared by all threads, buffers can be freed on a different thread
+ * to the one which allocated them. Apart from the naked ones each object
+ * is the struct http_buf followed by its data.
+ */
 static hgang_t h_req;
 static hgang_t h_res;
 static hgang_t h_dat;
 static hgang_t h_buf;
+static hgang_t h_class[HTTP_BUF_NR_CLASSES];
 
-static void __attribute__((constructor)) http_conn_ctor(void)
+static pthread_once_t buf_once = PTHREAD_ONCE_INIT;
+static int buf_ok;
+
+/* per-thread so that do_init() only ever sees what its own caller set */
+static __thread unsigned int (*buf_flags)(const char *name);
+
+static const char * const names[] = {"bufs", "req", "res", "data",
+					"4K", "16K", "64K"};
+
+static unsigned int flags_for(const char *name)
 {
-	h_buf = hgang_new(sizeof(struct http_buf), 256);
-	h_res = hgang_new(HTTP_MAX_REQ, 16);
-	h_req = hgang_new(HTTP_MAX_RESP, 8);
-	h_dat = hgang_new(HTTP_DATA_BUFFER, 32);
+	return ((buf_flags) ? buf_flags(name) : 0) | HGANG_SHARED;
 }
 
-static struct http_buf *do_alloc(hgang_t alloc)
+static void do_init(void)
 {
-	struct http_buf *b;
-	size_t sz;
+	unsigned int i;
 
-	b = hgang_alloc(h_buf);
-	if ( NULL == b )
+	h_buf = hgang_new_flags(sizeof(struct http_buf), 256,
+				flags_for("bufs"));
+	h_req = hgang_new_flags(sizeof(struct http_buf) + HTTP_MAX_REQ,
+				16, flags_for("req"));
+	h_res = hgang_new_flags(sizeof(struct http_buf) + HTTP_MAX_RESP,
+				8, flags_for("res"));
+	h_dat = hgang_new_flags(sizeof(struct http_buf) + HTTP_DATA_BUFFER,
+				32, flags_for("data"));
+	if ( NULL == h_buf || NULL == h_res ||
+			NULL == h_req || NULL == h_dat )
+		goto err;
+
+	for(i = 0; i < HTTP_BUF_NR_CLASSES; i++) {
+		h_class[i] = hgang_new_flags(sizeof(struct http_buf) +
+						(HTTP_BUF_MIN << (2 * i)),
+						0, flags_for(names[4 + i]));
+		if ( NULL == h_class[i] )
+			goto err;
+	}
+
+	buf_ok = 1;
+	return;
+err:
+	hgang_free(h_buf);
+	hgang_free(h_res);
+	hgang_free(h_req);
+	hgang_free(h_dat);
+	for(i = 0; i < HTTP_BUF_NR_CLASSES; i++)
+		hgang_free(h_class[i]);
+}
+
+/* Must be called from each thread before it allocates any buffers, the
+ * pools are only created by the first, with any extra hgang flags for
+ * each pool by name from pool_flags.
+ */
+int buf_init(unsigned int (*pool_flags)(const char *name))
+{
+	buf_flags = pool_flags;
+	pthread_once(&buf_once, do_init);
+	return buf_ok;
+}
+
+/* For stats */
+hgang_t buf_pool(unsigned int idx, const char **name)
+{
+	hgang_t pools[] = {h_buf, h_req, h_res, h_dat,
+				h_class[0], h_class[1], h_class[2]};
+
+	if ( idx >= sizeof(pools)/sizeof(*pools) )
 		return NULL;
+	*name = names[idx];
+	return pools[idx];
+}
+
+/* For buffers which live inside something else */
+void buf_attach(struct http_buf *b, uint8_t *base, size_t sz)
+{
+	b->b_base = base;
+	b->b_end = base + sz;
+	b->b_read = base;
+	b->b_write = base;
+}
+
+static struct http_buf *do_alloc(hgang_t alloc)
+{
+	struct http_buf *b;
 
 	if ( NULL == alloc )
-		return b;
+		return hgang_alloc(h_buf);
 
-	b->b_base = hgang_alloc(alloc);
-	if ( NULL == b->b_base ) {
-		hgang_return(h_buf, b);
+	b = hgang_alloc(alloc);
+	if ( NULL == b )
 		return NULL;
-	}
 
-	sz = hgang_object_size(alloc);
-	b->b_end = b->b_base + sz;
-	b->b_read = b->b_base;
-	b->b_write = b->b_base;
+	buf_attach(b, (uint8_t *)(b + 1),
+			hgang_object_size(alloc) - sizeof(*b));
 	return b;
 }
 
 static void do_free(hgang_t alloc, struct http_buf *b)
 {
-	if ( b ) {
-		if ( alloc )
-			hgang_return(alloc, b->b_base);
-		hgang_return(h_buf, b);
-	}
+	if ( b )
+		hgang_return((alloc) ? alloc : h_buf, b);
 }
 
 struct http_buf *buf_alloc_naked(void)
@@ -92,6 +160,38 @@ void buf_free_data(struct http_buf *b)
 	do_free(h_dat, b);
 }
 
+static unsigned int size_class(size_t sz)
+{
+	unsigned int i;
+
+	for(i = 0; i < HTTP_BUF_NR_CLASSES; i++)
+		if ( sz <= (size_t)(HTTP_BUF_MIN << (2 * i)) )
+			break;
+	return i;
+}
+
+/* From the smallest size class that holds sz bytes */
+struct http_buf *buf_alloc(size_t sz)
+{
+	unsigned int i;
+
+	i = size_class(sz);
+	if ( i >= HTTP_BUF_NR_CLASSES )
+		return NULL;
+	return do_alloc(h_class[i]);
+}
+
+void buf_free(struct http_buf *b)
+{
+	if ( b )
+		do_free(h_class[size_class(buf_size(b))], b);
+}
+
+size_t buf_size(const struct http_buf *b)
+{
+	return b->b_end - b->b_base;
+}
+
 const uint8_t *buf_read(struct http_buf *b, size_t *sz)
 {
 	assert(b->b_write >= b->b_read);
@@ -138,3 +238,100 @@ void buf_reset(struct http_buf *b)
 	b->b_read = b->b_base;
 	b->b_write = b->b_base + res;
 }
+
+void chain_init(struct http_chain *c, struct http_buf *first)
+{
+	c->c_buf[0] = first;
+	c->c_head = 0;
+	c->c_nr = 1;
+}
+
+/* Room for at least len contiguous bytes at the end, adding a buffer if
+ * the last one is too full. Returns NULL if the chain can't get that big.
+ */
+uint8_t *chain_write(struct http_chain *c, size_t len, size_t *sz)
+{
+	struct http_buf *b = c->c_buf[c->c_nr - 1];
+	uint8_t *ptr;
+
+	ptr = buf_write(b, sz);
+	if ( ptr && *sz >= len )
+		return ptr;
+
+	if ( c->c_nr >= HTTP_CHAIN_MAX )
+		return NULL;
+
+	b = buf_alloc(len);
+	if ( NULL == b )
+		return NULL;
+
+	c->c_buf[c->c_nr++] = b;
+	return buf_write(b, sz);
+}
+
+void chain_done_write(struct http_chain *c, size_t sz)
+{
+	buf_done_write(c->c_buf[c->c_nr - 1], sz);
+}
+
+/* Whatever's waiting to be read, as an iovec per buffer */
+unsigned int chain_read(struct http_chain *c, struct iovec *iov,
+			unsigned int max, size_t *sz)
+{
+	unsigned int i, n;
+	size_t len;
+
+	for(*sz = 0, n = 0, i = c->c_head; i < c->c_nr && n < max; i++) {
+		iov[n].iov_base = (void *)buf_read(c->c_buf[i], &len);
+		iov[n].iov_len = len;
+		if ( len ) {
+			*sz += len;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+size_t chain_done_read(struct http_chain *c, size_t sz)
+{
+	size_t len;
+
+	while ( c->c_head < c->c_nr ) {
+		buf_read(c->c_buf[c->c_head], &len);
+		if ( sz < len ) {
+			buf_done_read(c->c_buf[c->c_head], sz);
+			break;
+		}
+
+		buf_done_read(c->c_buf[c->c_head], len);
+		sz -= len;
+
+		/* keep the last one to write in to */
+		if ( c->c_head + 1 == c->c_nr )
+			break;
+		c->c_head++;
+	}
+
+	return chain_len(c);
+}
+
+size_t chain_len(const struct http_chain *c)
+{
+	unsigned int i;
+	size_t ret = 0;
+
+	for(i = c->c_head; i < c->c_nr; i++)
+		ret += c->c_buf[i]->b_write - c->c_buf[i]->b_read;
+	return ret;
+}
+
+/* Back to just the first buffer, empty */
+void chain_reset(struct http_chain *c)
+{
+	while ( c->c_nr > 1 )
+		buf_free(c->c_buf[--c->c_nr]);
+	c->c_head = 0;
+	buf_done_read(c->c_buf[0], c->c_buf[0]->b_write - c->c_buf[0]->b_read);
+	buf_reset(c->c_buf[0]);
+}
@@ -1,4 +1,5 @@
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -13,45 +14,130 @@
 #include <ashttpd-fio.h>
 #include <http-parse.h>
 #include <http-req.h>
+#include <http-fmt.h>
 #include <nbio-inotify.h>
+#include <nbio-timer.h>
 #include <normalize.h>
 #include <hgang.h>
+#include <tls.h>
 #include <signal.h>
+#include <pthread.h>
 
 #define HTTP_CONN_REQUEST	0
 /* FIXME: gobble any POST data */
 #define HTTP_CONN_HEADER	1
 #define HTTP_CONN_DATA		2
 #define HTTP_CONN_DEAD		3
+#define HTTP_CONN_HANDSHAKE	4 /* TLS, before the kernel takes over */
+/* Multipart byteranges responses go out one part at a time, the
+ * boundary and header for each part are queued as the previous one
+ * completes.
+ */
+struct http_ranges {
+	struct ro_vec	rg_mime;
+	off_t		rg_base;
+	uint64_t	rg_flen;
+	unsigned int	rg_cur;
+	unsigned int	rg_nr;
+	char		rg_boundary[17];
+	struct http_range rg_range[HTTP_MAX_RANGES];
+};
+
+/* Everything to do with requests in progress, only attached to the conn
+ * while there's something buffered or a response is going out so that an
+ * idle keep-alive conn is just the nbio, its timer and a few pointers.
+ * The smallest header buffers are carved out of the same allocation, a
+ * request which outgrows its buffer moves to a bigger one and responses
+ * chain on more buffers as needed.
+ */
+struct http_xfer {
+	struct http_buf	*x_req;
+	struct http_chain x_res;
+
+	const uint8_t	*x_rptr;
+	webroot_t	x_webroot;
+	void		*x_io_priv;
+	struct http_ranges *x_ranges;
+	off_t		x_data_off;
+	size_t		x_data_len;
+	unsigned short	x_io_state;
+	unsigned char	x_rstate;
+	unsigned char	x_conn_close;
+
+	struct http_buf	x_req_inl;
+	struct http_buf	x_res_inl;
+	uint8_t		x_req_buf[HTTP_MAX_REQ];
+	uint8_t		x_res_buf[HTTP_MAX_RESP];
+};
+
 struct _http_conn {
 	struct nbio	h_nbio;
 	unsigned char	h_state;
-	unsigned char	h_rstate;
-	unsigned short	h_io_state;
+	unsigned char	h_flags;
+	struct nbio_timer h_timer;
 
 	struct http_listener *h_owner;
-	webroot_t	h_webroot;
-
-	const uint8_t	*h_rptr;
-	struct http_buf	*h_req;
-	struct http_buf	*h_res;
-
-	void		*h_io_priv;
-	off_t		h_data_off;
-	size_t		h_data_len;
-
-	unsigned int	h_conn_close;
+	tls_t		h_tls; /* only if the kernel couldn't do rx */
+	void		*h_sock_priv; /* I/O model, for the life of the conn */
+	struct http_xfer *h_x;
 };
 
+/* Deadlines in msec: whole request header from the first byte, time
+ * between requests on a keep-alive conn, and time a response can go
+ * without any progress before the peer is considered gone.
+ */
+#define HTTP_TIMEOUT_HEADER	10000
+#define HTTP_TIMEOUT_IDLE	30000
+#define HTTP_TIMEOUT_WRITE	30000
+
+/* How often slabs which have stayed empty are given back */
+#define HTTP_RECLAIM_INTERVAL	10000
+
+/* h_flags */
+#define HTTP_CONN_RING		(1 << 0) /* eventloop does recv/send for us */
+#define HTTP_CONN_RX_EOF	(1 << 1) /* peer shut down, close when done */
+#define HTTP_CONN_TX_BUSY	(1 << 2) /* header send in flight */
+#define HTTP_CONN_MORE		(1 << 3) /* pipelined request waiting */
+#define HTTP_CONN_INLINE	(1 << 4) /* body is in the webroot index */
+
+/* Return code for response handlers when a pipelined response won't fit
+ * in behind the ones already queued, the request is left for next time.
+ * Anything which isn't HTTP_DEFER is guaranteed to fit in HTTP_RESP_ROOM.
+ */
+#define HTTP_DEFER		(-1)
+#define HTTP_RESP_ROOM		256
+
 #if 0
 #define dprintf printf
 #else
 #define dprintf(x...) do {} while(0)
 #endif
 
+/* Per-thread protocol state, each iothread has its own set of
+ * connections and there's no sharing between them. The stats are
+ * linked on a global list so that the totals can be reported.
+ */
+struct http_stats {
+	struct list_head	s_list;
+	struct iothread		*s_iothread;
+	uint64_t		s_reqs;
+	unsigned int		s_concurrency;
+};
+
 struct http_fio *fio_current;
-static unsigned int concurrency;
+static __thread struct http_stats stats;
+static __thread uint64_t boundary_seq;
+static __thread struct list_head oomq;
+
+/* shared by all iothreads */
 static hgang_t conns;
+static hgang_t xfers;
+static hgang_t ranges;
+static pthread_once_t pools_once = PTHREAD_ONCE_INIT;
+static struct nbio_timer reclaim_timer;
+
+static LIST_HEAD(all_stats);
+static pthread_mutex_t all_stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static const char * const resp400 =
 	"HTTP/1.1 400 Bad Request\r\n"
@@ -91,6 +177,11 @@ static const char * const resp404 =
 	"\r\n"
 	"<html><head><title>Fuck Off</title></head>"
 	"<body><h1>y u no find?</h1></body></html>";
+static const char * const resp416 =
+	"HTTP/1.1 416 Range Not Satisfiable\r\n"
+	"Content-Range: bytes */%"PRIu64"\r\n"
+	"Content-Length: 0\r\n"
+	"\r\n";
 static const char * const resp501 =
 	"HTTP/1.1 501 Method Not Implemented\r\n"
 	"Content-Type: text/html\r\n"
@@ -106,8 +197,6 @@ static const char * const resp501 =
 #define _io_abort	(*fio_current->abort)
 #define _io_fini	(*fio_current->fini)
 
-static LIST_HEAD(oomq);
-
 static void wake_listeners(struct iothread *t)
 {
 	struct nbio *io, *tmp;
@@ -132,21 +221,32 @@ static void http_kill(struct iothread *t, struct _http_conn *h)
 		return;
 
 	dprintf("Connection killed\n");
+	nbio_timer_disarm(t, &h->h_timer);
+	if ( fio_current->close )
+		(*fio_current->close)(t, h);
+	tls_free(h->h_tls);
+	h->h_tls = NULL;
 	close(h->h_nbio.fd);
 	h->h_nbio.fd = -1;
-	assert(concurrency);
-	--concurrency;
+	assert(stats.s_concurrency);
+	--stats.s_concurrency;
 	if ( !list_empty(&oomq) )
 		wake_listeners(t);
 
-	buf_free_req(h->h_req);
+	if ( h->h_x && h->h_x->x_ranges ) {
+		hgang_return(ranges, h->h_x->x_ranges);
+		h->h_x->x_ranges = NULL;
+	}
 
+	/* the xfer goes in the dtor, a ring send may still be using it */
 	switch(h->h_state) {
+	case HTTP_CONN_HANDSHAKE:
 	case HTTP_CONN_REQUEST:
-		assert(h->h_res == NULL);
 		break;
 	case HTTP_CONN_HEADER:
-		buf_free_res(h->h_res);
+		/* no I/O model involved, dtor drops the webroot */
+		if ( h->h_flags & HTTP_CONN_INLINE )
+			break;
 		/* fall through */
 	case HTTP_CONN_DATA:
 		_io_abort(h);
@@ -159,37 +259,148 @@ static void http_kill(struct iothread *t, struct _http_conn *h)
 	nbio_del(t, &h->h_nbio);
 }
 
+static struct http_xfer *xfer_new(void)
+{
+	struct http_xfer *x;
+
+	x = hgang_alloc(xfers);
+	if ( NULL == x )
+		return NULL;
+
+	/* not the buffers, they're big and about to be overwritten */
+	memset(x, 0, offsetof(struct http_xfer, x_req_buf));
+	buf_attach(&x->x_req_inl, x->x_req_buf, sizeof(x->x_req_buf));
+	buf_attach(&x->x_res_inl, x->x_res_buf, sizeof(x->x_res_buf));
+	x->x_req = &x->x_req_inl;
+	chain_init(&x->x_res, &x->x_res_inl);
+	x->x_rptr = x->x_req->b_base;
+	x->x_rstate = RSTATE_INITIAL;
+	return x;
+}
+
+static void xfer_free(struct http_xfer *x)
+{
+	if ( x ) {
+		assert(NULL == x->x_ranges);
+		if ( x->x_req != &x->x_req_inl )
+			buf_free(x->x_req);
+		chain_reset(&x->x_res);
+		webroot_unref(x->x_webroot);
+		hgang_return(xfers, x);
+	}
+}
+
+/* Request header doesn't fit, move it to a buffer from the next size
+ * class up. Returns 0 once it's as big as it gets.
+ */
+static int xfer_req_grow(struct http_xfer *x)
+{
+	const uint8_t *ptr;
+	struct http_buf *b;
+	size_t sz;
+
+	b = buf_alloc(buf_size(x->x_req) + 1);
+	if ( NULL == b )
+		return 0;
+
+	ptr = buf_read(x->x_req, &sz);
+	memcpy(b->b_base, ptr, sz);
+	buf_done_write(b, sz);
+	x->x_rptr = b->b_base + (x->x_rptr - ptr);
+
+	if ( x->x_req != &x->x_req_inl )
+		buf_free(x->x_req);
+	x->x_req = b;
+	return 1;
+}
+
+/* Back to the small buffer once the big request is dealt with */
+static void xfer_req_shrink(struct http_xfer *x)
+{
+	size_t sz;
+
+	if ( x->x_req == &x->x_req_inl )
+		return;
+
+	buf_read(x->x_req, &sz);
+	if ( sz )
+		return;
+
+	buf_free(x->x_req);
+	buf_attach(&x->x_req_inl, x->x_req_buf, sizeof(x->x_req_buf));
+	x->x_req = &x->x_req_inl;
+	x->x_rptr = x->x_req->b_base;
+}
+
+/* Nothing buffered, the xfer can go back to the pool until the next
+ * request turns up
+ */
+static void http_xfer_drop(struct _http_conn *h)
+{
+	size_t sz;
+
+	if ( NULL == h->h_x )
+		return;
+
+	buf_read(h->h_x->x_req, &sz);
+	if ( 0 == sz ) {
+		xfer_free(h->h_x);
+		h->h_x = NULL;
+	}
+}
+
+/* Back to waiting for a request, if part of the next one is already
+ * buffered then the header clock is running, otherwise we're idle.
+ */
+static void http_conn_idle(struct iothread *t, struct _http_conn *h)
+{
+	http_xfer_drop(h);
+	nbio_timer_arm(t, &h->h_timer, (h->h_x) ?
+			HTTP_TIMEOUT_HEADER : HTTP_TIMEOUT_IDLE);
+}
+
 size_t http_conn_data(http_conn_t h, int *fd, off_t *off)
 {
 	/* AIO read may run in parallel with transmission of header */
 	assert(h->h_state == HTTP_CONN_DATA || h->h_state == HTTP_CONN_HEADER);
 
 	if ( fd )
-		*fd = webroot_get_fd(h->h_webroot);
+		*fd = webroot_get_fd(h->h_x->x_webroot);
 	if ( off )
-		*off = h->h_data_off;
-	return h->h_data_len;
+		*off = h->h_x->x_data_off;
+	return h->h_x->x_data_len;
 }
 
-size_t http_conn_data_read(http_conn_t h, size_t len)
+size_t http_conn_data_read(struct iothread *t, http_conn_t h, size_t len)
 {
 	assert(h->h_state == HTTP_CONN_DATA || h->h_state == HTTP_CONN_HEADER);
-	assert(len <= h->h_data_len);
-	h->h_data_len -= len;
-	h->h_data_off += len;
-	return h->h_data_len;
+	assert(len <= h->h_x->x_data_len);
+	nbio_timer_arm(t, &h->h_timer, HTTP_TIMEOUT_WRITE);
+	h->h_x->x_data_len -= len;
+	h->h_x->x_data_off += len;
+	return h->h_x->x_data_len;
 }
 
+static int http_next_part(struct iothread *t, struct _http_conn *h);
+
 void http_conn_data_complete(struct iothread *t, http_conn_t h)
 {
 	assert(h->h_state == HTTP_CONN_DATA);
-	assert(0 == h->h_data_len);
+	assert(0 == h->h_x->x_data_len);
+	if ( h->h_x->x_ranges ) {
+		if ( !http_next_part(t, h) )
+			http_kill(t, h);
+		return;
+	}
 	h->h_state = HTTP_CONN_REQUEST;
 	nbio_set_wait(t, &h->h_nbio, NBIO_READ);
-	webroot_unref(h->h_webroot);
-	h->h_webroot = NULL;
-	if ( h->h_conn_close )
+	webroot_unref(h->h_x->x_webroot);
+	h->h_x->x_webroot = NULL;
+	if ( h->h_x->x_conn_close ) {
 		http_kill(t, h);
+		return;
+	}
+	http_conn_idle(t, h);
 }
 
 void http_conn_abort(struct iothread *t, http_conn_t h)
@@ -202,23 +413,48 @@ void *http_conn_get_priv(http_conn_t h, unsigned short *state)
 {
 	assert(h->h_state == HTTP_CONN_DATA || h->h_state == HTTP_CONN_HEADER);
 	if ( state )
-		*state = h->h_io_state;
-	return h->h_io_priv;
+		*state = h->h_x->x_io_state;
+	return h->h_x->x_io_priv;
 }
 
 void http_conn_set_priv(http_conn_t h, void *priv, unsigned short state)
 {
 	assert(h->h_state == HTTP_CONN_DATA || h->h_state == HTTP_CONN_HEADER);
-	h->h_io_state = state;
-	h->h_io_priv = priv;
+	h->h_x->x_io_state = state;
+	h->h_x->x_io_priv = priv;
 }
 
-int http_conn_socket(http_conn_t h)
+/* Unlike the io priv this stays put between requests */
+void *http_conn_get_sock_priv(http_conn_t h)
+{
+	return h->h_sock_priv;
+}
+
+void http_conn_set_sock_priv(http_conn_t h, void *priv)
+{
+	h->h_sock_priv = priv;
+}
+
+webroot_t http_conn_webroot(http_conn_t h)
 {
 	assert(h->h_state == HTTP_CONN_DATA || h->h_state == HTTP_CONN_HEADER);
+	return h->h_x->x_webroot;
+}
+
+int http_conn_socket(http_conn_t h)
+{
+	assert(h->h_state != HTTP_CONN_DEAD);
 	return h->h_nbio.fd;
 }
 
+/* Something else follows this data, another response or the next part
+ * of this one, so don't push out a partial segment at the end of it
+ */
+int http_conn_pipelined(http_conn_t h)
+{
+	return (h->h_flags & HTTP_CONN_MORE) || h->h_x->x_ranges;
+}
+
 void http_conn_inactive(struct iothread *t, http_conn_t h)
 {
 	assert(h->h_state == HTTP_CONN_DATA || h->h_state == HTTP_CONN_HEADER);
@@ -257,19 +493,120 @@ void http_conn_wake(struct iothread *t, struct list_head *waitq,
 	}
 }
 
+/* Account for len bytes of the header having been sent */
+static int http_hdr_sent(struct iothread *t, struct _http_conn *h, size_t len)
+{
+	nbio_timer_arm(t, &h->h_timer, HTTP_TIMEOUT_WRITE);
+	if ( chain_done_read(&h->h_x->x_res, len) )
+		return 1;
+
+	chain_reset(&h->h_x->x_res);
+
+	if ( h->h_x->x_data_len ) {
+		dprintf("Header done, %zu bytes of data\n",
+			h->h_x->x_data_len);
+		h->h_state = HTTP_CONN_DATA;
+		if ( h->h_flags & HTTP_CONN_RING )
+			nbio_set_wait(t, &h->h_nbio, NBIO_WRITE);
+	}else{
+		if ( h->h_x->x_conn_close )
+			return 0;
+		nbio_set_wait(t, &h->h_nbio, NBIO_READ);
+		h->h_state = HTTP_CONN_REQUEST;
+		http_conn_idle(t, h);
+	}
+
+	return 1;
+}
+
+/* Header and inline body in one go. The ring only takes single buffer
+ * sends so this is always done directly.
+ */
+static int http_write_inline(struct iothread *t, struct _http_conn *h)
+{
+	struct iovec iov[HTTP_CHAIN_MAX + 1];
+	struct msghdr msg;
+	int flags = MSG_NOSIGNAL;
+	unsigned int n;
+	ssize_t ret;
+	size_t sz;
+
+	if ( h->h_flags & HTTP_CONN_MORE )
+		flags |= MSG_MORE;
+
+	n = chain_read(&h->h_x->x_res, iov, HTTP_CHAIN_MAX, &sz);
+	iov[n].iov_base = (void *)webroot_inline(h->h_x->x_webroot,
+					h->h_x->x_data_off, h->h_x->x_data_len);
+	iov[n].iov_len = h->h_x->x_data_len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n + 1;
+
+	ret = sendmsg(h->h_nbio.fd, &msg, flags);
+	if ( ret < 0 && errno == EAGAIN ) {
+		nbio_inactive(t, &h->h_nbio, NBIO_WRITE);
+		return 1;
+	}else if ( ret <= 0 ) {
+		return 0;
+	}
+
+	if ( (size_t)ret < sz ) {
+		chain_done_read(&h->h_x->x_res, ret);
+		nbio_timer_arm(t, &h->h_timer, HTTP_TIMEOUT_WRITE);
+		return 1;
+	}
+
+	chain_done_read(&h->h_x->x_res, sz);
+	if ( http_conn_data_read(t, h, ret - sz) )
+		return 1;
+
+	h->h_flags &= ~HTTP_CONN_INLINE;
+	webroot_unref(h->h_x->x_webroot);
+	h->h_x->x_webroot = NULL;
+	return http_hdr_sent(t, h, 0);
+}
+
 static int http_write_hdr(struct iothread *t, struct _http_conn *h)
 {
-	const uint8_t *ptr;
+	struct iovec iov[HTTP_CHAIN_MAX];
+	struct msghdr msg;
+	unsigned int n;
 	size_t sz;
 	ssize_t ret;
 	int flags = MSG_NOSIGNAL;
 
-	if ( h->h_data_len )
+	/* woken up (eg. by AIO) while the header is still in flight */
+	if ( h->h_flags & HTTP_CONN_TX_BUSY ) {
+		nbio_set_wait(t, &h->h_nbio, 0);
+		return 1;
+	}
+
+	if ( h->h_flags & HTTP_CONN_INLINE )
+		return http_write_inline(t, h);
+
+	if ( h->h_x->x_data_len || (h->h_flags & HTTP_CONN_MORE) )
 		flags |= MSG_MORE;
 
-	ptr = buf_read(h->h_res, &sz);
+	n = chain_read(&h->h_x->x_res, iov, HTTP_CHAIN_MAX, &sz);
+
+	/* queue it up, goes out with everyone elses in the next batch. The
+	 * ring takes one buffer at a time, the rest follow on completion.
+	 */
+	if ( (h->h_flags & HTTP_CONN_RING) &&
+			nbio_send(t, &h->h_nbio, iov[0].iov_base,
+				iov[0].iov_len,
+				(n > 1) ? flags | MSG_MORE : flags) ) {
+		h->h_flags |= HTTP_CONN_TX_BUSY;
+		nbio_set_wait(t, &h->h_nbio, 0);
+		return 1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
 
-	ret = send(h->h_nbio.fd, ptr, sz, flags);
+	ret = sendmsg(h->h_nbio.fd, &msg, flags);
 	if ( ret < 0 && errno == EAGAIN ) {
 		nbio_inactive(t, &h->h_nbio, NBIO_WRITE);
 		return 1;
@@ -277,26 +614,52 @@ static int http_write_hdr(struct iothread *t, struct _http_conn *h)
 		return 0;
 	}
 
-	buf_done_read(h->h_res, ret);
+	return http_hdr_sent(t, h, ret);
+}
 
-	ptr = buf_read(h->h_res, &sz);
-	if ( sz == 0 ) {
-		buf_free_res(h->h_res);
-		h->h_res = NULL;
+static void http_sent(struct iothread *t, struct nbio *n, ssize_t ret)
+{
+	struct _http_conn *h = (struct _http_conn *)n;
 
-		if ( h->h_data_len ) {
-			dprintf("Header done, %zu bytes of data\n",
-				h->h_data_len);
-			h->h_state = HTTP_CONN_DATA;
-		}else{
-			if ( h->h_conn_close )
-				return 0;
-			nbio_set_wait(t, &h->h_nbio, NBIO_READ);
-			h->h_state = HTTP_CONN_REQUEST;
-		}
+	assert(h->h_state == HTTP_CONN_HEADER);
+	h->h_flags &= ~HTTP_CONN_TX_BUSY;
+
+	if ( ret <= 0 || !http_hdr_sent(t, h, ret) ) {
+		http_kill(t, h);
+		return;
 	}
 
-	return 1;
+	/* short send, go again */
+	if ( h->h_state == HTTP_CONN_HEADER )
+		nbio_set_wait(t, &h->h_nbio, NBIO_WRITE);
+}
+
+/* Once the handshake is done the conn carries on as if it was plain
+ * HTTP, the kernel does the encryption.
+ */
+static void http_handshake(struct iothread *t, struct _http_conn *h)
+{
+	nbio_flags_t wait = 0;
+	int ret;
+
+	ret = tls_handshake(h->h_tls, &wait);
+	if ( ret < 0 ) {
+		if ( nbio_get_wait(&h->h_nbio) != wait )
+			nbio_set_wait(t, &h->h_nbio, wait);
+		nbio_inactive(t, &h->h_nbio, wait);
+		return;
+	}else if ( 0 == ret ) {
+		http_kill(t, h);
+		return;
+	}
+
+	if ( tls_offloaded(h->h_tls) ) {
+		tls_free(h->h_tls);
+		h->h_tls = NULL;
+	}
+
+	h->h_state = HTTP_CONN_REQUEST;
+	nbio_set_wait(t, &h->h_nbio, NBIO_READ);
 }
 
 static void http_write(struct iothread *t, struct nbio *n)
@@ -307,6 +670,9 @@ static void http_write(struct iothread *t, struct nbio *n)
 	h = (struct _http_conn *)n;
 
 	switch(h->h_state) {
+	case HTTP_CONN_HANDSHAKE:
+		http_handshake(t, h);
+		return;
 	case HTTP_CONN_HEADER:
 		ret = http_write_hdr(t, h);
 		break;
@@ -328,12 +694,12 @@ static int response_403(struct iothread *t, struct _http_conn *h)
 	uint8_t *ptr;
 	size_t sz;
 
-	ptr = buf_write(h->h_res, &sz);
-	assert(NULL != ptr && sz >= strlen(resp403));
+	ptr = chain_write(&h->h_x->x_res, strlen(resp403), &sz);
+	assert(NULL != ptr);
 
 	memcpy(ptr, resp403, strlen(resp403));
-	buf_done_write(h->h_res, strlen(resp403));
-	h->h_data_len = 0;
+	chain_done_write(&h->h_x->x_res, strlen(resp403));
+	h->h_x->x_data_len = 0;
 	return 1;
 }
 
@@ -343,12 +709,12 @@ static int response_404(struct iothread *t, struct _http_conn *h)
 	uint8_t *ptr;
 	size_t sz;
 
-	ptr = buf_write(h->h_res, &sz);
-	assert(NULL != ptr && sz >= strlen(resp404));
+	ptr = chain_write(&h->h_x->x_res, strlen(resp404), &sz);
+	assert(NULL != ptr);
 
 	memcpy(ptr, resp404, strlen(resp404));
-	buf_done_write(h->h_res, strlen(resp404));
-	h->h_data_len = 0;
+	chain_done_write(&h->h_x->x_res, strlen(resp404));
+	h->h_x->x_data_len = 0;
 	return 1;
 }
 
@@ -358,13 +724,45 @@ static int response_501(struct iothread *t, struct _http_conn *h)
 	uint8_t *ptr;
 	size_t sz;
 
-	ptr = buf_write(h->h_res, &sz);
-	assert(NULL != ptr && sz >= strlen(resp501));
+	ptr = chain_write(&h->h_x->x_res, strlen(resp501), &sz);
+	assert(NULL != ptr);
 
 	memcpy(ptr, resp501, strlen(resp501));
-	buf_done_write(h->h_res, strlen(resp501));
-	h->h_data_len = 0;
-	h->h_conn_close = 1;
+	chain_done_write(&h->h_x->x_res, strlen(resp501));
+	h->h_x->x_data_len = 0;
+	h->h_x->x_conn_close = 1;
+	return 1;
+}
+
+static int response_500(struct iothread *t, struct _http_conn *h)
+{
+	uint8_t *ptr;
+	size_t sz;
+
+	ptr = chain_write(&h->h_x->x_res, strlen(resp500), &sz);
+	assert(NULL != ptr);
+
+	memcpy(ptr, resp500, strlen(resp500));
+	chain_done_write(&h->h_x->x_res, strlen(resp500));
+	h->h_x->x_data_len = 0;
+	h->h_x->x_conn_close = 1;
+	return 1;
+}
+
+static int response_416(struct iothread *t, struct _http_conn *h,
+			uint64_t flen)
+{
+	uint8_t *ptr;
+	size_t sz;
+	int n;
+
+	ptr = chain_write(&h->h_x->x_res, HTTP_RESP_ROOM, &sz);
+	assert(NULL != ptr);
+	n = snprintf((char *)ptr, sz, resp416, flen);
+	assert(n > 0 && (size_t)n < sz);
+
+	chain_done_write(&h->h_x->x_res, n);
+	h->h_x->x_data_len = 0;
 	return 1;
 }
 
@@ -382,15 +780,20 @@ static int response_301(struct iothread *t, struct _http_conn *h,
 	host.v_ptr = host_hdr->v_ptr;
 	host.v_len = host_hdr->v_len;
 
-	ptr = buf_write(h->h_res, &sz);
-	assert(NULL != ptr && sz >= strlen(resp301));
+	ptr = chain_write(&h->h_x->x_res, strlen(resp301) +
+				host.v_len + loc->v_len, &sz);
+	if ( NULL == ptr ) {
+		if ( chain_len(&h->h_x->x_res) )
+			return HTTP_DEFER;
+		return response_500(t, h);
+	}
 
-	memcpy(ptr, resp301, strlen(resp301));
 	n = snprintf((char *)ptr, sz, resp301,
 			(int)host.v_len, host.v_ptr,
 			(int)loc->v_len, loc->v_ptr);
-	buf_done_write(h->h_res, n);
-	h->h_data_len = 0;
+	assert(n > 0 && (size_t)n < sz);
+	chain_done_write(&h->h_x->x_res, n);
+	h->h_x->x_data_len = 0;
 	return 1;
 }
 
@@ -399,28 +802,13 @@ static int response_400(struct iothread *t, struct _http_conn *h)
 	uint8_t *ptr;
 	size_t sz;
 
-	ptr = buf_write(h->h_res, &sz);
-	assert(NULL != ptr && sz >= strlen(resp400));
+	ptr = chain_write(&h->h_x->x_res, strlen(resp400), &sz);
+	assert(NULL != ptr);
 
 	memcpy(ptr, resp400, strlen(resp400));
-	buf_done_write(h->h_res, strlen(resp400));
-	h->h_data_len = 0;
-	h->h_conn_close = 1;
-	return 1;
-}
-
-static int response_500(struct iothread *t, struct _http_conn *h)
-{
-	uint8_t *ptr;
-	size_t sz;
-
-	ptr = buf_write(h->h_res, &sz);
-	assert(NULL != ptr && sz >= strlen(resp500));
-
-	memcpy(ptr, resp500, strlen(resp500));
-	buf_done_write(h->h_res, strlen(resp500));
-	h->h_data_len = 0;
-	h->h_conn_close = 1;
+	chain_done_write(&h->h_x->x_res, strlen(resp400));
+	h->h_x->x_data_len = 0;
+	h->h_x->x_conn_close = 1;
 	return 1;
 }
 
@@ -430,7 +818,7 @@ static void print_etag(char buf[ETAG_SZ * 2 + 1], const uint8_t etag[ETAG_SZ])
 	char *ptr;
 
 	for(i = 0, ptr = buf; i < ETAG_SZ; i++, ptr += 2) {
-		static const char hex[] = "01234567890abcdef";
+		static const char hex[] = "0123456789abcdef";
 		uint8_t hi = etag[i] >> 4;
 		uint8_t lo = etag[i] & 0xf;
 		ptr[0] = hex[hi];
@@ -440,99 +828,294 @@ static void print_etag(char buf[ETAG_SZ * 2 + 1], const uint8_t etag[ETAG_SZ])
 	*ptr = '\0';
 }
 
-#define HTTP_TIME_BUF 44
-static int print_time(char buf[HTTP_TIME_BUF + 1], struct tm *tm)
-{
-	static const char * const dayofweek[] = {
-		"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
-	};
-	static const char * const monthofyear[] = {
-		"Jan", "Feb", "Mar", "Apr", "May", "Jun",
-		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
-	};
-	//strftime(mtime, sizeof(mtime), "%a, %d %b %Y %H:%M:%S GMT", &tm);
-	return snprintf(buf, HTTP_TIME_BUF + 1,
-		"%s, %02d %s %4d %02d:%02d:%02d GMT",
-		dayofweek[tm->tm_wday],
-		tm->tm_mday,
-		monthofyear[tm->tm_mon - 1],
-		tm->tm_year + 1900,
-		tm->tm_hour,
-		tm->tm_min,
-		tm->tm_sec);
-}
-
-struct resp {
-	uint8_t *r_ptr;
-	uint8_t *r_end;
-	size_t r_len;
-};
-
-static void resp_begin(struct _http_conn *h, struct resp *r)
+/* Returns 0 if there's no room for len bytes of header */
+static int resp_begin(struct _http_conn *h, struct resp *r, size_t len)
 {
 	size_t sz;
-	r->r_ptr = buf_write(h->h_res, &sz);
+
+	r->r_ptr = chain_write(&h->h_x->x_res, len, &sz);
+	if ( NULL == r->r_ptr )
+		return 0;
 	r->r_end = r->r_ptr + sz;
 	r->r_len = 0;
+	return 1;
 }
 
-#define resp_static_string(r, s) resp_string(r, (uint8_t *)s, strlen(s))
-static void resp_string(struct resp *r, const uint8_t *s, size_t len)
+static void resp_tail(struct _http_conn *h, struct resp *res)
 {
-	assert(r->r_ptr + len <= r->r_end);
-	memcpy(r->r_ptr, s, len);
-	r->r_ptr += len;
-	r->r_len += len;
+	resp_end(res, h->h_x->x_conn_close);
 }
 
-static void resp_u64(struct resp *r, uint64_t u)
+/* Header won't fit, if it's queued behind other responses then try
+ * again once they've gone
+ */
+static int resp_no_room(struct iothread *t, struct _http_conn *h)
 {
-	int ret;
-	ret = snprintf((char *)r->r_ptr, r->r_end - r->r_ptr, "%"PRIu64, u);
-	assert(r->r_ptr + ret <= r->r_end);
-	r->r_ptr += ret;
-	r->r_len += ret;
+	h->h_x->x_data_len = 0;
+	if ( chain_len(&h->h_x->x_res) )
+		return HTTP_DEFER;
+	printf("Response header too big\n");
+	return response_500(t, h);
 }
 
-static void resp_etag(struct resp *r, const uint8_t etag[ETAG_SZ])
+/* Get ready to send h_data_len bytes at h_data_off. The I/O model needs
+ * the webroot fd, inline data is sent from its mapping along with the
+ * header.
+ */
+static int body_prep(struct iothread *t, struct _http_conn *h,
+			webroot_t root, int can_inline)
 {
-	assert(r->r_ptr + ETAG_SZ * 2 + 1 <= r->r_end);
-	print_etag((char *)r->r_ptr, etag);
-	r->r_ptr += ETAG_SZ * 2;
-	r->r_len += ETAG_SZ * 2;
+	h->h_x->x_webroot = root;
+	webroot_ref(h->h_x->x_webroot);
+
+	if ( can_inline &&
+			webroot_inline(root, h->h_x->x_data_off, h->h_x->x_data_len) ) {
+		h->h_flags |= HTTP_CONN_INLINE;
+		return 1;
+	}
+
+	if ( !_io_prep(t, h) ) {
+		webroot_unref(h->h_x->x_webroot);
+		h->h_x->x_webroot = NULL;
+		return 0;
+	}
+
+	return 1;
 }
 
-static void resp_time(struct resp *r, struct tm *tm)
+/* If-Range has to match our ETag or Last-Modified exactly, otherwise
+ * the whole file is sent
+ */
+static int if_range_ok(const struct http_request *r,
+			const struct webroot_name *n)
+{
+	char etag[ETAG_SZ * 2 + 1];
+	char date[HTTP_TIME_BUF + 1];
+	struct tm tm;
+	time_t mt;
+
+	if ( !r->if_range.v_len )
+		return 1;
+
+	if ( r->if_range.v_len == ETAG_SZ * 2 ) {
+		print_etag(etag, n->u.data.f_etag);
+		return !vstrcmp(&r->if_range, etag);
+	}
+
+	mt = n->u.data.f_mtime;
+	gmtime_r(&mt, &tm);
+	print_time(date, &tm);
+	return !vstrcmp(&r->if_range, date);
+}
+
+/* Make the ranges absolute, dropping any which are unsatisfiable */
+static unsigned int resolve_ranges(struct http_range *rng, unsigned int nr,
+					uint64_t flen)
+{
+	unsigned int i, n = 0;
+	uint64_t first, last;
+
+	for(i = 0; i < nr; i++) {
+		first = rng[i].first;
+		last = rng[i].last;
+
+		if ( first == HTTP_RANGE_SUFFIX ) {
+			if ( 0 == last || 0 == flen )
+				continue;
+			first = (last < flen) ? flen - last : 0;
+			last = flen - 1;
+		}else{
+			if ( first >= flen )
+				continue;
+			if ( last >= flen )
+				last = flen - 1;
+		}
+
+		rng[n].first = first;
+		rng[n].last = last;
+		n++;
+	}
+
+	return n;
+}
+
+/* Boundary and header preceding part i, or the closing boundary if i is
+ * one past the last part. With NULL buf it just returns the length.
+ */
+static int part_hdr(char *buf, size_t sz, const struct http_ranges *rg,
+			unsigned int i)
+{
+	if ( i == rg->rg_nr )
+		return snprintf(buf, sz, "\r\n--%s--\r\n", rg->rg_boundary);
+
+	return snprintf(buf, sz,
+			"\r\n--%s\r\n"
+			"Content-Type: %.*s\r\n"
+			"Content-Range: bytes %"PRIu64"-%"PRIu64"/%"PRIu64"\r\n"
+			"\r\n",
+			rg->rg_boundary,
+			(int)rg->rg_mime.v_len, rg->rg_mime.v_ptr,
+			rg->rg_range[i].first, rg->rg_range[i].last,
+			rg->rg_flen);
+}
+
+static void resp_part(struct resp *res, const struct http_ranges *rg,
+			unsigned int i)
 {
 	int len;
-	assert(r->r_ptr + HTTP_TIME_BUF <= r->r_end);
-	len = print_time((char *)r->r_ptr, tm);
-	len = (len < 0) ? 0 : len;
-	r->r_ptr += len;
-	r->r_len += len;
+
+	len = part_hdr((char *)res->r_ptr, res->r_end - res->r_ptr, rg, i);
+	assert(len >= 0 && res->r_ptr + len < res->r_end);
+	res->r_ptr += len;
+	res->r_len += len;
+}
+
+static int http_next_part(struct iothread *t, struct _http_conn *h)
+{
+	struct http_ranges *rg = h->h_x->x_ranges;
+	const struct http_range *rng;
+	struct resp res;
+
+	h->h_state = HTTP_CONN_HEADER;
+	nbio_set_wait(t, &h->h_nbio, NBIO_WRITE);
+
+	rg->rg_cur++;
+	if ( !resp_begin(h, &res, part_hdr(NULL, 0, rg, rg->rg_cur) + 1) )
+		return 0;
+	resp_part(&res, rg, rg->rg_cur);
+	chain_done_write(&h->h_x->x_res, res.r_len);
+
+	/* closing boundary, then back to waiting for requests */
+	if ( rg->rg_cur == rg->rg_nr ) {
+		hgang_return(ranges, rg);
+		h->h_x->x_ranges = NULL;
+		webroot_unref(h->h_x->x_webroot);
+		h->h_x->x_webroot = NULL;
+		return 1;
+	}
+
+	rng = rg->rg_range + rg->rg_cur;
+	h->h_x->x_data_off = rg->rg_base + rng->first;
+	h->h_x->x_data_len = rng->last - rng->first + 1;
+	return _io_prep(t, h);
 }
 
-static void resp_http_code(struct resp *r, unsigned code)
+/* room for the 206 status, Content-Type/Length/Range/Encoding and a
+ * part header
+ */
+#define HTTP_RANGE_HDR	352
+
+/* 206 with a single range, or multipart/byteranges for several */
+static int handle_range(struct iothread *t, struct _http_conn *h,
+			struct http_request *r, const struct webroot_name *n,
+			webroot_t root, int head)
 {
-	assert(r->r_ptr + 3 <= r->r_end);
-	r->r_ptr[0] = '0' + ((code / 100) % 10);
-	r->r_ptr[1] = '0' + ((code / 10) % 10);
-	r->r_ptr[2] = '0' + (code % 10);
-	r->r_ptr += 3;
-	r->r_len += 3;
+	const struct http_range *rng = r->range;
+	uint64_t flen = n->u.data.f_len;
+	struct http_ranges *rg = NULL;
+	struct ro_vec val;
+	const uint8_t *eol;
+	struct resp res;
+	unsigned int nr, i;
+	uint64_t clen;
+
+	nr = resolve_ranges(r->range, r->nr_ranges, flen);
+	if ( !nr )
+		return response_416(t, h, flen);
+
+	/* validators are the 304 header without its status line */
+	val = n->u.data.f_hdr304;
+	eol = memchr(val.v_ptr, '\n', val.v_len);
+	assert(NULL != eol);
+	val.v_len -= (eol + 1) - val.v_ptr;
+	val.v_ptr = eol + 1;
+
+	if ( !resp_begin(h, &res, val.v_len + n->mime_type.v_len * 2 +
+				HTTP_RANGE_HDR + HTTP_HDR_TAIL) )
+		return resp_no_room(t, h);
+
+	if ( nr > 1 ) {
+		rg = hgang_alloc(ranges);
+		if ( NULL == rg ) {
+			printf("OOM on ranges...\n");
+			h->h_x->x_data_len = 0;
+			return response_500(t, h);
+		}
+
+		rg->rg_mime = n->mime_type;
+		rg->rg_base = h->h_x->x_data_off;
+		rg->rg_flen = flen;
+		rg->rg_cur = 0;
+		rg->rg_nr = nr;
+		memcpy(rg->rg_range, rng, nr * sizeof(*rng));
+		boundary_seq += 0x9e3779b97f4a7c15ULL;
+		snprintf(rg->rg_boundary, sizeof(rg->rg_boundary),
+			"%016"PRIx64, boundary_seq);
+
+		for(clen = 0, i = 0; i <= nr; i++)
+			clen += part_hdr(NULL, 0, rg, i);
+		for(i = 0; i < nr; i++)
+			clen += rng[i].last - rng[i].first + 1;
+	}else{
+		clen = rng->last - rng->first + 1;
+	}
+
+	h->h_x->x_data_off += rng->first;
+	h->h_x->x_data_len = rng->last - rng->first + 1;
+
+	if ( head ) {
+		h->h_x->x_data_len = 0;
+	}else{
+		/* multipart only ever goes via the I/O model */
+		h->h_x->x_ranges = rg;
+		if ( !body_prep(t, h, root, NULL == rg) ) {
+			h->h_x->x_ranges = NULL;
+			if ( rg )
+				hgang_return(ranges, rg);
+			h->h_x->x_data_len = 0;
+			return response_500(t, h);
+		}
+	}
+
+	resp_static_string(&res, "HTTP/1.1 206 Partial Content\r\n");
+	if ( rg ) {
+		resp_printf(&res, "Content-Type: multipart/byteranges; "
+				"boundary=%s\r\n", rg->rg_boundary);
+	}else{
+		resp_printf(&res, "Content-Type: %.*s\r\n"
+				"Content-Range: bytes %"PRIu64"-%"PRIu64
+				"/%"PRIu64"\r\n",
+				(int)n->mime_type.v_len, n->mime_type.v_ptr,
+				rng->first, rng->last, flen);
+	}
+	if ( n->u.data.f_encoding )
+		resp_printf(&res, "Content-Encoding: %s\r\n",
+				n->u.data.f_encoding);
+	resp_printf(&res, "Content-Length: %"PRIu64"\r\n", clen);
+	resp_string(&res, val.v_ptr, val.v_len);
+	resp_tail(h, &res);
+
+	/* the first part's header goes out along with ours */
+	if ( rg && head ) {
+		hgang_return(ranges, rg);
+	}else if ( rg ) {
+		resp_part(&res, rg, 0);
+	}
+
+	stats.s_reqs++;
+	chain_done_write(&h->h_x->x_res, res.r_len);
+	return 1;
 }
 
-uint64_t reqs;
 static int handle_get(struct iothread *t, struct _http_conn *h,
 			struct http_request *r, int head)
 {
 	struct webroot_name n;
 	struct ro_vec search_uri = r->uri;
+	const struct ro_vec *hdr;
 	struct resp res;
-	struct tm tm;
-	char etag[41];
+	char etag[ETAG_SZ * 2 + 1];
 	char hbuf[r->host.v_len + 1];
-	time_t mt;
 	struct nads nads;
 	webroot_t root;
 	int hit = 0;
@@ -548,17 +1131,17 @@ static int handle_get(struct iothread *t, struct _http_conn *h,
 		nads.uri, nads.query, hbuf);
 
 	search_uri.v_ptr = (uint8_t *)nads.uri;
-	search_uri.v_len = strlen(nads.uri);
+	search_uri.v_len = nads.uri_len;
 
 	root = vhosts_lookup(h->h_owner->l_vhosts, hbuf);
 	if ( NULL == root ) {
 		return response_403(t, h);
 	}
 
-	if ( !webroot_find(root, &search_uri, &n) ) {
+	if ( !webroot_find(root, &search_uri, r->accept_enc, &n) ) {
 #if 0
-		h->h_data_off = obj404_f_ofs;
-		h->h_data_len = obj404_f_len;
+		h->h_x->x_data_off = obj404_f_ofs;
+		h->h_x->x_data_len = obj404_f_len;
 		mime_type = obj404_mime_type;
 #else
 		dprintf("404\n");
@@ -573,15 +1156,14 @@ static int handle_get(struct iothread *t, struct _http_conn *h,
 		case HTTP_FORBIDDEN:
 			return response_403(t, h);
 		case HTTP_FOUND:
-			h->h_data_off = n.u.data.f_ofs;
-			h->h_data_len = n.u.data.f_len;
+			h->h_x->x_data_off = n.u.data.f_ofs;
+			h->h_x->x_data_len = n.u.data.f_len;
 			break;
 		}
 	}
 
-	print_etag(etag, n.u.data.f_etag);
-
-	if ( r->etag.v_len == 40 ) {
+	if ( r->etag.v_len == ETAG_SZ * 2 ) {
+		print_etag(etag, n.u.data.f_etag);
 		dprintf("conditional query: %.*s vs %s: ",
 			(int)r->etag.v_len, r->etag.v_ptr, etag);
 		if ( !vstrcmp(&r->etag, etag) ) {
@@ -594,107 +1176,68 @@ static int handle_get(struct iothread *t, struct _http_conn *h,
 
 	if ( hit ) {
 		head = 1;
-		n.code = HTTP_NOT_MODIFIED;
+		hdr = &n.u.data.f_hdr304;
+	}else if ( r->nr_ranges && if_range_ok(r, &n) ) {
+		return handle_range(t, h, r, &n, root, head);
 	}else{
+		hdr = &n.u.data.f_hdr200;
 	}
 
-	if ( h->h_data_len && !head ) {
-		if ( !_io_prep(t, h) ) {
-			response_500(t, h);
-			return 1;
-		}
-	}
-
-	resp_begin(h, &res);
-	resp_static_string(&res, "HTTP/1.1 ");
-	resp_http_code(&res, n.code);
-	switch(n.code) {
-	case 200:
-		resp_static_string(&res, " OK");
-		break;
-	case HTTP_NOT_MODIFIED:
-		resp_static_string(&res, " Not Modified");
-		break;
-	case 404:
-	default:
-		resp_static_string(&res, " Not Found");
-		break;
-	}
-
-	resp_static_string(&res, "\r\nContent-Type: ");
-	resp_string(&res, n.mime_type.v_ptr, n.mime_type.v_len);
+	if ( !resp_begin(h, &res, hdr->v_len + HTTP_HDR_TAIL) )
+		return resp_no_room(t, h);
 
-	resp_static_string(&res, "\r\nContent-Length: ");
-	resp_u64(&res, h->h_data_len);
-
-	resp_static_string(&res, "\r\nConnection: ");
-	if ( h->h_conn_close ) {
-		resp_static_string(&res, "Close");
-	}else{
-		resp_static_string(&res, "Keep-Alive");
+	if ( h->h_x->x_data_len && !head && !body_prep(t, h, root, 1) ) {
+		response_500(t, h);
+		return 1;
 	}
 
-	resp_static_string(&res, "\r\nETag: ");
-	resp_etag(&res, n.u.data.f_etag);
+	/* everything but the per-request bits came from mkroot */
+	resp_string(&res, hdr->v_ptr, hdr->v_len);
+	resp_tail(h, &res);
 
-	resp_static_string(&res, "\r\nLast-Modified: ");
-	mt = n.u.data.f_mtime;
-	gmtime_r(&mt, &tm);
-	resp_time(&res, &tm);
-
-	resp_static_string(&res, "\r\nServer: ashttpd\r\n\r\n");
-
-	reqs++;
-	buf_done_write(h->h_res, res.r_len);
-	dprintf("%.*s\n", (int)res.r_len, h->h_res->b_base);
+	stats.s_reqs++;
+	chain_done_write(&h->h_x->x_res, res.r_len);
+	dprintf("%.*s\n", (int)res.r_len, res.r_ptr - res.r_len);
 	if ( head )
-		h->h_data_len = 0;
-	else {
-		h->h_webroot = root;
-		webroot_ref(h->h_webroot);
-	}
+		h->h_x->x_data_len = 0;
 	return 1;
 }
 
-static void handle_request(struct iothread *t, struct _http_conn *h)
+/* Is there a whole request header buffered up */
+static int http_req_ready(struct _http_conn *h)
+{
+	if ( NULL == h->h_x )
+		return 0;
+	if ( RSTATE_TERMINAL(h->h_x->x_rstate) )
+		return 1;
+	return http_parse_incremental(&h->h_x->x_rstate,
+					&h->h_x->x_rptr, h->h_x->x_req->b_write);
+}
+
+/* Answer the request at the head of x_req, appending the response to
+ * x_res. Returns 0 if the conn should be killed, or HTTP_DEFER if there
+ * wasn't room for the response alongside what's queued already.
+ */
+static int handle_one(struct iothread *t, struct _http_conn *h)
 {
 	struct http_request r;
 	size_t hlen, sz;
 	const uint8_t *ptr;
 	int ret;
 
-	assert(h->h_state == HTTP_CONN_REQUEST);
-
-	/* first try allocate buffer to respond,
-	 * we always need to respond, so do this
-	 * first and kill the conn if we fail
-	*/
-	h->h_res = buf_alloc_res();
-	if ( NULL == h->h_res ) {
-		printf("OOM on res...\n");
-		http_kill(t, h);
-		return;
-	}
-
-	/* Respond or die! */
-	h->h_state = HTTP_CONN_HEADER;
-	nbio_set_wait(t, &h->h_nbio, NBIO_WRITE);
-
 	/* Parse the request */
-	ptr = buf_read(h->h_req, &sz);
+	ptr = buf_read(h->h_x->x_req, &sz);
 	memset(&r, 0, sizeof(r));
 	hlen = http_req(&r, ptr, sz);
 	dprintf("%zu/%zu bytes were request\n", hlen, sz);
 	dprintf("%.*s\n", (int)sz, ptr);
 	if ( 0 == hlen ) {
-		response_400(t, h);
-		return;
+		return response_400(t, h);
 	}
 
 	if ( r.content_len ) {
 		printf("Argh, Content-Length set on request\n");
-		http_kill(t, h);
-		return;
+		return 0;
 	}
 
 	/* For requests with no host header (HTTP/1.0, or malformed HTTP/1.1
@@ -713,7 +1256,7 @@ static void handle_request(struct iothread *t, struct _http_conn *h)
 		r.host.v_ptr = (uint8_t *)buf;
 	}
 
-	h->h_conn_close = r.conn_close;
+	h->h_x->x_conn_close = r.conn_close;
 
 	if ( !vstrcmp_fast(&r.method, "GET") ) {
 		ret = handle_get(t, h, &r, 0);
@@ -723,23 +1266,151 @@ static void handle_request(struct iothread *t, struct _http_conn *h)
 		ret = response_501(t, h);
 	}
 
-	if ( !ret ) {
+	if ( ret > 0 ) {
+		buf_done_read(h->h_x->x_req, hlen);
+		h->h_x->x_rptr = h->h_x->x_req->b_read;
+		h->h_x->x_rstate = RSTATE_INITIAL;
+	}
+
+	return ret;
+}
+
+/* Answer every complete request that's already buffered. Responses with
+ * no body are coalesced in to x_res and go out in one send, we stop at
+ * the first one with a body since that goes through the I/O model.
+ */
+static void handle_request(struct iothread *t, struct _http_conn *h)
+{
+	size_t sz;
+	int ret;
+
+	assert(h->h_state == HTTP_CONN_REQUEST);
+
+	/* Respond or die! */
+	h->h_state = HTTP_CONN_HEADER;
+	nbio_set_wait(t, &h->h_nbio, NBIO_WRITE);
+	nbio_timer_arm(t, &h->h_timer, HTTP_TIMEOUT_WRITE);
+
+	for(;;) {
+		ret = handle_one(t, h);
+		if ( ret == HTTP_DEFER )
+			break;
+		if ( !ret ) {
+			http_kill(t, h);
+			return;
+		}
+
+		if ( h->h_x->x_data_len || h->h_x->x_conn_close )
+			break;
+
+		if ( !http_req_ready(h) ||
+				!chain_write(&h->h_x->x_res, HTTP_RESP_ROOM, &sz) )
+			break;
+	}
+
+	/* keep hold of any partial or pipelined requests */
+	buf_reset(h->h_x->x_req);
+	h->h_x->x_rptr = h->h_x->x_req->b_base;
+	h->h_x->x_rstate = RSTATE_INITIAL;
+	xfer_req_shrink(h->h_x);
+
+	/* hold back the last segment if another response is coming */
+	if ( !h->h_x->x_conn_close && http_req_ready(h) )
+		h->h_flags |= HTTP_CONN_MORE;
+	else
+		h->h_flags &= ~HTTP_CONN_MORE;
+}
+
+/* The first bytes of a new request start the header clock */
+static void http_req_filled(struct iothread *t, struct _http_conn *h,
+				size_t sz)
+{
+	if ( h->h_x->x_req->b_write == h->h_x->x_req->b_base &&
+			h->h_state == HTTP_CONN_REQUEST )
+		nbio_timer_arm(t, &h->h_timer, HTTP_TIMEOUT_HEADER);
+	buf_done_write(h->h_x->x_req, sz);
+}
+
+/* Attach an xfer, and so the request buffer, if we don't have one */
+static int http_req_buf(struct _http_conn *h)
+{
+	if ( h->h_x )
+		return 1;
+
+	h->h_x = xfer_new();
+	return NULL != h->h_x;
+}
+
+/* Completion based receive: data arrives whatever state we're in and is
+ * buffered up, we only parse it in the request state. If the buffer is
+ * full then we push back and get offered the rest again later.
+ */
+static size_t http_recvd(struct iothread *t, struct nbio *nbio,
+			const uint8_t *buf, ssize_t len)
+{
+	struct _http_conn *h = (struct _http_conn *)nbio;
+	uint8_t *ptr;
+	size_t sz;
+
+	if ( len <= 0 ) {
+		/* finish off any requests we already have, then close */
+		h->h_flags |= HTTP_CONN_RX_EOF;
+		if ( h->h_state == HTTP_CONN_REQUEST )
+			nbio_set_wait(t, nbio, NBIO_READ);
+		return 0;
+	}
+
+	if ( !http_req_buf(h) ) {
+		printf("OOM on req...\n");
 		http_kill(t, h);
-		return;
+		return 0;
+	}
+
+	/* full, parse what we have first */
+	ptr = buf_write(h->h_x->x_req, &sz);
+	if ( 0 == sz ) {
+		if ( h->h_state == HTTP_CONN_REQUEST )
+			nbio_set_wait(t, nbio, NBIO_READ);
+		return 0;
 	}
 
-	buf_done_read(h->h_req, hlen);
+	if ( sz > (size_t)len )
+		sz = len;
+
+	dprintf("Received %zu bytes: %.*s\n", sz, (int)sz, buf);
+	memcpy(ptr, buf, sz);
+	http_req_filled(t, h, sz);
+
+	if ( h->h_state == HTTP_CONN_REQUEST )
+		nbio_set_wait(t, nbio, NBIO_READ);
+
+	return sz;
+}
+
+static void http_read_ring(struct iothread *t, struct _http_conn *h)
+{
+	size_t sz;
 
-	buf_read(h->h_req, &sz);
-	if ( sz ) {
-		buf_reset(h->h_req);
-		h->h_rptr = h->h_req->b_base;
-		h->h_rstate = RSTATE_INITIAL;
+	if ( h->h_x ) {
+		if ( http_req_ready(h) ) {
+			handle_request(t, h);
+			return;
+		}
+
+		buf_write(h->h_x->x_req, &sz);
+		if ( 0 == sz && !xfer_req_grow(h->h_x) ) {
+			printf("Request header too big\n");
+			http_kill(t, h);
+			return;
+		}
+	}
+
+	if ( h->h_flags & HTTP_CONN_RX_EOF ) {
+		http_kill(t, h);
 		return;
-	}else{
-		buf_free_req(h->h_req);
-		h->h_req = NULL;
 	}
+
+	nbio_inactive(t, &h->h_nbio, NBIO_READ);
 }
 
 static void http_read(struct iothread *t, struct nbio *nbio)
@@ -751,28 +1422,47 @@ static void http_read(struct iothread *t, struct nbio *nbio)
 
 	h = (struct _http_conn *)nbio;
 
+	if ( h->h_state == HTTP_CONN_HANDSHAKE ) {
+		http_handshake(t, h);
+		return;
+	}
+
 	assert(h->h_state == HTTP_CONN_REQUEST);
 
-	if ( NULL == h->h_req ) {
-		h->h_req = buf_alloc_req();
-		if ( NULL == h->h_req ) {
-			printf("OOM on res after header...\n");
-			http_kill(t, h);
-			return;
-		}
-		h->h_rptr = h->h_req->b_base;
-		h->h_rstate = RSTATE_INITIAL;
+	if ( h->h_flags & HTTP_CONN_RING ) {
+		http_read_ring(t, h);
+		return;
 	}
 
-	ptr = buf_write(h->h_req, &sz);
-	if ( 0 == sz ) {
-		printf("OOM on req...\n");
+	/* pipelined request left over from last time */
+	if ( http_req_ready(h) ) {
+		handle_request(t, h);
+		return;
+	}
+
+	if ( !http_req_buf(h) ) {
+		printf("OOM on res after header...\n");
 		http_kill(t, h);
 		return;
 	}
 
-	ret = recv(h->h_nbio.fd, ptr, sz, 0);
+again:
+	ptr = buf_write(h->h_x->x_req, &sz);
+	if ( 0 == sz ) {
+		if ( !xfer_req_grow(h->h_x) ) {
+			printf("Request header too big\n");
+			http_kill(t, h);
+			return;
+		}
+		ptr = buf_write(h->h_x->x_req, &sz);
+	}
+
+	if ( h->h_tls )
+		ret = tls_recv(h->h_tls, ptr, sz);
+	else
+		ret = recv(h->h_nbio.fd, ptr, sz, 0);
 	if ( ret < 0 && errno == EAGAIN ) {
+		http_xfer_drop(h);
 		nbio_inactive(t, nbio, NBIO_READ);
 		return;
 	}else if ( ret <= 0 ) {
@@ -782,10 +1472,15 @@ static void http_read(struct iothread *t, struct nbio *nbio)
 
 	dprintf("Received %zu bytes: %.*s\n",
 		ret, (int)ret, ptr);
-	buf_done_write(h->h_req, ret);
+	http_req_filled(t, h, ret);
+
+	/* Rest of the record didn't fit, the socket won't tell us about
+	 * it, so take it all now even if it's a pipelined request.
+	 */
+	if ( h->h_tls && tls_pending(h->h_tls) )
+		goto again;
 
-	if ( !http_parse_incremental(&h->h_rstate,
-					&h->h_rptr, h->h_req->b_write) ) {
+	if ( !http_req_ready(h) ) {
 		dprintf("no request yet, waiting for more data\n");
 		return;
 	}
@@ -797,14 +1492,34 @@ static void http_dtor(struct iothread *t, struct nbio *n)
 {
 	struct _http_conn *h = (struct _http_conn *)n;
 	assert(h->h_state = HTTP_CONN_DEAD);
-	webroot_unref(h->h_webroot);
+	xfer_free(h->h_x);
 	hgang_return(conns, n);
 }
 
+static int http_error(struct iothread *t, struct nbio *n)
+{
+	struct _http_conn *h = (struct _http_conn *)n;
+
+	if ( NULL == fio_current->error || h->h_nbio.fd < 0 )
+		return 0;
+	return (*fio_current->error)(t, h);
+}
+
+static void http_timeout(struct iothread *t, struct nbio_timer *tm)
+{
+	struct _http_conn *h = container_of(tm, struct _http_conn, h_timer);
+
+	dprintf("Connection timed out in state %u\n", h->h_state);
+	http_kill(t, h);
+}
+
 static const struct nbio_ops http_ops = {
 	.read = http_read,
 	.write = http_write,
 	.dtor = http_dtor,
+	.recvd = http_recvd,
+	.sent = http_sent,
+	.error = http_error,
 };
 
 void http_conn(struct iothread *t, int s, void *priv)
@@ -825,25 +1540,198 @@ void http_conn(struct iothread *t, int s, void *priv)
 	h->h_nbio.fd = s;
 	h->h_nbio.ops = &http_ops;
 	nbio_add(t, &h->h_nbio, NBIO_READ);
-	concurrency++;
-	if ( (concurrency % 1000) == 0 )
-		printf("concurrency %u\n", concurrency);
+	/* before anything which might http_kill() it */
+	stats.s_concurrency++;
+	if ( (stats.s_concurrency % 1000) == 0 )
+		printf("concurrency %u\n", stats.s_concurrency);
+	nbio_timer_init(&h->h_timer, http_timeout);
+	nbio_timer_arm(t, &h->h_timer, HTTP_TIMEOUT_HEADER);
+	if ( hl->l_tls ) {
+		/* the handshake needs readiness, not ring recv */
+		h->h_tls = tls_new(hl->l_tls, s);
+		if ( NULL == h->h_tls ) {
+			http_kill(t, h);
+			return;
+		}
+		h->h_state = HTTP_CONN_HANDSHAKE;
+	}else if ( nbio_recv(t, &h->h_nbio) ) {
+		h->h_flags |= HTTP_CONN_RING;
+	}
 	return;
 }
 
+static void pool_stats(const char *name, hgang_t pool)
+{
+	struct hgang_stats st;
+
+	if ( NULL == pool )
+		return;
+
+	hgang_stats(pool, &st);
+	printf("pool %s: %lu x %zuK slabs (%lu hugetlb, %lu empty), "
+		"%lu live, %lu free, %lu cached\n",
+		name, st.hs_slabs, st.hs_slab_size >> 10, st.hs_hugetlb,
+		st.hs_empty, st.hs_live, st.hs_free, st.hs_cached);
+}
+
 __attribute__((noreturn)) static void sigint(int sig)
 {
+	struct http_stats *s;
+	const char *name;
+	unsigned int i;
+	hgang_t pool;
+	uint64_t reqs = 0;
+	uint64_t ctl = 0;
+
+	/* racy, but it's only stats */
+	list_for_each_entry(s, &all_stats, s_list) {
+		reqs += s->s_reqs;
+		ctl += s->s_iothread->nr_ctl;
+	}
+
 	printf("\n%"PRIu64" reqs handled\n", reqs);
+	if ( reqs )
+		printf("%.2f eventloop ctl calls per req\n",
+			(double)ctl / reqs);
+
+	pool_stats("conns", conns);
+	pool_stats("xfers", xfers);
+	pool_stats("ranges", ranges);
+	for(i = 0; (pool = buf_pool(i, &name)); i++)
+		pool_stats(name, pool);
 	exit(1);
 }
+
+static const char * const pool_names[] = {"conns", "xfers", "ranges",
+					"bufs", "req", "res", "data",
+					"4K", "16K", "64K"};
+#define NR_POOLS (sizeof(pool_names)/sizeof(*pool_names))
+static unsigned int pool_flags[NR_POOLS];
+
+static int pool_mode(const char *mode, unsigned int *flags)
+{
+	if ( !strcmp(mode, "hugetlb") ) {
+		*flags = HGANG_HUGETLB;
+	}else if ( !strcmp(mode, "thp") ) {
+		*flags = HGANG_THP;
+	}else if ( !strcmp(mode, "off") ) {
+		*flags = 0;
+	}else{
+		return 0;
+	}
+	return 1;
+}
+
+/* A comma separated list of [pool=]mode, the mode on its own applies
+ * to every pool, eg. "thp,conns=hugetlb,ranges=off"
+ */
+int http_pool_opt(const char *spec)
+{
+	char *str, *tok, *save, *eq;
+	unsigned int flags, i;
+	int ret = 0;
+
+	str = strdup(spec);
+	if ( NULL == str )
+		return 0;
+
+	for(tok = strtok_r(str, ",", &save); tok;
+			tok = strtok_r(NULL, ",", &save)) {
+		eq = strchr(tok, '=');
+		if ( NULL == eq ) {
+			if ( !pool_mode(tok, &flags) )
+				goto bad;
+			for(i = 0; i < NR_POOLS; i++)
+				pool_flags[i] = flags;
+			continue;
+		}
+
+		*eq = '\0';
+		if ( !pool_mode(eq + 1, &flags) )
+			goto bad;
+		for(i = 0; i < NR_POOLS; i++)
+			if ( !strcmp(tok, pool_names[i]) )
+				break;
+		if ( i >= NR_POOLS )
+			goto bad;
+		pool_flags[i] = flags;
+	}
+
+	ret = 1;
+	goto out;
+bad:
+	fprintf(stderr, "-H: bad pool setting: %s\n", tok);
+out:
+	free(str);
+	return ret;
+}
+
+unsigned int http_pool_flags(const char *pool)
+{
+	unsigned int i;
+
+	for(i = 0; i < NR_POOLS; i++)
+		if ( !strcmp(pool, pool_names[i]) )
+			return pool_flags[i];
+	return 0;
+}
+
+/* Pools are shared so this only runs on the first iothread */
+static void pools_reclaim(struct iothread *t, struct nbio_timer *tm)
+{
+	const char *name;
+	unsigned int i;
+	hgang_t pool;
+
+	hgang_reclaim(conns);
+	hgang_reclaim(xfers);
+	hgang_reclaim(ranges);
+	for(i = 0; (pool = buf_pool(i, &name)); i++)
+		hgang_reclaim(pool);
+
+	nbio_timer_arm(t, tm, HTTP_RECLAIM_INTERVAL);
+}
+
+static void pools_init(void)
+{
+	conns = hgang_new_flags(sizeof(struct _http_conn), 0,
+				http_pool_flags("conns") | HGANG_SHARED);
+	if ( NULL == conns )
+		fprintf(stderr, "conns: %s\n", os_err());
+
+	xfers = hgang_new_flags(sizeof(struct http_xfer), 0,
+				http_pool_flags("xfers") | HGANG_SHARED);
+	if ( NULL == xfers )
+		fprintf(stderr, "xfers: %s\n", os_err());
+
+	ranges = hgang_new_flags(sizeof(struct http_ranges), 0,
+				http_pool_flags("ranges") | HGANG_SHARED);
+	if ( NULL == ranges )
+		fprintf(stderr, "ranges: %s\n", os_err());
+}
+
+/* Must be called from each thread which is going to run an iothread */
 int http_proto_init(struct iothread *t)
 {
 	signal(SIGINT, sigint);
-	conns = hgang_new(sizeof(struct _http_conn), 0);
-	if ( NULL == conns ) {
-		fprintf(stderr, "conns: %s\n", os_err());
+	INIT_LIST_HEAD(&oomq);
+
+	if ( !buf_init(http_pool_flags) )
 		return 0;
+
+	pthread_once(&pools_once, pools_init);
+	if ( NULL == conns || NULL == xfers || NULL == ranges )
+		return 0;
+	boundary_seq = ((uint64_t)time(NULL) << 32) ^ (uintptr_t)&stats;
+
+	stats.s_iothread = t;
+	pthread_mutex_lock(&all_stats_lock);
+	if ( list_empty(&all_stats) ) {
+		nbio_timer_init(&reclaim_timer, pools_reclaim);
+		nbio_timer_arm(t, &reclaim_timer, HTTP_RECLAIM_INTERVAL);
 	}
+	list_add_tail(&stats.s_list, &all_stats);
+	pthread_mutex_unlock(&all_stats_lock);
 
 	if ( !_io_init(t) ) {
 		return 0;
@@ -0,0 +1,78 @@
+/*
+ * Bits of response header which aren't precomputed by mkroot.
+*/
+#include <time.h>
+#include <stdarg.h>
+
+#include <ashttpd.h>
+#include <http-fmt.h>
+
+int print_time(char buf[HTTP_TIME_BUF + 1], struct tm *tm)
+{
+	static const char * const dayofweek[] = {
+		"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+	};
+	static const char * const monthofyear[] = {
+		"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+	};
+	//strftime(mtime, sizeof(mtime), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	return snprintf(buf, HTTP_TIME_BUF + 1,
+		"%s, %02d %s %4d %02d:%02d:%02d GMT",
+		dayofweek[tm->tm_wday],
+		tm->tm_mday,
+		monthofyear[tm->tm_mon],
+		tm->tm_year + 1900,
+		tm->tm_hour,
+		tm->tm_min,
+		tm->tm_sec);
+}
+
+/* Date only changes once a second, so keep it formatted */
+void resp_date(struct resp *r)
+{
+	static __thread char date[HTTP_TIME_BUF + 1];
+	static __thread time_t date_now;
+	static __thread int date_len;
+	time_t now;
+	struct tm tm;
+
+	now = time(NULL);
+	if ( now != date_now ) {
+		gmtime_r(&now, &tm);
+		date_len = print_time(date, &tm);
+		date_len = (date_len < 0) ? 0 : date_len;
+		date_now = now;
+	}
+
+	resp_string(r, (uint8_t *)date, date_len);
+}
+
+void resp_printf(struct resp *r, const char *fmt, ...)
+{
+	va_list va;
+	int len;
+
+	va_start(va, fmt);
+	len = vsnprintf((char *)r->r_ptr, r->r_end - r->r_ptr, fmt, va);
+	va_end(va);
+
+	assert(len >= 0 && r->r_ptr + len < r->r_end);
+	r->r_ptr += len;
+	r->r_len += len;
+}
+
+/* Connection and Date, then the end of the header */
+void resp_end(struct resp *r, int conn_close)
+{
+	resp_static_string(r, "Connection: ");
+	if ( conn_close ) {
+		resp_static_string(r, "Close");
+	}else{
+		resp_static_string(r, "Keep-Alive");
+	}
+
+	resp_static_string(r, "\r\nDate: ");
+	resp_date(r);
+	resp_static_string(r, "\r\n\r\n");
+}
@@ -4,6 +4,62 @@
 #include <ashttpd.h>
 #include <http-parse.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_SCAN_SIMD 1
+#endif
+
+static const uint8_t *scan_eol_c(const uint8_t *p, const uint8_t *end)
+{
+	for(; p < end; p++)
+		if ( *p == '\r' || *p == '\n' )
+			break;
+	return p;
+}
+
+#if HAVE_SCAN_SIMD
+__attribute__((target("sse2")))
+static const uint8_t *scan_eol_sse2(const uint8_t *p, const uint8_t *end)
+{
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	unsigned int mask;
+	__m128i v;
+
+	for(; end - p >= 16; p += 16) {
+		v = _mm_loadu_si128((const __m128i *)p);
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+							_mm_cmpeq_epi8(v, lf)));
+		if ( mask )
+			return p + __builtin_ctz(mask);
+	}
+
+	return scan_eol_c(p, end);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *scan_eol_avx2(const uint8_t *p, const uint8_t *end)
+{
+	const __m256i cr = _mm256_set1_epi8('\r');
+	const __m256i lf = _mm256_set1_epi8('\n');
+	unsigned int mask;
+	__m256i v;
+
+	for(; end - p >= 32; p += 32) {
+		v = _mm256_loadu_si256((const __m256i *)p);
+		mask = _mm256_movemask_epi8(
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, cr),
+						_mm256_cmpeq_epi8(v, lf)));
+		if ( mask )
+			return p + __builtin_ctz(mask);
+	}
+
+	return scan_eol_sse2(p, end);
+}
+#endif
+
+http_scan_fn_t http_scan_eol = scan_eol_c;
+
 /* Parse and HTTP version string (eg: "HTTP/1.0") */
 http_ver_t http_proto_version(struct ro_vec *str)
 {
@@ -102,87 +158,238 @@ static inline void dispatch_hdr(struct http_hcb *dcb,
 	}
 }
 
-/* Get a version code for a given major and minor version */
-/* Actually parse an HTTP request */
-size_t http_decode_buf(struct http_hcb *d, size_t num_dcb,
-				const uint8_t *p, const uint8_t *end)
+/* Bit per byte of a 64 byte block which is a '\n' or ':', these are all
+ * the tokeniser needs to look at to find every line and header name.
+ */
+static inline uint64_t structural_c(const uint8_t *p)
+{
+	uint64_t mask = 0;
+	unsigned int i;
+
+	for(i = 0; i < 64; i++)
+		if ( p[i] == '\n' || p[i] == ':' )
+			mask |= 1ULL << i;
+	return mask;
+}
+
+#if HAVE_SCAN_SIMD
+__attribute__((target("sse2")))
+static inline uint64_t structural_sse2(const uint8_t *p)
+{
+	const __m128i lf = _mm_set1_epi8('\n');
+	const __m128i colon = _mm_set1_epi8(':');
+	uint64_t mask = 0;
+	unsigned int i;
+	__m128i v;
+
+	for(i = 0; i < 4; i++) {
+		v = _mm_loadu_si128((const __m128i *)(p + i * 16));
+		v = _mm_or_si128(_mm_cmpeq_epi8(v, lf),
+				_mm_cmpeq_epi8(v, colon));
+		mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(v) << (i * 16);
+	}
+
+	return mask;
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t structural_avx2(const uint8_t *p)
+{
+	const __m256i lf = _mm256_set1_epi8('\n');
+	const __m256i colon = _mm256_set1_epi8(':');
+	__m256i lo, hi;
+
+	lo = _mm256_loadu_si256((const __m256i *)p);
+	hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+	lo = _mm256_or_si256(_mm256_cmpeq_epi8(lo, lf),
+				_mm256_cmpeq_epi8(lo, colon));
+	hi = _mm256_or_si256(_mm256_cmpeq_epi8(hi, lf),
+				_mm256_cmpeq_epi8(hi, colon));
+	return (uint32_t)_mm256_movemask_epi8(lo) |
+		((uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32);
+}
+#endif
+
+static inline size_t span_trim_cr(const uint8_t *base, size_t off, size_t len)
+{
+	if ( len && base[off + len - 1] == '\r' )
+		len--;
+	return len;
+}
+
+static inline void span_set(struct http_span *s, size_t off, size_t len)
+{
+	s->s_off = off;
+	s->s_len = len;
+}
+
+/* Method, URI and protocol are separated by spaces, the protocol is
+ * everything after the second lot (so a response's message can have
+ * spaces in it)
+ */
+static void request_line(struct http_tok *t, size_t len)
+{
+	const uint8_t *p = t->t_base;
+	size_t i = 0, tok;
+	unsigned int n;
+
+	len = span_trim_cr(p, 0, len);
+	for(n = 0; n < 3; n++) {
+		while ( i < len && p[i] == ' ' )
+			i++;
+		for(tok = i; i < len && (n == 2 || p[i] != ' '); i++)
+			/* nothing */;
+		span_set(&t->t_line[n], tok, i - tok);
+	}
+}
+
+/* One pass over the structural bits: the first '\n' ends the request
+ * line, the first ':' on each line after that ends the header name and
+ * a line with no ':' is the end of the header.
+ */
+static inline __attribute__((always_inline))
+size_t tokenize(struct http_tok *t, const uint8_t *p, const uint8_t *end,
+		uint64_t (*structural)(const uint8_t *p))
 {
-	const uint8_t *cur;
-	struct ro_vec hv[3]; /* method, url, proto */
-	struct ro_vec k,v;
-	int i = 0;
-	void *state = &&state0;
-	int ret = 0;
-
-	hv[0].v_len = 0;
-	hv[1].v_len = 0;
-	hv[2].v_len = 0;
-
-	for(cur = p; cur < end; cur++) {
-		goto *state;
-state0:
-		if ( *cur != ' ' ) {
-			state = &&state1;
-			hv[i].v_ptr = (void *)cur;
-			hv[i].v_len = 0;
+	size_t len = end - p, blk, i, line = 0, key_end = 0;
+	int first = 1, colon = 0;
+	uint8_t pad[64];
+	struct http_hdr *h;
+	uint64_t mask;
+
+	t->t_base = p;
+	t->t_nr_hdrs = 0;
+
+	for(blk = 0; blk < len; blk += 64) {
+		if ( len - blk >= 64 ) {
+			mask = (*structural)(p + blk);
+		}else{
+			memset(pad, 0, sizeof(pad));
+			memcpy(pad, p + blk, len - blk);
+			mask = (*structural)(pad);
 		}
-		continue;
-state1:
-		switch(*cur) {
-		case ' ':
-			if ( i < 2 ) {
-				hv[i].v_len = cur - hv[i].v_ptr;
-				state = &&state0;
-				i++;
+
+		for(; mask; mask &= mask - 1) {
+			i = blk + __builtin_ctzll(mask);
+
+			if ( p[i] == ':' ) {
+				if ( !first && !colon ) {
+					key_end = i;
+					colon = 1;
+				}
+				continue;
 			}
-			break;
-		case '\n':
-			hv[i].v_len = cur - hv[i].v_ptr;
-			if ( hv[i].v_len && *(cur - 1) == '\r' )
-				hv[i].v_len--;
-			k.v_ptr = (void *)cur + 1;
-			k.v_len = 0;
-			state = &&state2;
-			ret = (cur - p) + 1;
-			break;
-		}
-		continue;
-state2:
-		if ( *cur == ':' ) {
-			k.v_len = (cur - k.v_ptr);
-			state = &&state3;
-		}else if ( *cur == '\n' ) {
-			ret = (cur - p) + 1;
-			cur = end;
-		}
-		continue;
-state3:
-		if ( *cur != ' ' ) {
-			v.v_ptr = (void *)cur;
-			v.v_len = 0;
-			state = &&state4;
-		}
-		continue;
-state4:
-		if ( *cur == '\n' ) {
-			v.v_len = (cur - v.v_ptr);
-			if ( v.v_len && *(cur-1) == '\r' )
-				v.v_len--;
-			dispatch_hdr(d + 3, num_dcb - 3, &k, &v);
-			k.v_ptr = (void *)cur + 1;
-			k.v_len = 0;
-			state = &&state2;
+
+			if ( first ) {
+				request_line(t, i);
+				first = 0;
+			}else if ( !colon ) {
+				return i + 1;
+			}else if ( t->t_nr_hdrs == HTTP_MAX_HDRS ) {
+				return 0;
+			}else{
+				h = &t->t_hdr[t->t_nr_hdrs++];
+				span_set(&h->h_key, line, key_end - line);
+				for(key_end++; p[key_end] == ' '; key_end++)
+					/* nothing */;
+				span_set(&h->h_val, key_end,
+					span_trim_cr(p, key_end, i - key_end));
+			}
+
+			line = i + 1;
+			colon = 0;
 		}
-		continue;
 	}
 
-	if ( !hv[0].v_len || !hv[1].v_len )
+	/* no end of header */
+	return 0;
+}
+
+static size_t tokenize_c(struct http_tok *t,
+			const uint8_t *p, const uint8_t *end)
+{
+	return tokenize(t, p, end, structural_c);
+}
+
+#if HAVE_SCAN_SIMD
+__attribute__((target("sse2")))
+static size_t tokenize_sse2(struct http_tok *t,
+				const uint8_t *p, const uint8_t *end)
+{
+	return tokenize(t, p, end, structural_sse2);
+}
+
+__attribute__((target("avx2")))
+static size_t tokenize_avx2(struct http_tok *t,
+				const uint8_t *p, const uint8_t *end)
+{
+	return tokenize(t, p, end, structural_avx2);
+}
+#endif
+
+static size_t (*do_tokenize)(struct http_tok *t, const uint8_t *p,
+				const uint8_t *end) = tokenize_c;
+
+static void __attribute__((constructor)) scan_ctor(void)
+{
+#if HAVE_SCAN_SIMD
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports("avx2") ) {
+		http_scan_eol = scan_eol_avx2;
+		do_tokenize = tokenize_avx2;
+	}else if ( __builtin_cpu_supports("sse2") ) {
+		http_scan_eol = scan_eol_sse2;
+		do_tokenize = tokenize_sse2;
+	}
+#endif
+}
+
+/* Find the request (or status) line and every header in one go. Returns
+ * the length of the header, or 0 if it's incomplete, malformed or has
+ * too many lines.
+ */
+size_t http_tokenize(struct http_tok *t, const uint8_t *p, const uint8_t *end)
+{
+	size_t ret;
+
+	/* spans are 16 bits */
+	if ( end - p > HTTP_TOK_MAX )
+		end = p + HTTP_TOK_MAX;
+
+	ret = (*do_tokenize)(t, p, end);
+	if ( !ret || !t->t_line[0].s_len || !t->t_line[1].s_len )
 		return 0;
+	return ret;
+}
 
-	/* Setup method/url/proto */
-	d[0].fn(&d[0], &hv[0]);
-	d[1].fn(&d[1], &hv[1]);
-	d[2].fn(&d[2], &hv[2]);
+/* Hand the line and the headers we're interested in to their callbacks */
+void http_dispatch(struct http_hcb *d, size_t num_dcb,
+			const struct http_tok *t)
+{
+	struct ro_vec k, v;
+	unsigned int i;
+
+	for(i = 0; i < 3; i++) {
+		http_span_vec(t, &t->t_line[i], &v);
+		d[i].fn(&d[i], &v);
+	}
+
+	for(i = 0; i < t->t_nr_hdrs; i++) {
+		http_span_vec(t, &t->t_hdr[i].h_key, &k);
+		http_span_vec(t, &t->t_hdr[i].h_val, &v);
+		dispatch_hdr(d + 3, num_dcb - 3, &k, &v);
+	}
+}
+
+/* Actually parse an HTTP request */
+size_t http_decode_buf(struct http_hcb *d, size_t num_dcb,
+				const uint8_t *p, const uint8_t *end)
+{
+	struct http_tok t;
+	size_t ret;
 
+	ret = http_tokenize(&t, p, end);
+	if ( ret )
+		http_dispatch(d, num_dcb, &t);
 	return ret;
 }
@@ -1,52 +1,224 @@
 #include <ashttpd.h>
 #include <http-parse.h>
 #include <http-req.h>
+#include <http-hdrs.h>
+#include <strings.h>
+#include <limits.h>
+
+static const uint8_t *parse_u64(const uint8_t *p, const uint8_t *end,
+				uint64_t *val)
+{
+	const uint8_t *start = p;
+	uint64_t v = 0;
+
+	for(; p < end && *p >= '0' && *p <= '9'; p++) {
+		if ( v >= UINT64_MAX / 10 )
+			return NULL;
+		v = (v * 10) + (*p - '0');
+	}
+
+	if ( p == start )
+		return NULL;
+
+	*val = v;
+	return p;
+}
+
+static const uint8_t *skip_ws(const uint8_t *p, const uint8_t *end)
+{
+	while ( p < end && (*p == ' ' || *p == '\t') )
+		p++;
+	return p;
+}
+
+/* Parse "bytes=0-499,500-,-100" in to r->range. Anything malformed, or
+ * with too many ranges, is ignored as if there were no Range header.
+ */
+static unsigned int parse_ranges(struct http_request *r,
+				const struct ro_vec *v)
+{
+	const uint8_t *p = v->v_ptr, *end = v->v_ptr + v->v_len;
+	struct http_range *rng;
+	unsigned int n = 0;
+
+	if ( v->v_len < 6 || strncasecmp((const char *)p, "bytes=", 6) )
+		return 0;
+
+	for(p += 6; ; p++) {
+		p = skip_ws(p, end);
+		if ( p == end )
+			break;
+		if ( *p == ',' )
+			continue;
+		if ( n == HTTP_MAX_RANGES )
+			return 0;
+
+		rng = &r->range[n];
+		if ( *p == '-' ) {
+			rng->first = HTTP_RANGE_SUFFIX;
+			p = parse_u64(p + 1, end, &rng->last);
+			if ( NULL == p )
+				return 0;
+		}else{
+			p = parse_u64(p, end, &rng->first);
+			if ( NULL == p || p == end || *p != '-' )
+				return 0;
+			if ( p + 1 < end && p[1] >= '0' && p[1] <= '9' ) {
+				p = parse_u64(p + 1, end, &rng->last);
+				if ( NULL == p || rng->last < rng->first )
+					return 0;
+			}else{
+				rng->last = HTTP_RANGE_EOF;
+				p++;
+			}
+		}
+		n++;
+
+		p = skip_ws(p, end);
+		if ( p == end )
+			break;
+		if ( *p != ',' )
+			return 0;
+	}
+
+	return n;
+}
+
+/* q=0, q=0.0 etc. means not acceptable */
+static int qvalue_zero(const uint8_t *p, const uint8_t *end)
+{
+	if ( p == end || *p != '0' )
+		return 0;
+	for(p++; p < end && *p != ',' && *p != ';'; p++) {
+		if ( *p != '.' && *p != '0' && *p != ' ' && *p != '\t' )
+			return 0;
+	}
+	return 1;
+}
+
+static unsigned int coding_bit(const uint8_t *tok, size_t len)
+{
+	static const struct {
+		const char *name;
+		unsigned int bit;
+	}codings[] = {
+		{"gzip", HTTP_ACCEPT_GZIP},
+		{"x-gzip", HTTP_ACCEPT_GZIP},
+		{"br", HTTP_ACCEPT_BROTLI},
+		{"zstd", HTTP_ACCEPT_ZSTD},
+		{"*", HTTP_ACCEPT_ALL},
+	};
+	unsigned int i;
+
+	for(i = 0; i < sizeof(codings)/sizeof(*codings); i++) {
+		if ( strlen(codings[i].name) == len &&
+			!strncasecmp((const char *)tok, codings[i].name, len) )
+			return codings[i].bit;
+	}
+
+	return 0;
+}
+
+/* Parse Accept-Encoding in to a mask of HTTP_ACCEPT_* bits. Preference
+ * order is ignored since we just send the smallest variant we have, a
+ * q of zero rules out a coding and * stands in for the unmentioned ones.
+ */
+static unsigned int parse_accept_enc(const struct ro_vec *v)
+{
+	const uint8_t *p = v->v_ptr, *end = v->v_ptr + v->v_len;
+	unsigned int yes = 0, no = 0, star = 0, bit;
+	const uint8_t *tok;
+	int zero;
+
+	while ( p < end ) {
+		p = skip_ws(p, end);
+		for(tok = p; p < end && *p != ',' && *p != ';' &&
+				*p != ' ' && *p != '\t'; p++)
+			/* nothing */;
+		bit = coding_bit(tok, p - tok);
+
+		for(zero = 0; p < end && *p != ','; ) {
+			p = skip_ws(p, end);
+			if ( p < end && *p == ';' ) {
+				p = skip_ws(p + 1, end);
+				if ( end - p >= 2 && (*p == 'q' || *p == 'Q') &&
+						p[1] == '=' )
+					zero = qvalue_zero(p + 2, end);
+			}
+			while ( p < end && *p != ',' && *p != ';' )
+				p++;
+		}
+		if ( p < end )
+			p++;
+
+		if ( bit == HTTP_ACCEPT_ALL )
+			star = (zero) ? 0 : bit;
+		else if ( zero )
+			no |= bit;
+		else
+			yes |= bit;
+	}
+
+	return (yes | star) & ~no;
+}
 
 /* Parse an HTTP request header and fill in the http response structure */
 size_t http_req(struct http_request *r, const uint8_t *ptr, size_t len)
 {
 	const uint8_t *end = ptr + len;
-	int clen = -1;
+	struct http_tok tok;
+	struct ro_vec pv, hv[HTTP_NR_HDRS];
+	struct ro_vec *connection = &hv[HTTP_HDR_CONNECTION];
+	unsigned int i;
 	size_t hlen;
-	struct ro_vec pv = {0,}, connection = {0,};
-	struct http_hcb hcb[] = {
-		{"method", htype_string, {.vec = &r->method}},
-		{"uri", htype_string, {.vec = &r->uri}},
-		{"protocol", htype_string, {.vec = &pv}},
-		{"Connection", htype_string, { .vec = &connection}},
-#if 0
-		{"Content-Type", htype_string,
-					{.vec = &r->content_type}},
-#endif
-		{"Content-Length", htype_int, {.val = &clen}},
-#if 0
-		{"Content-Encoding", htype_string,
-					{.vec = &r->content_enc}},
-#endif
-		{"Host", htype_string , {.vec = &r->host}},
-		{"If-None-Match", htype_string, {.vec = &r->etag}},
-#if 0
-		{"Transfer-Encoding", htype_string,
-					{.vec = &r->transfer_enc}},
-#endif
-	};
 
 	/* Do the decode */
-	hlen = http_decode_buf(hcb, sizeof(hcb)/sizeof(*hcb), ptr, end);
+	hlen = http_tokenize(&tok, ptr, end);
 	if ( !hlen )
 		return 0;
 
+	http_span_vec(&tok, &tok.t_line[0], &r->method);
+	http_span_vec(&tok, &tok.t_line[1], &r->uri);
+	http_span_vec(&tok, &tok.t_line[2], &pv);
+
+	/* the last of any repeated header wins */
+	memset(hv, 0, sizeof(hv));
+	for(i = 0; i < tok.t_nr_hdrs; i++) {
+		const struct http_hdr *hdr = &tok.t_hdr[i];
+		unsigned int id;
+
+		id = http_hdr_lookup(tok.t_base + hdr->h_key.s_off,
+					hdr->h_key.s_len);
+		if ( id < HTTP_NR_HDRS )
+			http_span_vec(&tok, &hdr->h_val, &hv[id]);
+	}
+
 	r->proto_vers = http_proto_version(&pv);
 
-	if ( clen > 0 )
-		r->content_len = clen;
+	r->host = hv[HTTP_HDR_HOST];
+	r->if_range = hv[HTTP_HDR_IF_RANGE];
+	r->etag = hv[HTTP_HDR_IF_NONE_MATCH];
+
+	if ( hv[HTTP_HDR_CONTENT_LENGTH].v_ptr ) {
+		unsigned int clen;
+
+		if ( vtouint(&hv[HTTP_HDR_CONTENT_LENGTH], &clen) &&
+				clen > 0 && clen <= INT_MAX )
+			r->content_len = clen;
+	}
+
+	if ( hv[HTTP_HDR_RANGE].v_len )
+		r->nr_ranges = parse_ranges(r, &hv[HTTP_HDR_RANGE]);
+
+	if ( hv[HTTP_HDR_ACCEPT_ENCODING].v_len )
+		r->accept_enc = parse_accept_enc(&hv[HTTP_HDR_ACCEPT_ENCODING]);
 
 	if ( r->proto_vers >= HTTP_VER_1_1 || 1 ) {
 		static const struct ro_vec close_token = {
 			.v_ptr = (uint8_t *)"Close",
 			.v_len = 5,
 		};
-		if ( !vcasecmp_fast(&connection, &close_token) ) {
+		if ( !vcasecmp_fast(connection, &close_token) ) {
 			r->conn_close = 1;
 		}else{
 			r->conn_close = 0;
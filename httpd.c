@@ -1,13 +1,19 @@
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <ashttpd.h>
 #include <ashttpd-conn.h>
@@ -19,6 +25,7 @@
 #include <normalize.h>
 #include <hgang.h>
 #include <critbit.h>
+#include <tls.h>
 
 #if 0
 #define dprintf printf
@@ -26,7 +33,47 @@
 #define dprintf(x...) do {} while(0)
 #endif
 
-static LIST_HEAD(listeners);
+/* TLS ports are only opened if there's a certificate */
+static const struct {
+	uint16_t port;
+	uint8_t tls;
+}ports[] = {
+	{80, 0},
+	{1234, 0},
+	{443, 1},
+	{1443, 1},
+};
+#define NUM_PORTS (sizeof(ports)/sizeof(*ports))
+
+/* shared, OpenSSL contexts are safe to use from many threads */
+static tls_ctx_t tls_ctx;
+
+static int port_enabled(unsigned int i)
+{
+	return !ports[i].tls || NULL != tls_ctx;
+}
+
+/* One of these per iothread, there's no shared state between them
+ * apart from fio_current. Each has its own listening sockets (which
+ * share the port via SO_REUSEPORT) and its own vhosts.
+ *
+ * In pre-fork mode each worker is a process instead, the listening
+ * sockets and vhosts are inherited from the master and w_master is
+ * the socket on which the master sends vhost updates.
+ */
+struct worker {
+	pthread_t		w_thread;
+	pid_t			w_pid;
+	unsigned int		w_idx;
+	int			w_cpu;
+	int			w_master;
+	int			w_lfd[NUM_PORTS];
+	const char		*w_vhosts_dir;
+	const char		*w_eventloop;
+	struct iothread		w_iothread;
+	struct list_head	w_listeners;
+	vhosts_t		w_vhosts;
+};
 
 static struct http_fio *io_model(const char *name)
 {
@@ -41,12 +88,26 @@ static struct http_fio *io_model(const char *name)
 		/* sendfile: regular synchronous version */
 		{"sendfile", &fio_sendfile},
 
+		/* file to pipe to socket, pipes come from a pool */
+		{"splice", &fio_splice},
+
 		/* Kernel AIO on regular file, not currently
 		 * supported in linux 2.6 so falls back to synchronous
 		 */
 		{"aio", &fio_async},
 		{"async", &fio_async},
 
+		/* io_uring reads in to a buffer, or splices through a
+		 * pipe, either way page cache misses don't block us
+		 */
+		{"uring", &fio_uring},
+		{"uring-splice", &fio_uring_splice},
+
+		/* Straight out of a mapping of the webroot with
+		 * MSG_ZEROCOPY, no copies and no pipes
+		 */
+		{"mmap", &fio_mmap},
+
 		/* Kernel AIO on O_DIRECT file descriptor, re-implementing
 		 * page cache in userspace fucking alice in wonderland
 		 */
@@ -77,26 +138,33 @@ static struct http_fio *io_model(const char *name)
 	return &fio_sync;
 }
 
-static struct http_listener *http_listen(struct iothread *t,
+static struct http_listener *http_listen(struct worker *w, int fd,
 					uint32_t addr, uint16_t port,
-					vhosts_t vhosts)
+					tls_ctx_t tls)
 {
+	struct iothread *t = &w->w_iothread;
 	struct http_listener *hl;
 
 	hl = calloc(1, sizeof(*hl));
 	if ( NULL == hl )
 		goto out;
 
-	hl->l_listen = listener_inet(t, SOCK_STREAM, IPPROTO_TCP,
-					addr, port, http_conn,
-					hl, http_oom);
+	if ( fd >= 0 ) {
+		hl->l_listen = listener_fd(t, fd, http_conn, hl, http_oom);
+	}else{
+		hl->l_listen = listener_inet(t, SOCK_STREAM, IPPROTO_TCP,
+						addr, port, http_conn,
+						hl, http_oom);
+	}
 	if ( NULL == hl->l_listen )
 		goto out_free;
 
-	hl->l_vhosts = vhosts;
-	list_add_tail(&hl->l_list, &listeners);
-	printf("http: Listening on %s:%d\n",
-		inet_ntoa((struct in_addr){addr}), port);
+	hl->l_vhosts = w->w_vhosts;
+	hl->l_tls = tls;
+	list_add_tail(&hl->l_list, &w->w_listeners);
+	printf("http: %u: Listening on %s:%d%s\n", w->w_idx,
+		inet_ntoa((struct in_addr){addr}), port,
+		(tls) ? " (TLS)" : "");
 
 	goto out; /* success */
 
@@ -107,38 +175,351 @@ out:
 	return hl;
 }
 
+static void bind_cpu(struct worker *w)
+{
+	cpu_set_t set;
+
+	if ( w->w_cpu < 0 )
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->w_cpu, &set);
+	if ( pthread_setaffinity_np(pthread_self(), sizeof(set), &set) ) {
+		/* not fatal */
+		fprintf(stderr, "http: %u: unable to bind to cpu %d\n",
+			w->w_idx, w->w_cpu);
+	}
+}
+
+static int worker_init(struct worker *w)
+{
+	struct iothread *t = &w->w_iothread;
+	unsigned int i;
+
+	bind_cpu(w);
+
+	if ( !nbio_init(t, w->w_eventloop) )
+		return 0;
+
+	if ( !http_proto_init(t) )
+		return 0;
+
+	if ( w->w_vhosts ) {
+		if ( !vhosts_follow(t, w->w_vhosts, w->w_master) )
+			return 0;
+	}else{
+		w->w_vhosts = vhosts_new(t, w->w_vhosts_dir);
+		if ( NULL == w->w_vhosts )
+			return 0;
+	}
+
+	for(i = 0; i < NUM_PORTS; i++) {
+		if ( !port_enabled(i) )
+			continue;
+		if ( NULL == http_listen(w, w->w_lfd[i], 0, ports[i].port,
+					(ports[i].tls) ? tls_ctx : NULL) )
+			fprintf(stderr, "http: %u: port %u: %s\n",
+				w->w_idx, ports[i].port, os_err());
+	}
+
+	return 1;
+}
+
+static void worker_run(struct worker *w)
+{
+	struct iothread *t = &w->w_iothread;
+
+	do {
+		nbio_pump(t, -1);
+	}while ( !list_empty(&t->active) || !list_empty(&t->inactive) ||
+			!list_empty(&t->deleted) );
+
+	nbio_fini(t);
+	//vhosts_free(w->w_vhosts);
+}
+
+static void *worker_thread(void *priv)
+{
+	struct worker *w = priv;
+
+	if ( !worker_init(w) ) {
+		fprintf(stderr, "http: %u: failed to initialise\n", w->w_idx);
+		exit(EXIT_FAILURE);
+	}
+
+	worker_run(w);
+	return NULL;
+}
+
+/* master is the masters own iothread, if it's been set up yet */
+static int worker_spawn(struct worker *w, vhosts_t v,
+			struct iothread *master)
+{
+	int sv[2];
+	pid_t pid;
+
+	if ( socketpair(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0, sv) ) {
+		fprintf(stderr, "socketpair: %s\n", os_err());
+		return 0;
+	}
+
+	/* big enough to queue up a burst of vhost changes */
+	do {
+		int val = 1 << 20;
+		setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &val, sizeof(val));
+	}while(0);
+
+	fflush(stdout);
+	pid = fork();
+	if ( pid < 0 ) {
+		fprintf(stderr, "fork: %s\n", os_err());
+		close(sv[0]);
+		close(sv[1]);
+		return 0;
+	}
+
+	if ( 0 == pid ) {
+		/* child: don't outlive the master */
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		close(sv[0]);
+		if ( master ) /* its epoll and inotify fds */
+			nbio_fini(master);
+		w->w_master = sv[1];
+		w->w_vhosts = v;
+		if ( !worker_init(w) ) {
+			fprintf(stderr, "http: %u: failed to initialise\n",
+				w->w_idx);
+			_exit(EXIT_FAILURE);
+		}
+		worker_run(w);
+		exit(EXIT_SUCCESS);
+	}
+
+	close(sv[1]);
+	if ( !vhosts_replicate(v, sv[0], pid) ) {
+		kill(pid, SIGTERM);
+		close(sv[0]);
+		return 0;
+	}
+
+	w->w_pid = pid;
+	w->w_master = sv[0];
+	printf("http: %u: worker pid %d\n", w->w_idx, (int)pid);
+	return 1;
+}
+
+/* Reap dead workers and start replacements, the replacement gets a
+ * copy of the masters current vhosts.
+ */
+static void master_reap(struct iothread *t, struct worker *workers,
+			unsigned int nproc, vhosts_t v)
+{
+	unsigned int i;
+	int status;
+	pid_t pid;
+
+	while ( (pid = waitpid(-1, &status, WNOHANG)) > 0 ) {
+		for(i = 0; i < nproc; i++) {
+			if ( workers[i].w_pid == pid )
+				break;
+		}
+		if ( i >= nproc )
+			continue;
+
+		fprintf(stderr, "http: %u: worker pid %d died (status %d)\n",
+			i, (int)pid, status);
+		vhosts_unreplicate(v, workers[i].w_master);
+		close(workers[i].w_master);
+		workers[i].w_master = -1;
+		workers[i].w_pid = 0;
+	}
+
+	for(i = 0; i < nproc; i++) {
+		if ( workers[i].w_pid )
+			continue;
+		worker_spawn(&workers[i], v, t);
+	}
+}
+
+/* The master owns the listening sockets and the vhosts (including the
+ * inotify watch), it forks off the workers and then just relays vhost
+ * changes to them and restarts any that crash.
+ */
+static int prefork(struct worker *workers, unsigned int nproc,
+			const char *vhosts_dir)
+{
+	struct iothread t;
+	unsigned int i, j;
+	int lfd[NUM_PORTS];
+	vhosts_t v;
+
+	v = vhosts_scan(vhosts_dir);
+	if ( NULL == v )
+		return 0;
+
+	for(i = 0; i < NUM_PORTS; i++) {
+		lfd[i] = -1;
+		if ( !port_enabled(i) )
+			continue;
+		lfd[i] = listener_inet_socket(SOCK_STREAM, IPPROTO_TCP,
+						0, ports[i].port);
+		if ( lfd[i] < 0 ) {
+			fprintf(stderr, "http: port %u: %s\n",
+				ports[i].port, os_err());
+			continue;
+		}
+		printf("http: Listening on 0.0.0.0:%u\n", ports[i].port);
+	}
+
+	for(i = 0; i < nproc; i++) {
+		for(j = 0; j < NUM_PORTS; j++)
+			workers[i].w_lfd[j] = lfd[j];
+		if ( !worker_spawn(&workers[i], v, NULL) )
+			return 0;
+	}
+
+	if ( !nbio_init(&t, NULL) )
+		return 0;
+
+	if ( !vhosts_watch(&t, v) )
+		return 0;
+
+	for(;;) {
+		nbio_pump(&t, 1000);
+		master_reap(&t, workers, nproc, v);
+	}
+
+	return 1;
+}
+
+static unsigned int num_cpus(void)
+{
+	long ret;
+
+	ret = sysconf(_SC_NPROCESSORS_ONLN);
+	if ( ret < 1 )
+		return 1;
+	return ret;
+}
+
+static _noreturn void usage(const char *cmd)
+{
+	fprintf(stderr, "Usage:\n");
+	fprintf(stderr, "\t%s [-j threads | -p procs] [-e eventloop] "
+		"[-c cert.pem [-k key.pem]] [-H pools] [vhosts-dir] "
+		"[io-model]\n",
+		cmd);
+	fprintf(stderr, "\t -j 0 starts one thread per online cpu\n");
+	fprintf(stderr, "\t -p 0 forks one worker process per online cpu\n");
+	fprintf(stderr, "\t -e selects epoll, poll or uring\n");
+	fprintf(stderr, "\t -H puts pools on huge pages: [pool=]hugetlb, "
+		"thp or off, comma separated\n");
+	fprintf(stderr, "\t    pools are conns, xfers, ranges, bufs, req, "
+		"res, data, 4K, 16K and 64K\n");
+	fprintf(stderr, "\t -c enables HTTPS on 443 and 1443 with kernel TLS, "
+		"key is in the cert file unless -k\n");
+	exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv)
 {
-	const char *vhosts_dir;
-	struct iothread iothread;
-	vhosts_t vhosts;
+	const char *vhosts_dir, *eventloop = NULL;
+	const char *cert = NULL, *key = NULL;
+	struct worker *workers;
+	unsigned int i, j, nthreads = 1;
+	int autocpu = 0, procs = 0;
+	int c;
 
-	vhosts_dir = (argc > 1) ? argv[1] : "./vhosts";
-	fio_current = io_model((argc > 2) ? argv[2] : NULL);
+	while ( (c = getopt(argc, argv, "j:p:e:c:k:H:")) != -1 ) {
+		switch(c) {
+		case 'H':
+			if ( !http_pool_opt(optarg) )
+				usage(argv[0]);
+			break;
+		case 'c':
+			cert = optarg;
+			break;
+		case 'k':
+			key = optarg;
+			break;
+		case 'e':
+			eventloop = optarg;
+			break;
+		case 'p':
+			procs = 1;
+			/* fall through */
+		case 'j':
+			nthreads = strtoul(optarg, NULL, 0);
+			if ( 0 == nthreads ) {
+				nthreads = num_cpus();
+				autocpu = 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	vhosts_dir = (argc > 0) ? argv[0] : "./vhosts";
+	fio_current = io_model((argc > 1) ? argv[1] : NULL);
 
 	printf("data: %s model\n", fio_current->label);
 	printf("webroot: %s\n", vhosts_dir);
+	printf("%s: %u\n", (procs) ? "processes" : "threads", nthreads);
 
-	if ( !nbio_init(&iothread, NULL) )
-		return EXIT_FAILURE;
+	if ( cert ) {
+		tls_ctx = tls_ctx_new(cert, (key) ? key : cert);
+		if ( NULL == tls_ctx )
+			return EXIT_FAILURE;
+	}
 
-	if ( !http_proto_init(&iothread) ) {
+	workers = calloc(nthreads, sizeof(*workers));
+	if ( NULL == workers ) {
+		fprintf(stderr, "workers: %s\n", os_err());
 		return EXIT_FAILURE;
 	}
 
-	vhosts = vhosts_new(&iothread, vhosts_dir);
-	if ( NULL == vhosts )
-		return EXIT_FAILURE;
+	for(i = 0; i < nthreads; i++) {
+		workers[i].w_idx = i;
+		workers[i].w_cpu = (autocpu) ? (int)i : -1;
+		workers[i].w_master = -1;
+		workers[i].w_vhosts_dir = vhosts_dir;
+		workers[i].w_eventloop = eventloop;
+		for(j = 0; j < NUM_PORTS; j++)
+			workers[i].w_lfd[j] = -1;
+		INIT_LIST_HEAD(&workers[i].w_listeners);
+	}
 
-	http_listen(&iothread, 0, 80, vhosts);
-	http_listen(&iothread, 0, 1234, vhosts);
+	if ( procs ) {
+		if ( !prefork(workers, nthreads, vhosts_dir) )
+			return EXIT_FAILURE;
+		return EXIT_SUCCESS;
+	}
 
-	do {
-		nbio_pump(&iothread, -1);
-	}while ( !list_empty(&iothread.active) );
+	/* Single threaded mode runs the iothread on the main thread */
+	if ( 1 == nthreads ) {
+		if ( !worker_init(&workers[0]) )
+			return EXIT_FAILURE;
+		worker_run(&workers[0]);
+		free(workers);
+		return EXIT_SUCCESS;
+	}
+
+	for(i = 0; i < nthreads; i++) {
+		c = pthread_create(&workers[i].w_thread, NULL,
+					worker_thread, &workers[i]);
+		if ( c ) {
+			fprintf(stderr, "pthread_create: %s\n", os_error(c));
+			return EXIT_FAILURE;
+		}
+	}
 
-	nbio_fini(&iothread);
-	//vhosts_free(vhosts);
+	for(i = 0; i < nthreads; i++)
+		pthread_join(workers[i].w_thread, NULL);
 
+	free(workers);
 	return EXIT_SUCCESS;
 }
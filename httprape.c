@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <limits.h>
+#include <sys/resource.h>
 
 #include <httprape.h>
 #include <nbio-connecter.h>
@@ -345,26 +346,188 @@ static void ramp_up(struct iothread *t)
 		printf(" - max_concurrency = %u\n", i);
 }
 
+/* Anonymous memory of the server process in bytes, that's where all of
+ * the connection state lives
+ */
+static long rss_anon(pid_t pid)
+{
+	char fn[64], line[128];
+	long kb = -1;
+	FILE *f;
+
+	snprintf(fn, sizeof(fn), "/proc/%u/status", (unsigned)pid);
+	f = fopen(fn, "r");
+	if ( NULL == f ) {
+		fprintf(stderr, "%s: %s\n", fn, os_err());
+		return -1;
+	}
+
+	while ( fgets(line, sizeof(line), f) ) {
+		if ( 1 == sscanf(line, "RssAnon: %ld kB", &kb) )
+			break;
+	}
+
+	fclose(f);
+	return (kb < 0) ? -1 : kb << 10;
+}
+
+/* Connect and answer one request, keep-alive, so the server is left with
+ * a conn which has been through a whole request and gone idle.
+ */
+static int idle_conn(void)
+{
+	static const char req[] = "HEAD / HTTP/1.1\r\n"
+					"Host: localhost\r\n\r\n";
+	struct sockaddr_in sa;
+	char buf[1024];
+	size_t got = 0;
+	ssize_t ret;
+	int s;
+
+	s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if ( s < 0 ) {
+		fprintf(stderr, "socket: %s\n", os_err());
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = svr_addr;
+	sa.sin_port = htons(svr_port);
+	if ( connect(s, (struct sockaddr *)&sa, sizeof(sa)) ||
+			send(s, req, sizeof(req) - 1, 0) != sizeof(req) - 1 )
+		goto err;
+
+	do {
+		ret = recv(s, buf + got, sizeof(buf) - 1 - got, 0);
+		if ( ret <= 0 )
+			goto err;
+		got += ret;
+		buf[got] = '\0';
+	}while( NULL == strstr(buf, "\r\n\r\n") && got < sizeof(buf) - 1 );
+
+	return s;
+err:
+	fprintf(stderr, "idle conn: %s\n", os_err());
+	close(s);
+	return -1;
+}
+
+/* Memory footprint of an idle keep-alive connection as seen from the
+ * server's RSS. One conn first so that anything allocated on first use
+ * isn't counted.
+ */
+static int idle_bench(pid_t pid, unsigned int nr)
+{
+	struct rlimit rl;
+	long before, after;
+	unsigned int i;
+	int *fds;
+	int ret = 0;
+
+	if ( !getrlimit(RLIMIT_NOFILE, &rl) ) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	fds = calloc(nr + 1, sizeof(*fds));
+	if ( NULL == fds )
+		return 0;
+
+	fds[nr] = idle_conn();
+	if ( fds[nr] < 0 )
+		goto out;
+
+	/* let it go idle */
+	usleep(100000);
+	before = rss_anon(pid);
+	if ( before < 0 )
+		goto out_close;
+
+	for(i = 0; i < nr; i++) {
+		fds[i] = idle_conn();
+		if ( fds[i] < 0 )
+			break;
+	}
+
+	usleep(100000);
+	after = rss_anon(pid);
+	if ( after >= 0 && i ) {
+		printf("%u idle connections: %ld bytes anon RSS\n",
+			i, after - before);
+		printf("%.1f bytes per idle connection\n",
+			(double)(after - before) / i);
+		ret = (i == nr);
+	}
+
+	while ( i )
+		close(fds[--i]);
+out_close:
+	close(fds[nr]);
+out:
+	free(fds);
+	return ret;
+}
+
+static _noreturn void usage(const char *cmd)
+{
+	fprintf(stderr, "Usage:\n");
+	fprintf(stderr, "\t%s [-i conns -P pid] [host] [port]\n", cmd);
+	fprintf(stderr, "\t -i opens conns keep-alive connections to the "
+		"server with pid and reports its\n"
+		"\t    memory use per idle connection\n");
+	exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv)
 {
 	struct iothread iothread;
+	const char *cmd = argv[0];
 	struct in_addr in;
+	unsigned int idle = 0;
+	pid_t pid = 0;
+	int c;
 
 	svr_port = 80;
 
+	while ( (c = getopt(argc, argv, "i:P:")) != -1 ) {
+		switch(c) {
+		case 'i':
+			idle = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			pid = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(cmd);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if ( argc > 0 )
+		host_addr = argv[0];
 	if ( argc > 1 )
-		host_addr = argv[1];
-	if ( argc > 2 )
-		svr_port = atoi(argv[2]);
+		svr_port = atoi(argv[1]);
 
 	printf("Connecting to %s:%u\n", host_addr, svr_port);
 	inet_aton(host_addr, &in);
 	svr_addr = in.s_addr;
 
+	if ( idle ) {
+		if ( !pid )
+			usage(cmd);
+		return (idle_bench(pid, idle)) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	clients = hgang_new(sizeof(struct http_client), 0);
 	if ( NULL == clients )
 		return EXIT_FAILURE;
 
+	if ( !buf_init(NULL) )
+		return EXIT_FAILURE;
+
 	if ( !nbio_init(&iothread, NULL) )
 		return EXIT_FAILURE;
 
@@ -5,6 +5,14 @@
 #define HTTP_MAX_RESP		1024
 #define HTTP_DATA_BUFFER	4096
 
+/* Size classes for buffers which outgrow the above: 4K, 16K and 64K */
+#define HTTP_BUF_MIN		4096
+#define HTTP_BUF_NR_CLASSES	3
+#define HTTP_BUF_MAX		(HTTP_BUF_MIN << (2 * (HTTP_BUF_NR_CLASSES - 1)))
+
+/* Max buffers in a chain */
+#define HTTP_CHAIN_MAX		4
+
 struct http_buf {
 	/* On the real */
 	uint8_t		*b_base;
@@ -17,6 +25,23 @@ struct http_buf {
 	uint8_t		*b_write;
 };
 
+/* Read from the front and written at the back, for data which doesn't
+ * need to be contiguous. The first buffer is the callers and stays put,
+ * any more come from the size classes as needed.
+ */
+struct http_chain {
+	struct http_buf	*c_buf[HTTP_CHAIN_MAX];
+	unsigned int	c_head;
+	unsigned int	c_nr;
+};
+
+struct iovec;
+
+_private int buf_init(unsigned int (*pool_flags)(const char *name));
+_private struct _hgang *buf_pool(unsigned int idx, const char **name);
+
+_private void buf_attach(struct http_buf *b, uint8_t *base, size_t sz);
+
 _private struct http_buf *buf_alloc_naked(void);
 _private void buf_free_naked(struct http_buf *b);
 
@@ -29,6 +54,10 @@ _private void buf_free_res(struct http_buf *b);
 _private struct http_buf *buf_alloc_data(void);
 _private void buf_free_data(struct http_buf *b);
 
+_private struct http_buf *buf_alloc(size_t sz);
+_private void buf_free(struct http_buf *b);
+_private size_t buf_size(const struct http_buf *b);
+
 _private const uint8_t *buf_read(struct http_buf *b, size_t *sz);
 _private uint8_t *buf_write(struct http_buf *b, size_t *sz);
 
@@ -37,4 +66,13 @@ _private size_t buf_done_write(struct http_buf *b, size_t sz);
 
 _private void buf_reset(struct http_buf *b);
 
+_private void chain_init(struct http_chain *c, struct http_buf *first);
+_private uint8_t *chain_write(struct http_chain *c, size_t len, size_t *sz);
+_private void chain_done_write(struct http_chain *c, size_t sz);
+_private unsigned int chain_read(struct http_chain *c, struct iovec *iov,
+				unsigned int max, size_t *sz);
+_private size_t chain_done_read(struct http_chain *c, size_t sz);
+_private size_t chain_len(const struct http_chain *c);
+_private void chain_reset(struct http_chain *c);
+
 #endif /* _ASHTTPD_BUF_H */
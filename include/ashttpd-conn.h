@@ -3,12 +3,17 @@
 
 typedef struct _http_conn *http_conn_t;
 _private size_t http_conn_data(http_conn_t h, int *fd, off_t *off);
-_private size_t http_conn_data_read(http_conn_t h, size_t len);
+_private size_t http_conn_data_read(struct iothread *t, http_conn_t h,
+					size_t len);
 _private void http_conn_data_complete(struct iothread *t, http_conn_t h);
 _private void http_conn_abort(struct iothread *t, http_conn_t h);
 _private void *http_conn_get_priv(http_conn_t h, unsigned short *s);
 _private void http_conn_set_priv(http_conn_t h, void *priv, unsigned short s);
+_private void *http_conn_get_sock_priv(http_conn_t h);
+_private void http_conn_set_sock_priv(http_conn_t h, void *priv);
+_private webroot_t http_conn_webroot(http_conn_t h);
 _private int http_conn_socket(http_conn_t h);
+_private int http_conn_pipelined(http_conn_t h);
 _private void http_conn_inactive(struct iothread *t, http_conn_t h);
 _private void http_conn_wait_on(struct iothread *t, http_conn_t h,
 				unsigned short w);
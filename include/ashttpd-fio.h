@@ -8,11 +8,23 @@ struct http_fio {
 	void (*abort)(http_conn_t h);
 	int (*init)(struct iothread *t);
 	void (*fini)(struct iothread *t);
+
+	/* Optional per-connection hooks, for state which outlives a
+	 * single response. error() is for socket error queue wakeups and
+	 * returns zero if there was a real error, close() is called just
+	 * before the socket is closed.
+	 */
+	int (*error)(struct iothread *t, http_conn_t h);
+	void (*close)(struct iothread *t, http_conn_t h);
 };
 
 _private extern struct http_fio fio_sync;
 _private extern struct http_fio fio_sendfile;
 _private extern struct http_fio fio_async;
 _private extern struct http_fio fio_async_sendfile;
+_private extern struct http_fio fio_uring;
+_private extern struct http_fio fio_uring_splice;
+_private extern struct http_fio fio_mmap;
+_private extern struct http_fio fio_splice;
 
 #endif /* _ASHTTPD_FIO_H */
@@ -23,6 +23,13 @@ typedef struct _webroot *webroot_t;
 #define HTTP_MOVED_PERMANENTLY		301
 #define HTTP_NOT_MODIFIED		304
 #define HTTP_FORBIDDEN			403
+
+/* Accept-Encoding, one bit per precompressed variant in the webroot */
+#define HTTP_ACCEPT_GZIP		(1U << 0)
+#define HTTP_ACCEPT_BROTLI		(1U << 1)
+#define HTTP_ACCEPT_ZSTD		(1U << 2)
+#define HTTP_ACCEPT_ALL			((1U << 3) - 1)
+
 struct webroot_name {
 	struct ro_vec mime_type;
 	union {
@@ -31,6 +38,10 @@ struct webroot_name {
 			size_t f_len;
 			uint32_t f_mtime;
 			uint8_t f_etag[ETAG_SZ];
+			struct ro_vec f_hdr200;
+			struct ro_vec f_hdr304;
+			/* NULL for identity */
+			const char *f_encoding;
 		}data;
 		struct ro_vec moved;
 	}u;
@@ -42,17 +53,30 @@ typedef struct _vhosts *vhosts_t;
 struct _vhosts *vhosts_new(struct iothread *t, const char *dirname);
 webroot_t vhosts_lookup(vhosts_t v, const char *host);
 
+/* vhosts replication for pre-forked workers: the master scans and
+ * watches the vhosts dir and sends any changes down to the workers
+ */
+_private struct _vhosts *vhosts_scan(const char *dirname);
+_private int vhosts_watch(struct iothread *t, vhosts_t v);
+_private int vhosts_replicate(vhosts_t v, int fd, pid_t pid);
+_private void vhosts_unreplicate(vhosts_t v, int fd);
+_private int vhosts_follow(struct iothread *t, vhosts_t v, int fd);
+
 struct http_listener {
 	struct list_head l_list;
 	listener_t l_listen;
 	vhosts_t l_vhosts;
+	struct _tls_ctx *l_tls;
 };
 
 /* webroot API */
 _private webroot_t webroot_open(const char *fn);
+_private webroot_t webroot_fdopen(int fd, const char *fn);
 _private int webroot_get_fd(webroot_t r);
+_private const uint8_t *webroot_inline(webroot_t r, off_t off, size_t len);
+_private const uint8_t *webroot_data(webroot_t r, off_t off, size_t len);
 _private int webroot_find(webroot_t r, const struct ro_vec *uri,
-				struct webroot_name *out);
+				unsigned int accept, struct webroot_name *out);
 _private webroot_t webroot_ref(webroot_t r);
 _private void webroot_unref(webroot_t r);
 
@@ -64,4 +88,8 @@ _private void http_oom(struct iothread *t, struct nbio *listener);
 /* current file I/O model */
 extern struct http_fio *fio_current;
 
+/* hgang flags for each of the per-connection pools, from -H */
+_private int http_pool_opt(const char *spec);
+_private unsigned int http_pool_flags(const char *pool);
+
 #endif /* _ASHTTPD_H */
@@ -0,0 +1,7 @@
+#ifndef _BENCH_CORPUS_H
+#define _BENCH_CORPUS_H
+
+extern const char * const bench_corpus[];
+extern const unsigned int bench_nr_corpus;
+
+#endif /* _BENCH_CORPUS_H */
@@ -11,16 +11,39 @@ typedef struct _hgang *hgang_t;
 #define HGANG_POISON 		1
 #define HGANG_POISON_PATTERN 	0xa5
 
+/* Slabs backed by huge pages, to save TLB misses on big pools */
+#define HGANG_HUGETLB		(1 << 0) /* MAP_HUGETLB, else THP */
+#define HGANG_THP		(1 << 1) /* madvise(MADV_HUGEPAGE) */
+
+/* Safe to use from any thread, via per-thread magazines */
+#define HGANG_SHARED		(1 << 2)
+
 typedef int(*hgang_cb_t)(void *priv, void *obj);
 
+struct hgang_stats {
+	size_t hs_obj_size;
+	size_t hs_slab_size;
+	unsigned long hs_slabs;
+	unsigned long hs_empty; /* slabs with nothing allocated */
+	unsigned long hs_hugetlb; /* slabs from hugetlbfs */
+	unsigned long hs_live;
+	unsigned long hs_free;
+	unsigned long hs_cached; /* in full magazines in the depot */
+};
+
 _private hgang_t hgang_new(size_t obj_size, unsigned slab_size);
+_private hgang_t hgang_new_flags(size_t obj_size, unsigned slab_size,
+				unsigned int flags);
 _private void hgang_free(hgang_t h);
 _private void * hgang_alloc(hgang_t h) _malloc;
 _private void *hgang_alloc0(hgang_t h) _malloc;
 _private void hgang_return(hgang_t h, void *obj);
+_private void hgang_flush(hgang_t h);
+_private unsigned long hgang_reclaim(hgang_t h);
 
 _private int hgang_foreach(hgang_t h, hgang_cb_t cb, void *priv);
 
 _private size_t hgang_object_size(hgang_t h);
+_private void hgang_stats(hgang_t h, struct hgang_stats *st);
 
 #endif /* _HGANG_HEADER_INCLUDED_ */
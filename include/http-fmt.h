@@ -0,0 +1,33 @@
+#ifndef _HTTP_FMT_H
+#define _HTTP_FMT_H
+
+/* Response header being built in to a buffer, r_len is how much has been
+ * written so far
+ */
+struct resp {
+	uint8_t *r_ptr;
+	uint8_t *r_end;
+	size_t r_len;
+};
+
+#define HTTP_TIME_BUF 44
+
+/* room for what gets appended to the precomputed headers */
+#define HTTP_HDR_TAIL	(sizeof("Connection: Keep-Alive\r\nDate: \r\n\r\n") + \
+				HTTP_TIME_BUF)
+
+#define resp_static_string(r, s) resp_string(r, (uint8_t *)s, strlen(s))
+static inline void resp_string(struct resp *r, const uint8_t *s, size_t len)
+{
+	assert(r->r_ptr + len <= r->r_end);
+	memcpy(r->r_ptr, s, len);
+	r->r_ptr += len;
+	r->r_len += len;
+}
+
+_private int print_time(char buf[HTTP_TIME_BUF + 1], struct tm *tm);
+_private void resp_date(struct resp *r);
+_private void _printf(2, 3) resp_printf(struct resp *r, const char *fmt, ...);
+_private void resp_end(struct resp *r, int conn_close);
+
+#endif /* _HTTP_FMT_H */
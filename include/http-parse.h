@@ -24,8 +24,47 @@ _private void htype_present(struct http_hcb *h, struct ro_vec *v);
 _private void htype_int(struct http_hcb *h, struct ro_vec *v);
 _private size_t http_decode_buf(struct http_hcb *d, size_t num_dcb,
 				const uint8_t *p, const uint8_t *end);
+
+/* Compact index of a tokenised header, offsets are from t_base */
+struct http_span {
+	uint16_t	s_off;
+	uint16_t	s_len;
+};
+
+struct http_hdr {
+	struct http_span h_key;
+	struct http_span h_val;
+};
+
+#define HTTP_MAX_HDRS		100
+#define HTTP_TOK_MAX		0xffff
+struct http_tok {
+	const uint8_t	*t_base;
+	struct http_span t_line[3]; /* method, uri, protocol */
+	unsigned int	t_nr_hdrs;
+	struct http_hdr	t_hdr[HTTP_MAX_HDRS];
+};
+
+static inline void http_span_vec(const struct http_tok *t,
+					const struct http_span *s,
+					struct ro_vec *v)
+{
+	v->v_ptr = t->t_base + s->s_off;
+	v->v_len = s->s_len;
+}
+
+_private size_t http_tokenize(struct http_tok *t,
+				const uint8_t *p, const uint8_t *end);
+_private void http_dispatch(struct http_hcb *d, size_t num_dcb,
+				const struct http_tok *t);
 _private void htype_code(struct http_hcb *h, struct ro_vec *v);
 
+/* First '\r' or '\n' in [p, end) or end if there isn't one. Vectorised,
+ * picked at startup according to what the CPU can do.
+ */
+typedef const uint8_t *(*http_scan_fn_t)(const uint8_t *p, const uint8_t *end);
+_private extern http_scan_fn_t http_scan_eol;
+
 /* State machine for incremental HTTP request parse */
 #define RSTATE_INITIAL		0
 #define RSTATE_CR		1
@@ -62,6 +101,15 @@ static inline int http_parse_incremental(uint8_t *state,
 	assert(end >= *rptr);
 
 	for(; *rptr < end; (*rptr)++) {
+		/* nothing but CR and LF can change the state from initial,
+		 * so skip straight to the next one
+		 */
+		if ( (*state) == RSTATE_INITIAL ) {
+			*rptr = (*http_scan_eol)(*rptr, end);
+			if ( *rptr == end )
+				break;
+		}
+
 		switch((*rptr)[0]) {
 		case '\r':
 			assert((*state) < RSTATE_NR_NONTERMINAL);
@@ -2,6 +2,18 @@
 #define _HTTP_REQ_H
 
 #define HTTP_DEFAULT_PORT	80
+
+/* A single byte range, first is HTTP_RANGE_SUFFIX for the last 'last'
+ * bytes of the file and last is HTTP_RANGE_EOF if it's open ended.
+ */
+#define HTTP_MAX_RANGES		8
+#define HTTP_RANGE_SUFFIX	UINT64_MAX
+#define HTTP_RANGE_EOF		UINT64_MAX
+struct http_range {
+	uint64_t	first;
+	uint64_t	last;
+};
+
 struct http_request {
 	struct ro_vec	method;
 	struct ro_vec	host;
@@ -15,6 +27,10 @@ struct http_request {
 #endif
 	struct ro_vec	hostname;
 	struct ro_vec	etag;
+	struct ro_vec	if_range;
+	struct http_range range[HTTP_MAX_RANGES];
+	unsigned int	nr_ranges;
+	unsigned int	accept_enc;
 	size_t		content_len;
 	uint16_t	port;
 	http_ver_t	proto_vers;
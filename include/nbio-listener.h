@@ -10,6 +10,11 @@ _private listener_t listener_inet(struct iothread *t, int type, int proto,
 					uint32_t addr, uint16_t port,
 					listener_cbfn_t cb, void *priv,
 					listener_oom_t oom);
+_private int listener_inet_socket(int type, int proto,
+					uint32_t addr, uint16_t port);
+_private listener_t listener_fd(struct iothread *t, int fd,
+					listener_cbfn_t cb, void *priv,
+					listener_oom_t oom);
 _private void listener_wake(struct iothread *t, struct nbio *io);
 
 #endif /* _NBIO_LISTENER_H */
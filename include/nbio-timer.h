@@ -0,0 +1,33 @@
+#ifndef _NBIO_TIMER_H
+#define _NBIO_TIMER_H
+
+/* Timers are embedded in whatever owns them, usually alongside a struct
+ * nbio. Arming and disarming are O(1) and don't make any syscalls, the
+ * current time is only read once per nbio_pump().
+ */
+struct nbio_timer;
+typedef void(*nbio_timer_cb_t)(struct iothread *t, struct nbio_timer *tm);
+
+struct nbio_timer {
+	struct list_head	tm_list;
+	uint64_t		tm_expires;
+	nbio_timer_cb_t		tm_cb;
+};
+
+_private void nbio_timer_init(struct nbio_timer *tm, nbio_timer_cb_t cb);
+_private void nbio_timer_arm(struct iothread *t, struct nbio_timer *tm,
+				unsigned int msec);
+_private void nbio_timer_disarm(struct iothread *t, struct nbio_timer *tm);
+
+static inline int nbio_timer_armed(const struct nbio_timer *tm)
+{
+	return !list_empty(&tm->tm_list);
+}
+
+/* for nbio.c */
+_private int _nbio_timers_init(struct iothread *t);
+_private void _nbio_timers_fini(struct iothread *t);
+_private void _nbio_timers_run(struct iothread *t);
+_private int _nbio_timers_mto(struct iothread *t, int mto);
+
+#endif /* _NBIO_TIMER_H */
@@ -15,6 +15,7 @@ struct nbio {
 #define NBIO_WRITE	(1<<1)
 #define NBIO_ERROR	(1<<2)
 #define NBIO_WAIT	(NBIO_READ|NBIO_WRITE|NBIO_ERROR)
+#define NBIO_DELETED	0x80
 	nbio_flags_t mask;
 	nbio_flags_t flags;
 	const struct nbio_ops *ops;
@@ -25,22 +26,47 @@ struct nbio {
 	}ev_priv;
 };
 
+struct nbio_wheel;
+
 /* Represents all the I/Os for a given thread */
 struct iothread {
 	struct list_head inactive;
 	struct list_head active;
 	struct eventloop *plugin;
 	union {
-		int epoll;
 		void *ptr;
 	}priv;
 	struct list_head deleted;
+	struct nbio_wheel *wheel;
+
+	/* how many times the eventloop had to tell the kernel about a
+	 * change in interest, eg. epoll_ctl() calls
+	 */
+	uint64_t nr_ctl;
 };
 
 struct nbio_ops {
 	void (*read)(struct iothread *t, struct nbio *n);
 	void (*write)(struct iothread *t, struct nbio *n);
 	void (*dtor)(struct iothread *t, struct nbio *n);
+
+	/* Completion callbacks, only called if the corresponding
+	 * nbio_accept()/nbio_recv()/nbio_send() succeeded. With accept
+	 * or recv enabled, waiting for NBIO_READ means waiting for these
+	 * instead of for readiness. recvd() returns how many bytes it
+	 * took, anything left over is handed back the next time the nbio
+	 * waits for NBIO_READ. Errors and EOF are passed as len <= 0.
+	 */
+	void (*accepted)(struct iothread *t, struct nbio *n, int fd);
+	size_t (*recvd)(struct iothread *t, struct nbio *n,
+			const uint8_t *buf, ssize_t len);
+	void (*sent)(struct iothread *t, struct nbio *n, ssize_t ret);
+
+	/* Optional, NBIO_ERROR may just mean there's something on the
+	 * socket error queue (eg. zerocopy completions). Return non-zero
+	 * if that's all it was, otherwise the nbio is torn down.
+	 */
+	int (*error)(struct iothread *t, struct nbio *n);
 };
 
 /* nbio API */
@@ -56,6 +82,10 @@ _private void nbio_to_waitq(struct iothread *, struct nbio *,
 				struct list_head *q);
 _private void nbio_wake(struct iothread *, struct nbio *, nbio_flags_t);
 _private void nbio_wait_on(struct iothread *t, struct nbio *n, nbio_flags_t);
+_private int nbio_accept(struct iothread *t, struct nbio *n);
+_private int nbio_recv(struct iothread *t, struct nbio *n);
+_private int nbio_send(struct iothread *t, struct nbio *n,
+			const void *buf, size_t len, int flags);
 
 /* eventloop plugin API */
 struct eventloop {
@@ -65,6 +95,16 @@ struct eventloop {
 	void (*pump)(struct iothread *, int);
 	void (*inactive)(struct iothread *, struct nbio *);
 	void (*active)(struct iothread *, struct nbio *);
+
+	/* optional, for completion based eventloops */
+	int (*accept)(struct iothread *, struct nbio *);
+	int (*recv)(struct iothread *, struct nbio *);
+	int (*send)(struct iothread *, struct nbio *,
+			const void *, size_t, int);
+	/* return 0 if there's still I/O in flight, then the eventloop
+	 * calls the dtor itself once it's all completed
+	 */
+	int (*release)(struct iothread *, struct nbio *);
 	struct eventloop *next;
 };
 
@@ -72,5 +112,6 @@ _private void eventloop_add(struct eventloop *e);
 _private struct eventloop *eventloop_find(const char *name);
 _private void _eventloop_poll_ctor(void);
 _private void _eventloop_epoll_ctor(void);
+_private void _eventloop_uring_ctor(void);
 
 #endif /* _NBIO_HEADER_INCLUDED_ */
@@ -5,6 +5,7 @@ struct nads {
 	const char	*buf;
 	size_t		buf_len;
 	char		*uri;
+	size_t		uri_len;
 	char		*query;
 };
 
@@ -22,6 +23,7 @@ struct nads {
 #define NADS_ERR_BAD_UTF8		4
 #define NADS_ERR_NULL			5
 #define NADS_ERR_OOM			6
+#define NADS_ERR_TOO_LONG		7
 
 /* Web-server details */
 #define NADS_WS_CASE_SENSITIVE		0x01UL /* Server has case sensitive paths */
@@ -32,6 +34,7 @@ struct nads {
 /* =====[ Exported API ]===== */
 
 int nads_normalize(struct nads *res);
+int nads_normalize_full(struct nads *res);
 int nads_error(void);
 const char *nads_strerror(unsigned int err);
 unsigned int nads_errno(void);
@@ -0,0 +1,13 @@
+#ifndef _PIPEPOOL_H
+#define _PIPEPOOL_H
+
+/* Per-thread pool of non-blocking pipes for the splice based I/O models.
+ * pipepool_get() returns the pipe's capacity, or zero on error, which is
+ * handed back with it. Only empty pipes go back in the pool, anything
+ * else is closed.
+ */
+_private size_t pipepool_get(int p[2]);
+_private void pipepool_put(int p[2], size_t cap, int empty);
+_private void pipepool_fini(void);
+
+#endif /* _PIPEPOOL_H */
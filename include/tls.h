@@ -0,0 +1,50 @@
+#ifndef _TLS_H
+#define _TLS_H
+
+/* TLS where the library only does the handshake, after which the kernel
+ * has the keys and does the record layer for us (kTLS). If the kernel
+ * couldn't take the rx side then requests are read with tls_recv().
+ */
+typedef struct _tls_ctx *tls_ctx_t;
+typedef struct _tls *tls_t;
+
+#if HAVE_KTLS
+_private tls_ctx_t tls_ctx_new(const char *cert, const char *key);
+_private tls_t tls_new(tls_ctx_t ctx, int fd);
+_private int tls_handshake(tls_t tls, nbio_flags_t *wait);
+_private int tls_offloaded(tls_t tls);
+_private int tls_pending(tls_t tls);
+_private ssize_t tls_recv(tls_t tls, void *buf, size_t len);
+_private void tls_free(tls_t tls);
+#else
+static inline tls_ctx_t tls_ctx_new(const char *cert, const char *key)
+{
+	fprintf(stderr, "tls: not built with USE_KTLS\n");
+	return NULL;
+}
+static inline tls_t tls_new(tls_ctx_t ctx, int fd)
+{
+	return NULL;
+}
+static inline int tls_handshake(tls_t tls, nbio_flags_t *wait)
+{
+	return 0;
+}
+static inline int tls_offloaded(tls_t tls)
+{
+	return 0;
+}
+static inline int tls_pending(tls_t tls)
+{
+	return 0;
+}
+static inline ssize_t tls_recv(tls_t tls, void *buf, size_t len)
+{
+	return -1;
+}
+static inline void tls_free(tls_t tls)
+{
+}
+#endif
+
+#endif /* _TLS_H */
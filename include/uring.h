@@ -0,0 +1,43 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <linux/io_uring.h>
+
+/* Minimal raw io_uring wrapper, just enough for the eventloop and the
+ * file I/O model. Not thread-safe, one per iothread.
+ */
+struct uring {
+	int			u_fd;
+	unsigned int		u_features;
+
+	/* submission queue */
+	unsigned int		*u_sq_head;
+	unsigned int		*u_sq_tail;
+	unsigned int		u_sq_mask;
+	unsigned int		u_sq_entries;
+	unsigned int		u_sq_local;
+	struct io_uring_sqe	*u_sqes;
+
+	/* completion queue */
+	unsigned int		*u_cq_head;
+	unsigned int		*u_cq_tail;
+	unsigned int		u_cq_mask;
+	struct io_uring_cqe	*u_cqes;
+
+	void			*u_sq_map;
+	size_t			u_sq_map_sz;
+	void			*u_cq_map;
+	size_t			u_cq_map_sz;
+	size_t			u_sqe_map_sz;
+};
+
+_private int uring_init(struct uring *u, unsigned int entries);
+_private void uring_fini(struct uring *u);
+_private struct io_uring_sqe *uring_get_sqe(struct uring *u);
+_private int uring_submit(struct uring *u, unsigned int wait_nr, int mto);
+_private struct io_uring_cqe *uring_peek_cqe(struct uring *u);
+_private void uring_cqe_seen(struct uring *u);
+_private int uring_register(struct uring *u, unsigned int op,
+				void *arg, unsigned int nr_args);
+
+#endif /* _URING_H */
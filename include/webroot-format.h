@@ -10,44 +10,81 @@
  *  - Mapped
  *      Header
  *      Trie edges
+ *      URI hash: displacements, slots, key string table
  *      Redirect objects
  *	File objects
  *      Mime string table
  *      Redirect string table
+ *      Response header table, small files are stored inline
+ *      straight after their 200 header, as are small compressed
+ *      variants
  * - Not mapped
  *      Data
  *
  * Notes on limits:
  *  - max 2^24 - 1 files
- *  - 4GB of combined mime types and redirects
+ *  - URIs up to 64KB each
 */
 
 #define WEBROOT_MAGIC		((0x37 << 24) | (0x13 << 16) | 'W' << 8 | 'w')
-#define WEBROOT_CURRENT_VER	3
+#define WEBROOT_CURRENT_VER	9
 struct webroot_hdr {
 	uint32_t	h_num_edges;
 	uint32_t	h_num_redirect;
 	uint32_t	h_num_file;
-	uint32_t	h_strtab_sz; /* all strings */
+	uint32_t	h_hash_seed;
 	uint32_t	h_magic;
 	uint32_t	h_vers;
-	uint32_t	h_files_begin;
-	uint32_t	h__pad;
+	uint32_t	h_hash_buckets;
+	uint32_t	h_hash_keys; /* also the number of slots */
+	uint64_t	h_hash_strtab_sz;
+	uint64_t	h_strtab_sz; /* all strings */
+	uint64_t	h_files_begin;
 } _packed;
 
 #define WEBROOT_DIGEST_LEN	20
+
+/* Precompressed variants of a file, each is a complete representation
+ * with its own etag and headers. Absent if e_len is zero.
+ */
+#define WEBROOT_ENC_GZIP	0
+#define WEBROOT_ENC_BROTLI	1
+#define WEBROOT_ENC_ZSTD	2
+#define WEBROOT_NUM_ENC		3
+struct webroot_enc {
+	uint64_t e_off;
+	uint64_t e_len;
+	uint8_t e_digest[WEBROOT_DIGEST_LEN];
+	uint64_t e_hdr200;
+	uint32_t e_hdr200_len;
+	uint64_t e_hdr304;
+	uint32_t e_hdr304_len;
+} _packed;
+
+/* Files whose data lies before h_files_begin are inline, f_off is
+ * still a file offset so they can be served like any other.
+ */
 struct webroot_file {
 	uint64_t f_off;
 	uint64_t f_len;
-	uint32_t f_type;
+	uint64_t f_type;
 	uint32_t f_type_len;
 	uint32_t f_modified;
 	uint8_t f_digest[WEBROOT_DIGEST_LEN];
+	/* Ready made response headers, everything up to but not
+	 * including the per-request Connection and Date headers.
+	 * Each header line is terminated with CRLF.
+	 */
+	uint64_t f_hdr200;
+	uint32_t f_hdr200_len;
+	uint64_t f_hdr304;
+	uint32_t f_hdr304_len;
+	struct webroot_enc f_enc[WEBROOT_NUM_ENC];
 } _packed;
 
-#define WEBROOT_INVALID_REDIRECT 0xffffffffU
+#define WEBROOT_INVALID_REDIRECT 0xffffffffffffffffULL
 struct webroot_redirect {
-	uint32_t r_off;
+	uint64_t r_off;
 	uint32_t r_len;
 } _packed;
 
@@ -63,4 +100,81 @@ struct trie_dedge {
 	uint8_t		re_str[RE_EDGE_MAX];
 }_packed;
 
+/* Minimal perfect hash of every URI (CHD). The hash of a URI picks a
+ * bucket, the bucket's displacements then pick the URI's slot. Any
+ * string at all hashes to some slot so the key has to be compared, the
+ * tag saves touching the key for most misses. s_key is an offset in to
+ * the key string table.
+ */
+struct webroot_hdisp {
+	uint32_t	d_mul;
+	uint32_t	d_add;
+} _packed;
+
+struct webroot_hslot {
+	uint64_t	s_key;
+	gidx_oid_t	s_oid;
+	uint16_t	s_len;
+	uint16_t	s_tag;
+} _packed;
+
+#define WEBROOT_HASH_M1	0x9e3779b97f4a7c15ULL
+#define WEBROOT_HASH_M2	0x87c37b91114253d5ULL
+
+static inline uint64_t webroot_hash_fmix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* h[0] gives the bucket and the first slot hash, h[1] the second slot
+ * hash and the tag
+ */
+static inline void webroot_hash(const uint8_t *p, size_t len,
+				uint32_t seed, uint64_t h[2])
+{
+	uint64_t x = seed ^ (len * WEBROOT_HASH_M1);
+	uint64_t w;
+
+	for(; len >= sizeof(w); p += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		w *= WEBROOT_HASH_M2;
+		x ^= (w << 31) | (w >> 33);
+		x = ((x << 27) | (x >> 37)) * WEBROOT_HASH_M1;
+	}
+
+	if ( len ) {
+		w = 0;
+		memcpy(&w, p, len);
+		w *= WEBROOT_HASH_M2;
+		x ^= (w << 31) | (w >> 33);
+	}
+
+	h[0] = webroot_hash_fmix(x);
+	h[1] = webroot_hash_fmix(h[0] ^ WEBROOT_HASH_M2);
+}
+
+static inline uint32_t webroot_hash_bucket(const uint64_t h[2],
+						uint32_t nr_buckets)
+{
+	return ((h[0] >> 32) * nr_buckets) >> 32;
+}
+
+static inline uint32_t webroot_hash_slot(const uint64_t h[2],
+					const struct webroot_hdisp *d,
+					uint32_t nr_keys)
+{
+	return ((uint64_t)(uint32_t)h[0] * d->d_mul +
+		(uint32_t)h[1] + d->d_add) % nr_keys;
+}
+
+static inline uint16_t webroot_hash_tag(const uint64_t h[2])
+{
+	return h[1] >> 48;
+}
+
 #endif /* _WEBROOT_FORMAT_H */
@@ -16,10 +16,11 @@
 #endif
 
 #define AIO_QUEUE_SIZE		4096
-static io_context_t aio_ctx;
-static hgang_t aio_iocbs;
-static struct nbio *efd;
-static unsigned in_flight;
+/* one AIO context per iothread */
+static __thread io_context_t aio_ctx;
+static __thread hgang_t aio_iocbs;
+static __thread struct nbio *efd;
+static __thread unsigned in_flight;
 
 static int aio_submit(struct iothread *t, http_conn_t h)
 {
@@ -141,7 +142,7 @@ static int io_async_write(struct iothread *t, http_conn_t h)
 	data_buf = http_conn_get_priv(h, NULL);
 	ptr = buf_read(data_buf, &sz);
 	data_len = http_conn_data(h, NULL, NULL);
-	if ( data_len > sz )
+	if ( data_len > sz || http_conn_pipelined(h) )
 		flags |= MSG_MORE;
 
 	ret = send(http_conn_socket(h), ptr, sz, flags);
@@ -154,7 +155,7 @@ static int io_async_write(struct iothread *t, http_conn_t h)
 
 	dprintf("Transmitted %zu\n", (size_t)ret);
 	sz = buf_done_read(data_buf, ret);
-	data_len = http_conn_data_read(h, ret);
+	data_len = http_conn_data_read(t, h, ret);
 	if ( sz ) {
 		dprintf("Partial transmit: %zu bytes left\n", sz);
 		return 1;
@@ -16,10 +16,11 @@
 #endif
 
 #define AIO_QUEUE_SIZE		4096
-static io_context_t aio_ctx;
-static hgang_t aio_iocbs;
-static struct nbio *efd;
-static unsigned in_flight;
+/* one AIO context per iothread */
+static __thread io_context_t aio_ctx;
+static __thread hgang_t aio_iocbs;
+static __thread struct nbio *efd;
+static __thread unsigned in_flight;
 
 static int aio_submit(struct iothread *t, http_conn_t h)
 {
@@ -59,7 +60,7 @@ static void handle_completion(struct iothread *t, struct iocb *iocb,
 
 	if ( ret > 0 ) {
 		size_t data_len;
-		data_len = http_conn_data_read(h, ret);
+		data_len = http_conn_data_read(t, h, ret);
 		if ( data_len ) {
 			printf("re-submit from completion\n");
 			if ( !aio_submit(t, h) )
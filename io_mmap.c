@@ -0,0 +1,288 @@
+/*
+ * Send file data straight out of a mapping of the whole webroot with
+ * MSG_ZEROCOPY. The kernel tells us when it's done with the pages via the
+ * socket error queue, until then the conn holds a ref on the webroot.
+*/
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <errno.h>
+
+#include <ashttpd.h>
+#include <ashttpd-conn.h>
+#include <ashttpd-fio.h>
+#include <hgang.h>
+
+#if 0
+#define dprintf printf
+#else
+#define dprintf(x...) do {} while(0)
+#endif
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY		60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY		0x4000000
+#endif
+
+/* Page pinning and the notification cost more than copying small sends */
+#define MMAP_CHUNK		(1 << 18)
+#define ZC_MIN			(1 << 14)
+
+/* Reap before there's so much outstanding that the kernel runs out of
+ * optmem for notifications
+ */
+#define ZC_MAX_PENDING		64
+
+#define ZC_ON			(1 << 0)
+#define ZC_OFF			(1 << 1) /* unsupported, or always copied */
+
+/* Per-connection zerocopy state, every send with MSG_ZEROCOPY gets the
+ * next sequence number and notifications complete ranges of them. Only
+ * one webroot is pinned at a time, a conn which moves to another with
+ * sends still outstanding just copies until they're done.
+ */
+struct zc_sock {
+	webroot_t	zs_root;
+	uint32_t	zs_sent;
+	uint32_t	zs_done;
+	unsigned int	zs_flags;
+};
+
+static __thread hgang_t zc_socks;
+
+static uint32_t zc_pending(const struct zc_sock *zs)
+{
+	return zs->zs_sent - zs->zs_done;
+}
+
+/* Returns how many notifications were reaped or -1 on a real error */
+static int zc_reap(struct zc_sock *zs, int fd)
+{
+	uint8_t cbuf[CMSG_SPACE(sizeof(struct sock_extended_err) +
+				sizeof(struct sockaddr_in6))];
+	struct sock_extended_err *serr;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	int n = 0;
+
+	for(;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+
+		if ( recvmsg(fd, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) < 0 ) {
+			if ( errno == EAGAIN || errno == EINTR )
+				break;
+			return -1;
+		}
+
+		cm = CMSG_FIRSTHDR(&msg);
+		if ( NULL == cm )
+			return -1;
+		if ( !(cm->cmsg_level == SOL_IP &&
+				cm->cmsg_type == IP_RECVERR) &&
+			!(cm->cmsg_level == SOL_IPV6 &&
+				cm->cmsg_type == IPV6_RECVERR) )
+			return -1;
+
+		serr = (struct sock_extended_err *)CMSG_DATA(cm);
+		if ( serr->ee_errno ||
+				serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY )
+			return -1;
+
+		/* kernel fell back to copying, eg. loopback, so stop */
+		if ( serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED )
+			zs->zs_flags |= ZC_OFF;
+
+		dprintf("zerocopy: %u - %u done\n", serr->ee_info, serr->ee_data);
+		zs->zs_done += serr->ee_data - serr->ee_info + 1;
+		n++;
+	}
+
+	if ( zs->zs_root && !zc_pending(zs) ) {
+		webroot_unref(zs->zs_root);
+		zs->zs_root = NULL;
+	}
+
+	return n;
+}
+
+static int zc_enable(struct zc_sock *zs, int fd)
+{
+	int one = 1;
+
+	if ( zs->zs_flags & (ZC_ON|ZC_OFF) )
+		return !(zs->zs_flags & ZC_OFF);
+
+	if ( setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) ) {
+		zs->zs_flags |= ZC_OFF;
+		return 0;
+	}
+
+	zs->zs_flags |= ZC_ON;
+	return 1;
+}
+
+static int zc_ok(struct zc_sock *zs, int fd, webroot_t root, size_t len)
+{
+	if ( len < ZC_MIN || (zs->zs_flags & ZC_OFF) )
+		return 0;
+	if ( zc_pending(zs) >= ZC_MAX_PENDING && zc_reap(zs, fd) < 0 )
+		return 0;
+	if ( zs->zs_root && zs->zs_root != root )
+		return 0;
+	return zc_enable(zs, fd);
+}
+
+static void zc_sent(struct zc_sock *zs, webroot_t root)
+{
+	if ( NULL == zs->zs_root )
+		zs->zs_root = webroot_ref(root);
+	zs->zs_sent++;
+}
+
+static int io_mmap_init(struct iothread *t)
+{
+	if ( !os_sigpipe_ignore() )
+		return 0;
+
+	zc_socks = hgang_new(sizeof(struct zc_sock), 0);
+	if ( NULL == zc_socks )
+		return 0;
+
+	return 1;
+}
+
+static int io_mmap_write(struct iothread *t, http_conn_t h)
+{
+	struct zc_sock *zs = http_conn_get_sock_priv(h);
+	webroot_t root = http_conn_webroot(h);
+	int fd = http_conn_socket(h);
+	int flags = MSG_NOSIGNAL;
+	const uint8_t *ptr;
+	size_t len, sz;
+	ssize_t ret;
+	off_t off;
+
+	len = http_conn_data(h, NULL, &off);
+	sz = (len > MMAP_CHUNK) ? MMAP_CHUNK : len;
+
+	/* checked by prep */
+	ptr = webroot_data(root, off, sz);
+	assert(NULL != ptr);
+
+	if ( len > sz || http_conn_pipelined(h) )
+		flags |= MSG_MORE;
+	if ( zc_ok(zs, fd, root, sz) )
+		flags |= MSG_ZEROCOPY;
+
+again:
+	ret = send(fd, ptr, sz, flags);
+	if ( ret < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY) ) {
+		/* notifications are backed up, just copy this one */
+		if ( zc_reap(zs, fd) < 0 )
+			return 0;
+		flags &= ~MSG_ZEROCOPY;
+		goto again;
+	}else if ( ret < 0 && errno == EOPNOTSUPP && (flags & MSG_ZEROCOPY) ) {
+		/* kTLS sockets can't do it, still skips a copy to userspace */
+		zs->zs_flags |= ZC_OFF;
+		flags &= ~MSG_ZEROCOPY;
+		goto again;
+	}else if ( ret < 0 && errno == EAGAIN ) {
+		http_conn_inactive(t, h);
+		return 1;
+	}else if ( ret <= 0 ) {
+		return 0;
+	}
+
+	if ( flags & MSG_ZEROCOPY )
+		zc_sent(zs, root);
+
+	dprintf("mmap: sent %zd/%zu bytes%s\n", ret, len,
+		(flags & MSG_ZEROCOPY) ? " zerocopy" : "");
+	if ( !http_conn_data_read(t, h, ret) )
+		http_conn_data_complete(t, h);
+
+	return 1;
+}
+
+static int io_mmap_prep(struct iothread *t, http_conn_t h)
+{
+	size_t len;
+	off_t off;
+
+	len = http_conn_data(h, NULL, &off);
+	if ( NULL == webroot_data(http_conn_webroot(h), off, len) )
+		return 0;
+
+	if ( NULL == http_conn_get_sock_priv(h) ) {
+		struct zc_sock *zs;
+
+		zs = hgang_alloc0(zc_socks);
+		if ( NULL == zs )
+			return 0;
+		http_conn_set_sock_priv(h, zs);
+	}
+
+	return 1;
+}
+
+static void io_mmap_abort(http_conn_t h)
+{
+}
+
+static int io_mmap_error(struct iothread *t, http_conn_t h)
+{
+	struct zc_sock *zs = http_conn_get_sock_priv(h);
+	int fd = http_conn_socket(h);
+	socklen_t len;
+	int err = 0;
+
+	if ( NULL == zs || zc_reap(zs, fd) <= 0 )
+		return 0;
+
+	len = sizeof(err);
+	if ( getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) || err )
+		return 0;
+
+	return 1;
+}
+
+/* Anything still outstanding can't be reaped once the socket is gone,
+ * but the kernel holds its own page refs and mkroot renames a new webroot
+ * over the old one rather than rewriting it, so it's safe to let the
+ * mapping go.
+ */
+static void io_mmap_close(struct iothread *t, http_conn_t h)
+{
+	struct zc_sock *zs = http_conn_get_sock_priv(h);
+
+	if ( NULL == zs )
+		return;
+
+	if ( zc_pending(zs) )
+		zc_reap(zs, http_conn_socket(h));
+	if ( zs->zs_root )
+		webroot_unref(zs->zs_root);
+
+	http_conn_set_sock_priv(h, NULL);
+	hgang_return(zc_socks, zs);
+}
+
+static void io_mmap_fini(struct iothread *t)
+{
+}
+
+struct http_fio fio_mmap = {
+	.label = "mmap MSG_ZEROCOPY",
+	.init = io_mmap_init,
+	.prep = io_mmap_prep,
+	.write = io_mmap_write,
+	.abort = io_mmap_abort,
+	.fini = io_mmap_fini,
+	.error = io_mmap_error,
+	.close = io_mmap_close,
+};
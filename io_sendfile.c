@@ -43,7 +43,7 @@ static int io_sendfile_write(struct iothread *t, http_conn_t h)
 		return 0;
 	}
 
-	if ( !http_conn_data_read(h, ret) )
+	if ( !http_conn_data_read(t, h, ret) )
 		http_conn_data_complete(t, h);
 
 	return 1;
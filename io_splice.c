@@ -0,0 +1,151 @@
+/*
+ * File to pipe to socket with plain splice(), zero copy on a stock kernel.
+ * Each response borrows a pipe from the per-thread pool, one pipe full at
+ * a time goes out and if the socket fills up what's left in the pipe
+ * waits there for it to become writable.
+*/
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <errno.h>
+
+#include <ashttpd.h>
+#include <ashttpd-conn.h>
+#include <ashttpd-fio.h>
+#include <pipepool.h>
+#include <hgang.h>
+
+#if 0
+#define dprintf printf
+#else
+#define dprintf(x...) do {} while(0)
+#endif
+
+struct splice_io {
+	int		sp_pipe[2];
+	size_t		sp_pipe_sz;
+	size_t		sp_in_pipe;
+};
+
+static __thread hgang_t splice_ios;
+
+static void sp_free(struct splice_io *sp)
+{
+	pipepool_put(sp->sp_pipe, sp->sp_pipe_sz, 0 == sp->sp_in_pipe);
+	hgang_return(splice_ios, sp);
+}
+
+static int io_splice_init(struct iothread *t)
+{
+	if ( !os_sigpipe_ignore() )
+		return 0;
+
+	splice_ios = hgang_new(sizeof(struct splice_io), 0);
+	if ( NULL == splice_ios )
+		return 0;
+
+	return 1;
+}
+
+/* Only once the pipe is drained, the data in it is from h_data_off */
+static int fill_pipe(struct splice_io *sp, http_conn_t h)
+{
+	size_t data_len, len;
+	off_t data_off;
+	ssize_t ret;
+	int fd;
+
+	data_len = http_conn_data(h, &fd, &data_off);
+	len = (data_len < sp->sp_pipe_sz) ? data_len : sp->sp_pipe_sz;
+
+	ret = splice(fd, &data_off, sp->sp_pipe[1], NULL, len,
+			SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	if ( ret <= 0 ) {
+		fprintf(stderr, "splice: %s\n", (ret) ? os_err() : "short file");
+		return 0;
+	}
+
+	dprintf("splice: %zd bytes in to pipe\n", ret);
+	sp->sp_in_pipe = ret;
+	return 1;
+}
+
+static int io_splice_write(struct iothread *t, http_conn_t h)
+{
+	unsigned int flags = SPLICE_F_MOVE|SPLICE_F_NONBLOCK;
+	struct splice_io *sp;
+	size_t data_len;
+	ssize_t ret;
+
+	sp = http_conn_get_priv(h, NULL);
+
+	if ( 0 == sp->sp_in_pipe && !fill_pipe(sp, h) )
+		return 0;
+
+	data_len = http_conn_data(h, NULL, NULL);
+	if ( data_len > sp->sp_in_pipe || http_conn_pipelined(h) )
+		flags |= SPLICE_F_MORE;
+
+	ret = splice(sp->sp_pipe[0], NULL, http_conn_socket(h), NULL,
+			sp->sp_in_pipe, flags);
+	if ( ret < 0 && errno == EAGAIN ) {
+		/* partially drained pipe stays with the conn */
+		http_conn_inactive(t, h);
+		return 1;
+	}else if ( ret <= 0 ) {
+		return 0;
+	}
+
+	dprintf("splice: %zd bytes out of pipe\n", ret);
+	sp->sp_in_pipe -= ret;
+	if ( http_conn_data_read(t, h, ret) )
+		return 1;
+
+	http_conn_set_priv(h, NULL, 0);
+	sp_free(sp);
+	http_conn_data_complete(t, h);
+	return 1;
+}
+
+static int io_splice_prep(struct iothread *t, http_conn_t h)
+{
+	struct splice_io *sp;
+
+	sp = hgang_alloc0(splice_ios);
+	if ( NULL == sp )
+		return 0;
+
+	sp->sp_pipe_sz = pipepool_get(sp->sp_pipe);
+	if ( !sp->sp_pipe_sz ) {
+		hgang_return(splice_ios, sp);
+		return 0;
+	}
+
+	http_conn_set_priv(h, sp, 0);
+	return 1;
+}
+
+static void io_splice_abort(http_conn_t h)
+{
+	struct splice_io *sp;
+
+	sp = http_conn_get_priv(h, NULL);
+	if ( NULL == sp )
+		return;
+
+	http_conn_set_priv(h, NULL, 0);
+	sp_free(sp);
+}
+
+static void io_splice_fini(struct iothread *t)
+{
+	pipepool_fini();
+}
+
+struct http_fio fio_splice = {
+	.label = "Synchronous splice",
+	.init = io_splice_init,
+	.prep = io_splice_prep,
+	.write = io_splice_write,
+	.abort = io_splice_abort,
+	.fini = io_splice_fini,
+};
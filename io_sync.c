@@ -46,11 +46,11 @@ static int io_sync_write(struct iothread *t, http_conn_t h)
 
 		dprintf("Read %u bytes in to buffer\n", sz);
 		buf_done_write(data_buf, sz);
-		http_conn_data_read(h, sz);
+		http_conn_data_read(t, h, sz);
 		data_len -= sz;
 	}
 
-	if ( data_len )
+	if ( data_len || http_conn_pipelined(h) )
 		flags |= MSG_MORE;
 
 	rptr = buf_read(data_buf, &rsz);
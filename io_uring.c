@@ -0,0 +1,419 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <ashttpd.h>
+#include <ashttpd-conn.h>
+#include <ashttpd-buf.h>
+#include <ashttpd-fio.h>
+#include <nbio-eventfd.h>
+#include <hgang.h>
+#include <uring.h>
+#include <pipepool.h>
+
+#if 0
+#define dprintf printf
+#else
+#define dprintf(x...) do {} while(0)
+#endif
+
+#define URING_QUEUE_SIZE	256
+
+/* One in flight file operation, the conn may be aborted while the
+ * read is still in flight in which case io_conn is NULL'd and the
+ * completion cleans up.
+ */
+struct uring_io {
+	http_conn_t		io_conn;
+	struct http_buf		*io_buf;
+	int			io_pipe[2];
+	size_t			io_pipe_sz;
+	size_t			io_in_pipe;
+	unsigned int		io_busy;
+};
+
+/* one ring per iothread, completions are signalled through an eventfd
+ * which is registered with the ring
+ */
+static __thread struct uring ring;
+static __thread hgang_t uring_ios;
+static __thread struct nbio *efd;
+static __thread unsigned int in_flight;
+
+/* Submission is deferred until everything on the active list has had a
+ * go so that the reads for a whole batch of connections go in with one
+ * syscall. The flush nbio gets woken for each new sqe which puts it at
+ * the end of the active list.
+ */
+static __thread struct nbio flush;
+
+static void io_free(struct uring_io *io)
+{
+	if ( io->io_buf )
+		buf_free_data(io->io_buf);
+	if ( io->io_pipe[0] >= 0 )
+		pipepool_put(io->io_pipe, io->io_pipe_sz,
+				0 == io->io_in_pipe);
+	hgang_return(uring_ios, io);
+}
+
+static struct io_uring_sqe *io_sqe(struct iothread *t, struct uring_io *io)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(&ring);
+	if ( NULL == sqe ) {
+		fprintf(stderr, "uring: submission queue full\n");
+		return NULL;
+	}
+
+	sqe->user_data = (uint64_t)(uintptr_t)io;
+	io->io_busy = 1;
+	in_flight++;
+	nbio_wake(t, &flush, NBIO_READ);
+	return sqe;
+}
+
+static int read_submit(struct iothread *t, http_conn_t h, struct uring_io *io)
+{
+	struct io_uring_sqe *sqe;
+	size_t data_len;
+	off_t data_off;
+	uint8_t *ptr;
+	size_t sz;
+	int fd;
+
+	data_len = http_conn_data(h, &fd, &data_off);
+	assert(data_len);
+
+	ptr = buf_write(io->io_buf, &sz);
+	sz = (data_len < sz) ? data_len : sz;
+
+	sqe = io_sqe(t, io);
+	if ( NULL == sqe )
+		return 0;
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)ptr;
+	sqe->len = sz;
+	sqe->off = data_off;
+
+	dprintf("uring: read: %zu bytes\n", sz);
+	http_conn_to_waitq(t, h, NULL);
+	return 1;
+}
+
+/* File to pipe in the ring, it goes async so a page cache miss doesn't
+ * stall us. Pipe to socket is done with plain non-blocking splice().
+ */
+static int splice_submit(struct iothread *t, http_conn_t h,
+			struct uring_io *io)
+{
+	struct io_uring_sqe *sqe;
+	size_t data_len;
+	off_t data_off;
+	int fd;
+
+	data_len = http_conn_data(h, &fd, &data_off);
+	assert(data_len);
+	assert(0 == io->io_in_pipe);
+
+	sqe = io_sqe(t, io);
+	if ( NULL == sqe )
+		return 0;
+
+	sqe->opcode = IORING_OP_SPLICE;
+	sqe->splice_fd_in = fd;
+	sqe->splice_off_in = data_off;
+	sqe->fd = io->io_pipe[1];
+	sqe->off = (uint64_t)-1;
+	sqe->len = (data_len < io->io_pipe_sz) ? data_len : io->io_pipe_sz;
+	sqe->splice_flags = SPLICE_F_MOVE;
+
+	dprintf("uring: splice: %u bytes\n", sqe->len);
+	http_conn_to_waitq(t, h, NULL);
+	return 1;
+}
+
+static void handle_completion(struct iothread *t, struct uring_io *io, int ret)
+{
+	http_conn_t h = io->io_conn;
+
+	io->io_busy = 0;
+	in_flight--;
+
+	/* conn went away while we were busy, a splice may still have
+	 * filled the pipe so it mustn't go back in the pool as empty
+	 */
+	if ( NULL == h ) {
+		if ( ret > 0 && NULL == io->io_buf )
+			io->io_in_pipe += ret;
+		io_free(io);
+		return;
+	}
+
+	if ( ret <= 0 ) {
+		errno = -ret;
+		fprintf(stderr, "uring: %s\n", (ret) ? os_err() : "short file");
+		http_conn_abort(t, h);
+		return;
+	}
+
+	if ( io->io_buf )
+		buf_done_write(io->io_buf, ret);
+	else
+		io->io_in_pipe += ret;
+
+	http_conn_wake_one(t, h);
+}
+
+static void uring_event(struct iothread *t, void *priv, eventfd_t val)
+{
+	struct io_uring_cqe *cqe;
+
+	while ( (cqe = uring_peek_cqe(&ring)) ) {
+		struct uring_io *io = (struct uring_io *)(uintptr_t)cqe->user_data;
+		int res = cqe->res;
+
+		uring_cqe_seen(&ring);
+		handle_completion(t, io, res);
+	}
+}
+
+static void flush_read(struct iothread *t, struct nbio *n)
+{
+	uring_submit(&ring, 0, 0);
+	nbio_set_wait(t, n, 0);
+}
+
+static void flush_dtor(struct iothread *t, struct nbio *n)
+{
+}
+
+static const struct nbio_ops flush_ops = {
+	.read = flush_read,
+	.dtor = flush_dtor,
+};
+
+static int io_uring_init(struct iothread *t)
+{
+	int fd;
+
+	if ( !os_sigpipe_ignore() )
+		return 0;
+
+	if ( !uring_init(&ring, URING_QUEUE_SIZE) ) {
+		fprintf(stderr, "io_uring_setup: %s\n", os_err());
+		return 0;
+	}
+
+	uring_ios = hgang_new(sizeof(struct uring_io), 0);
+	if ( NULL == uring_ios )
+		return 0;
+
+	efd = nbio_eventfd_new(0, uring_event, NULL);
+	if ( NULL == efd )
+		return 0;
+
+	fd = efd->fd;
+	if ( uring_register(&ring, IORING_REGISTER_EVENTFD, &fd, 1) ) {
+		fprintf(stderr, "io_uring_register: %s\n", os_err());
+		return 0;
+	}
+
+	nbio_eventfd_add(t, efd);
+
+	flush.fd = -1;
+	flush.ops = &flush_ops;
+	nbio_add(t, &flush, 0);
+	return 1;
+}
+
+static int io_uring_prep(struct iothread *t, http_conn_t h)
+{
+	struct uring_io *io;
+
+	io = hgang_alloc0(uring_ios);
+	if ( NULL == io )
+		return 0;
+
+	io->io_conn = h;
+	io->io_pipe[0] = io->io_pipe[1] = -1;
+
+	io->io_buf = buf_alloc_data();
+	if ( NULL == io->io_buf ) {
+		printf("OOM on data...\n");
+		goto err;
+	}
+
+	http_conn_set_priv(h, io, 0);
+	if ( !read_submit(t, h, io) )
+		goto err_priv;
+
+	return 1;
+
+err_priv:
+	http_conn_set_priv(h, NULL, 0);
+err:
+	io_free(io);
+	return 0;
+}
+
+static int io_uring_splice_prep(struct iothread *t, http_conn_t h)
+{
+	struct uring_io *io;
+
+	io = hgang_alloc0(uring_ios);
+	if ( NULL == io )
+		return 0;
+
+	io->io_conn = h;
+	io->io_pipe_sz = pipepool_get(io->io_pipe);
+	if ( !io->io_pipe_sz ) {
+		io->io_pipe[0] = io->io_pipe[1] = -1;
+		goto err;
+	}
+
+	http_conn_set_priv(h, io, 0);
+	if ( !splice_submit(t, h, io) )
+		goto err_priv;
+
+	return 1;
+
+err_priv:
+	http_conn_set_priv(h, NULL, 0);
+err:
+	io_free(io);
+	return 0;
+}
+
+static int io_uring_write(struct iothread *t, http_conn_t h)
+{
+	struct uring_io *io;
+	int flags = MSG_NOSIGNAL;
+	const uint8_t *ptr;
+	size_t data_len;
+	ssize_t ret;
+	size_t sz;
+
+	io = http_conn_get_priv(h, NULL);
+
+	/* woken early, eg. by header completing */
+	if ( io->io_busy ) {
+		http_conn_to_waitq(t, h, NULL);
+		return 1;
+	}
+
+	ptr = buf_read(io->io_buf, &sz);
+	data_len = http_conn_data(h, NULL, NULL);
+	if ( data_len > sz || http_conn_pipelined(h) )
+		flags |= MSG_MORE;
+
+	ret = send(http_conn_socket(h), ptr, sz, flags);
+	if ( ret < 0 && errno == EAGAIN ) {
+		http_conn_inactive(t, h);
+		return 1;
+	}else if ( ret <= 0 ) {
+		return 0;
+	}
+
+	sz = buf_done_read(io->io_buf, ret);
+	data_len = http_conn_data_read(t, h, ret);
+	if ( sz )
+		return 1;
+
+	if ( data_len ) {
+		buf_reset(io->io_buf);
+		return read_submit(t, h, io);
+	}
+
+	http_conn_set_priv(h, NULL, 0);
+	io_free(io);
+	http_conn_data_complete(t, h);
+	return 1;
+}
+
+static int io_uring_splice_write(struct iothread *t, http_conn_t h)
+{
+	struct uring_io *io;
+	unsigned int flags = SPLICE_F_MOVE|SPLICE_F_NONBLOCK;
+	size_t data_len;
+	ssize_t ret;
+
+	io = http_conn_get_priv(h, NULL);
+
+	if ( io->io_busy ) {
+		http_conn_to_waitq(t, h, NULL);
+		return 1;
+	}
+
+	data_len = http_conn_data(h, NULL, NULL);
+	if ( data_len > io->io_in_pipe || http_conn_pipelined(h) )
+		flags |= SPLICE_F_MORE;
+
+	ret = splice(io->io_pipe[0], NULL, http_conn_socket(h), NULL,
+			io->io_in_pipe, flags);
+	if ( ret < 0 && errno == EAGAIN ) {
+		http_conn_inactive(t, h);
+		return 1;
+	}else if ( ret <= 0 ) {
+		return 0;
+	}
+
+	io->io_in_pipe -= ret;
+	data_len = http_conn_data_read(t, h, ret);
+	if ( io->io_in_pipe )
+		return 1;
+
+	if ( data_len )
+		return splice_submit(t, h, io);
+
+	http_conn_set_priv(h, NULL, 0);
+	io_free(io);
+	http_conn_data_complete(t, h);
+	return 1;
+}
+
+static void io_uring_abort(http_conn_t h)
+{
+	struct uring_io *io;
+
+	io = http_conn_get_priv(h, NULL);
+	if ( NULL == io )
+		return;
+
+	http_conn_set_priv(h, NULL, 0);
+	if ( io->io_busy ) {
+		io->io_conn = NULL;
+		return;
+	}
+
+	io_free(io);
+}
+
+static void io_uring_fini(struct iothread *t)
+{
+	pipepool_fini();
+	uring_fini(&ring);
+}
+
+struct http_fio fio_uring = {
+	.label = "io_uring read",
+	.prep = io_uring_prep,
+	.write = io_uring_write,
+	.abort = io_uring_abort,
+	.init = io_uring_init,
+	.fini = io_uring_fini,
+};
+
+struct http_fio fio_uring_splice = {
+	.label = "io_uring splice",
+	.prep = io_uring_splice_prep,
+	.write = io_uring_splice_write,
+	.abort = io_uring_abort,
+	.init = io_uring_init,
+	.fini = io_uring_fini,
+};
@@ -0,0 +1,701 @@
+/*
+ * Microbenchmarks for each step of answering a GET: finding the end of
+ * the header, parsing it, normalising the URI, picking the vhost, looking
+ * up the file and formatting the response header. Requests come from the
+ * browser corpus, or a recording of what clients sent, and files from a
+ * webroot generated with mkroot. Time, cycles and cache misses per op are
+ * from perf_event_open(), when the kernel lets us have them.
+*/
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <linux/perf_event.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <ftw.h>
+#include <time.h>
+#include <stdarg.h>
+#include <limits.h>
+
+#include <ashttpd.h>
+#include <http-parse.h>
+#include <http-req.h>
+#include <http-fmt.h>
+#include <normalize.h>
+#include <bench-corpus.h>
+
+#define BENCH_SECS	0.3
+#define DEFAULT_FILES	20000
+#define DEFAULT_VHOSTS	256
+#define NR_DIRS		64
+
+static const char *cmd = "microbench";
+
+struct req {
+	const uint8_t	*ptr;
+	size_t		len;
+};
+
+static struct req *reqs;
+static unsigned int nr_reqs;
+
+/* the generated webroot, lookups miss one time in eight */
+static struct ro_vec *uris;
+static unsigned int nr_uris;
+static struct ro_vec *nads_uris;
+static unsigned int nr_nads_uris;
+static char **hosts;
+static unsigned int nr_hosts;
+static struct webroot_name *names;
+static unsigned int nr_names;
+
+static webroot_t root;
+static vhosts_t vhosts;
+static char tmpdir[] = "/tmp/microbench.XXXXXX";
+
+static volatile unsigned long sink;
+
+static void bench_parse_incremental(unsigned long n)
+{
+	unsigned long i;
+	unsigned int j;
+
+	for(i = j = 0; i < n; i++) {
+		const uint8_t *p = reqs[j].ptr;
+		uint8_t state = RSTATE_INITIAL;
+
+		http_parse_incremental(&state, &p, reqs[j].ptr + reqs[j].len);
+		sink += p - reqs[j].ptr;
+		if ( ++j == nr_reqs )
+			j = 0;
+	}
+}
+
+static void bench_http_req(unsigned long n)
+{
+	struct http_request r;
+	unsigned long i;
+	unsigned int j;
+
+	for(i = j = 0; i < n; i++) {
+		memset(&r, 0, sizeof(r));
+		sink += http_req(&r, reqs[j].ptr, reqs[j].len);
+		if ( ++j == nr_reqs )
+			j = 0;
+	}
+}
+
+static void bench_nads_normalize(unsigned long n)
+{
+	struct nads nads;
+	unsigned long i;
+	unsigned int j;
+
+	for(i = j = 0; i < n; i++) {
+		nads.buf = (const char *)nads_uris[j].v_ptr;
+		nads.buf_len = nads_uris[j].v_len;
+		sink += nads_normalize(&nads);
+		if ( ++j == nr_nads_uris )
+			j = 0;
+	}
+}
+
+static void bench_vhosts_lookup(unsigned long n)
+{
+	unsigned long i;
+	unsigned int j;
+
+	for(i = j = 0; i < n; i++) {
+		sink += (uintptr_t)vhosts_lookup(vhosts, hosts[j]);
+		if ( ++j == nr_hosts )
+			j = 0;
+	}
+}
+
+static void bench_webroot_find(unsigned long n)
+{
+	struct webroot_name name;
+	unsigned long i;
+	unsigned int j;
+
+	for(i = j = 0; i < n; i++) {
+		sink += webroot_find(root, &uris[j], HTTP_ACCEPT_ALL, &name);
+		if ( ++j == nr_uris )
+			j = 0;
+	}
+}
+
+/* what handle_get() does with a 200 */
+static void bench_resp_header(unsigned long n)
+{
+	uint8_t buf[4096];
+	struct resp res;
+	unsigned long i;
+	unsigned int j;
+
+	for(i = j = 0; i < n; i++) {
+		const struct ro_vec *hdr = &names[j].u.data.f_hdr200;
+
+		res.r_ptr = buf;
+		res.r_end = buf + sizeof(buf);
+		res.r_len = 0;
+		resp_string(&res, hdr->v_ptr, hdr->v_len);
+		resp_end(&res, 0);
+		sink += res.r_len;
+		if ( ++j == nr_names )
+			j = 0;
+	}
+}
+
+static const struct bench {
+	const char	*name;
+	void		(*fn)(unsigned long n);
+}benches[] = {
+	{"parse_incremental", bench_parse_incremental},
+	{"http_req", bench_http_req},
+	{"nads_normalize", bench_nads_normalize},
+	{"vhosts_lookup", bench_vhosts_lookup},
+	{"webroot_find", bench_webroot_find},
+	{"resp_header", bench_resp_header},
+};
+
+#define NR_BENCHES	(sizeof(benches)/sizeof(*benches))
+
+struct result {
+	unsigned long	ops;
+	double		ns;
+	uint64_t	cycles;
+	uint64_t	misses;
+	int		have_pmu;
+};
+
+/* cycles leads a group with cache misses, -1 if there's no PMU */
+static int pmu_cycles = -1;
+static int pmu_misses = -1;
+
+static int perf_open(uint64_t config, int group)
+{
+	struct perf_event_attr pe;
+
+	memset(&pe, 0, sizeof(pe));
+	pe.type = PERF_TYPE_HARDWARE;
+	pe.size = sizeof(pe);
+	pe.config = config;
+	pe.disabled = (group < 0);
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+	pe.read_format = PERF_FORMAT_GROUP;
+	return syscall(__NR_perf_event_open, &pe, 0, -1, group, 0);
+}
+
+static void pmu_init(void)
+{
+	pmu_cycles = perf_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+	if ( pmu_cycles < 0 )
+		goto err;
+
+	pmu_misses = perf_open(PERF_COUNT_HW_CACHE_MISSES, pmu_cycles);
+	if ( pmu_misses < 0 ) {
+		close(pmu_cycles);
+		pmu_cycles = -1;
+		goto err;
+	}
+
+	return;
+err:
+	fprintf(stderr, "%s: perf_event_open: %s, timing only\n",
+		cmd, os_err());
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const struct bench *b, struct result *res)
+{
+	struct {
+		uint64_t nr;
+		uint64_t val[2];
+	}rf;
+	unsigned long n;
+	double start, secs;
+
+	/* warm up and find out how many ops take BENCH_SECS */
+	for(n = 1024; ; n *= 2) {
+		start = now();
+		(*b->fn)(n);
+		secs = now() - start;
+		if ( secs >= BENCH_SECS / 10 )
+			break;
+	}
+	n = n * (BENCH_SECS / secs) + 1;
+
+	if ( pmu_cycles >= 0 ) {
+		ioctl(pmu_cycles, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(pmu_cycles, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+
+	start = now();
+	(*b->fn)(n);
+	secs = now() - start;
+
+	res->have_pmu = 0;
+	if ( pmu_cycles >= 0 ) {
+		ioctl(pmu_cycles, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+		if ( read(pmu_cycles, &rf, sizeof(rf)) == sizeof(rf) ) {
+			res->cycles = rf.val[0];
+			res->misses = rf.val[1];
+			res->have_pmu = 1;
+		}
+	}
+
+	res->ops = n;
+	res->ns = secs * 1e9;
+}
+
+/* Requests back to back, as a client sent them */
+static int load_corpus(const char *fn)
+{
+	const uint8_t *buf, *p, *req, *end;
+	size_t sz;
+	int fd, ret = 0;
+
+	fd = open(fn, O_RDONLY);
+	if ( fd < 0 ) {
+		fprintf(stderr, "%s: %s: %s\n", cmd, fn, os_err());
+		return 0;
+	}
+
+	buf = map_file(fd, &sz);
+	if ( NULL == buf ) {
+		fprintf(stderr, "%s: %s: %s\n", cmd, fn, os_err());
+		goto out_close;
+	}
+
+	/* every request ends with at least two bytes of "\n\n" */
+	reqs = calloc(sz / 2 + 1, sizeof(*reqs));
+	if ( NULL == reqs )
+		goto out_close;
+
+	for(p = req = buf, end = buf + sz; p < end; ) {
+		uint8_t state = RSTATE_INITIAL;
+
+		if ( !http_parse_incremental(&state, &p, end) )
+			break;
+		p++;
+		reqs[nr_reqs].ptr = req;
+		reqs[nr_reqs].len = p - req;
+		nr_reqs++;
+		req = p;
+	}
+
+	if ( !nr_reqs ) {
+		fprintf(stderr, "%s: %s: no requests\n", cmd, fn);
+		goto out_close;
+	}
+
+	ret = 1;
+out_close:
+	close(fd);
+	return ret;
+}
+
+static int builtin_corpus(void)
+{
+	unsigned int i;
+
+	reqs = calloc(bench_nr_corpus, sizeof(*reqs));
+	if ( NULL == reqs )
+		return 0;
+
+	for(i = 0; i < bench_nr_corpus; i++) {
+		reqs[i].ptr = (const uint8_t *)bench_corpus[i];
+		reqs[i].len = strlen(bench_corpus[i]);
+	}
+
+	nr_reqs = bench_nr_corpus;
+	return 1;
+}
+
+static int _printf(2, 3) mkvec(struct ro_vec *v, const char *fmt, ...)
+{
+	va_list va;
+	char *str;
+	int len;
+
+	va_start(va, fmt);
+	len = vasprintf(&str, fmt, va);
+	va_end(va);
+	if ( len < 0 )
+		return 0;
+
+	v->v_ptr = (const uint8_t *)str;
+	v->v_len = len;
+	return 1;
+}
+
+static int _printf(1, 2) quiet_system(const char *fmt, ...)
+{
+	char *str;
+	va_list va;
+	int ret;
+
+	va_start(va, fmt);
+	ret = vasprintf(&str, fmt, va);
+	va_end(va);
+	if ( ret < 0 )
+		return 0;
+
+	ret = system(str);
+	free(str);
+	return (0 == ret);
+}
+
+static const char * const exts[] = {
+	"html", "css", "js", "png", "jpg", "svg", "woff2", "json",
+};
+#define NR_EXTS	(sizeof(exts)/sizeof(*exts))
+
+/* NR_DIRS directories of files, then a webroot of them */
+static int gen_webroot(const char *mkroot, unsigned int nr_files)
+{
+	char fn[PATH_MAX];
+	unsigned int i;
+	FILE *f;
+
+	snprintf(fn, sizeof(fn), "%s/www", tmpdir);
+	if ( mkdir(fn, 0755) )
+		return 0;
+
+	for(i = 0; i < NR_DIRS; i++) {
+		snprintf(fn, sizeof(fn), "%s/www/d%02u", tmpdir, i);
+		if ( mkdir(fn, 0755) )
+			return 0;
+	}
+
+	for(i = 0; i < nr_files; i++) {
+		snprintf(fn, sizeof(fn), "%s/www/d%02u/file%u.%s", tmpdir,
+			i % NR_DIRS, i, exts[i % NR_EXTS]);
+		f = fopen(fn, "w");
+		if ( NULL == f )
+			return 0;
+		fprintf(f, "This is file number %u\n", i);
+		fclose(f);
+	}
+
+	if ( !quiet_system("%s -z %s/www %s/root > /dev/null",
+				mkroot, tmpdir, tmpdir) ) {
+		fprintf(stderr, "%s: %s failed\n", cmd, mkroot);
+		return 0;
+	}
+
+	snprintf(fn, sizeof(fn), "%s/root", tmpdir);
+	root = webroot_open(fn);
+	return NULL != root;
+}
+
+static int gen_uris(unsigned int nr_files)
+{
+	struct http_request r;
+	unsigned int i;
+
+	nr_uris = nr_files + nr_files / 8;
+	uris = calloc(nr_uris, sizeof(*uris));
+	names = calloc(nr_files, sizeof(*names));
+	nr_nads_uris = nr_files + nr_files / 16 + nr_reqs;
+	nads_uris = calloc(nr_nads_uris, sizeof(*nads_uris));
+	if ( NULL == uris || NULL == names || NULL == nads_uris )
+		return 0;
+
+	/* shuffled, so it's not all one directory at a time */
+	for(i = 0; i < nr_uris; i++) {
+		unsigned int n = (i * 2654435761ULL) % nr_uris;
+		int ok;
+
+		if ( n < nr_files ) {
+			ok = mkvec(&uris[i], "/d%02u/file%u.%s",
+					n % NR_DIRS, n, exts[n % NR_EXTS]);
+		}else{
+			ok = mkvec(&uris[i], "/d%02u/nosuch%u",
+					n % NR_DIRS, n);
+		}
+		if ( !ok )
+			return 0;
+	}
+
+	/* mostly canonical, with some that need the full treatment */
+	for(i = 0; i < nr_files; i++)
+		nads_uris[i] = uris[i];
+	for(i = 0; i < nr_files / 16; i++) {
+		if ( !mkvec(&nads_uris[nr_files + i], "/d%02u/./../d%02u/x%%41",
+				i % NR_DIRS, i % NR_DIRS) )
+			return 0;
+	}
+	for(i = 0; i < nr_reqs; i++) {
+		memset(&r, 0, sizeof(r));
+		if ( http_req(&r, reqs[i].ptr, reqs[i].len) )
+			nads_uris[nr_files + nr_files / 16 + i] = r.uri;
+	}
+
+	for(i = 0; i < nr_uris; i++) {
+		if ( webroot_find(root, &uris[i], HTTP_ACCEPT_ALL,
+					&names[nr_names]) &&
+				names[nr_names].code == HTTP_FOUND )
+			nr_names++;
+	}
+
+	if ( !nr_names ) {
+		fprintf(stderr, "%s: nothing found in generated webroot\n",
+			cmd);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* vhost files are named for the host, all linked to the one webroot */
+static int gen_vhosts(unsigned int nr_vhosts)
+{
+	char fn[PATH_MAX], dir[PATH_MAX / 2];
+	unsigned int i;
+	int fd, saved;
+
+	snprintf(dir, sizeof(dir), "%s/vhosts", tmpdir);
+	if ( mkdir(dir, 0755) )
+		return 0;
+
+	nr_hosts = nr_vhosts + nr_vhosts / 8;
+	hosts = calloc(nr_hosts, sizeof(*hosts));
+	if ( NULL == hosts )
+		return 0;
+
+	for(i = 0; i < nr_hosts; i++) {
+		int ret;
+
+		if ( i < nr_vhosts ) {
+			ret = asprintf(&hosts[i], "www%u.example.com", i);
+		}else{
+			ret = asprintf(&hosts[i], "nosuch%u.example.org", i);
+		}
+		if ( ret < 0 )
+			return 0;
+		if ( i >= nr_vhosts )
+			continue;
+
+		snprintf(fn, sizeof(fn), "%s/%s", dir, hosts[i]);
+		if ( symlink("../root", fn) )
+			return 0;
+	}
+
+	snprintf(fn, sizeof(fn), "%s/__default__", dir);
+	if ( symlink("../root", fn) )
+		return 0;
+
+	/* vhosts are announced on stdout as they're added */
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	fd = open("/dev/null", O_WRONLY);
+	if ( saved < 0 || fd < 0 )
+		return 0;
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+
+	vhosts = vhosts_scan(strdup(dir));
+
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	return NULL != vhosts;
+}
+
+static int rm_one(const char *fn, const struct stat *st, int flag,
+			struct FTW *ftw)
+{
+	remove(fn);
+	return 0;
+}
+
+static void cleanup(void)
+{
+	nftw(tmpdir, rm_one, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static void print_text(const struct result *res, int *want)
+{
+	unsigned int i;
+
+	printf("%u requests, %u uris, %u vhosts\n",
+		nr_reqs, nr_uris, nr_hosts);
+	printf("%-18s %10s %10s %10s\n",
+		"benchmark", "ns/op", "cycles/op", "misses/op");
+	for(i = 0; i < NR_BENCHES; i++) {
+		const struct result *r = &res[i];
+
+		if ( !want[i] )
+			continue;
+
+		printf("%-18s %10.1f", benches[i].name, r->ns / r->ops);
+		if ( r->have_pmu ) {
+			printf(" %10.1f %10.3f\n",
+				(double)r->cycles / r->ops,
+				(double)r->misses / r->ops);
+		}else{
+			printf(" %10s %10s\n", "-", "-");
+		}
+	}
+}
+
+static void print_json(const struct result *res, int *want)
+{
+	const char *sep = "";
+	unsigned int i;
+
+	printf("{\n");
+	printf("  \"requests\": %u,\n", nr_reqs);
+	printf("  \"uris\": %u,\n", nr_uris);
+	printf("  \"vhosts\": %u,\n", nr_hosts);
+	printf("  \"benchmarks\": {");
+	for(i = 0; i < NR_BENCHES; i++) {
+		const struct result *r = &res[i];
+
+		if ( !want[i] )
+			continue;
+
+		printf("%s\n    \"%s\": {\"ops\": %lu, \"ns_per_op\": %.3f",
+			sep, benches[i].name, r->ops, r->ns / r->ops);
+		if ( r->have_pmu ) {
+			printf(", \"cycles_per_op\": %.3f, "
+				"\"cache_misses_per_op\": %.4f}",
+				(double)r->cycles / r->ops,
+				(double)r->misses / r->ops);
+		}else{
+			printf(", \"cycles_per_op\": null, "
+				"\"cache_misses_per_op\": null}");
+		}
+		sep = ",";
+	}
+	printf("\n  }\n}\n");
+}
+
+static _noreturn void usage(int e)
+{
+	unsigned int i;
+
+	fprintf(stderr, "%s: Usage\n", cmd);
+	fprintf(stderr, "\t%s [-j] [-c corpus] [-n files] [-v vhosts] "
+			"[-m mkroot] [benchmark...]\n", cmd);
+	fprintf(stderr, "\t -j print results as JSON\n");
+	fprintf(stderr, "\t -c requests recorded back to back, "
+			"instead of the built in ones\n");
+	fprintf(stderr, "\t -n files in the generated webroot (default %u)\n",
+			DEFAULT_FILES);
+	fprintf(stderr, "\t -v number of vhosts (default %u)\n",
+			DEFAULT_VHOSTS);
+	fprintf(stderr, "\t -m path to mkroot (default ./mkroot)\n");
+	fprintf(stderr, "\tbenchmarks:");
+	for(i = 0; i < NR_BENCHES; i++)
+		fprintf(stderr, " %s", benches[i].name);
+	fprintf(stderr, "\n");
+	exit(e);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nr_files = DEFAULT_FILES, nr_vhosts = DEFAULT_VHOSTS;
+	const char *mkroot = "./mkroot", *corpus = NULL;
+	struct result res[NR_BENCHES];
+	int want[NR_BENCHES];
+	unsigned int i;
+	int c, json = 0, ret = EXIT_FAILURE;
+
+	if ( argc )
+		cmd = argv[0];
+
+	while ( (c = getopt(argc, argv, "jc:n:v:m:h")) != -1 ) {
+		switch(c) {
+		case 'j':
+			json = 1;
+			break;
+		case 'c':
+			corpus = optarg;
+			break;
+		case 'n':
+			nr_files = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			nr_vhosts = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			mkroot = optarg;
+			break;
+		case 'h':
+			usage(EXIT_SUCCESS);
+		default:
+			usage(EXIT_FAILURE);
+		}
+	}
+
+	if ( !nr_files || !nr_vhosts )
+		usage(EXIT_FAILURE);
+
+	for(i = 0; i < NR_BENCHES; i++) {
+		int j;
+
+		want[i] = (optind == argc);
+		for(j = optind; j < argc; j++)
+			if ( !strcmp(argv[j], benches[i].name) )
+				want[i] = 1;
+	}
+
+	for(c = optind; c < argc; c++) {
+		for(i = 0; i < NR_BENCHES; i++)
+			if ( !strcmp(argv[c], benches[i].name) )
+				break;
+		if ( i == NR_BENCHES ) {
+			fprintf(stderr, "%s: %s: no such benchmark\n",
+				cmd, argv[c]);
+			usage(EXIT_FAILURE);
+		}
+	}
+
+	if ( corpus ) {
+		if ( !load_corpus(corpus) )
+			return EXIT_FAILURE;
+	}else if ( !builtin_corpus() ) {
+		return EXIT_FAILURE;
+	}
+
+	if ( NULL == mkdtemp(tmpdir) ) {
+		fprintf(stderr, "%s: mkdtemp: %s\n", cmd, os_err());
+		return EXIT_FAILURE;
+	}
+
+	if ( !gen_webroot(mkroot, nr_files) || !gen_uris(nr_files) ||
+			!gen_vhosts(nr_vhosts) ) {
+		fprintf(stderr, "%s: setup failed\n", cmd);
+		goto out;
+	}
+
+	pmu_init();
+
+	for(i = 0; i < NR_BENCHES; i++) {
+		if ( want[i] )
+			run(&benches[i], &res[i]);
+	}
+
+	if ( json ) {
+		print_json(res, want);
+	}else{
+		print_text(res, want);
+	}
+
+	ret = EXIT_SUCCESS;
+out:
+	cleanup();
+	return ret;
+}
@@ -14,6 +14,7 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <time.h>
 
 #include <magic.h>
 
@@ -25,11 +26,17 @@
 #include <vec.h>
 #include <webroot-format.h>
 #include "trie.h"
+#include "chd.h"
 #include "sha1.h"
+#include "compress.h"
 
 #define WRITE_FILES	1
 #define BUFFER_SIZE	(1U << 20U)
 #define SYMBUF		(16U << 10U) /* readlink buffer */
+#define INLINE_MAX	4096U /* default, files smaller than this are inline */
+#define INLINE_TOTAL	(1U << 30U) /* keep the mapped index well under 4GB */
+#define COMPRESS_MIN	256U /* not worth it for anything smaller */
+#define COMPRESS_MAX	(64U << 20U) /* read whole files in to memory */
 
 #if 0
 #define dprintf printf
@@ -47,11 +54,41 @@ static const char *tmpchunks_pattern = "/tmp/ashttpd.mkroot.XXXXXX";
 static const char *cmd = "mkroot";
 static int dotfiles; /* whether to include dot files */
 static int indexdirs = 1;
+static uint64_t inline_max = INLINE_MAX;
+static int precompress = 1;
+
+/* other than text/ */
+static const char * const compress_types[] = {
+	"application/javascript",
+	"application/json",
+	"application/xml",
+	"application/xhtml+xml",
+	"application/x-javascript",
+	"image/svg+xml",
+	"image/x-icon",
+};
 
 struct mime_type {
 	struct list_head m_list;
 	const char *m_type;
-	uint32_t m_strtab_off;
+	uint64_t m_strtab_off;
+};
+
+#define NR_REPR		(1 + WEBROOT_NUM_ENC)
+/* A representation of a file: the identity encoding or one of the
+ * compressed variants which are kept in the tmpchunks file
+ */
+struct repr {
+	uint64_t size;
+	uint64_t off;
+	uint64_t tmpoff;
+	const char *encoding;
+	uint64_t hdr200_off;
+	uint32_t hdr200_len;
+	uint64_t hdr304_off;
+	uint32_t hdr304_len;
+	unsigned int inline_data;
+	uint8_t digest[WEBROOT_DIGEST_LEN];
 };
 
 #define OBJ_TYPE_FILE		0
@@ -67,19 +104,20 @@ struct object {
 				char *path;
 				uint64_t tmpoff;
 			}u;
-			uint64_t size;
-			uint64_t off;
 			dev_t dev;
 			ino_t ino;
+			struct object *ino_next; /* in r_ino_hash */
 			time_t mtime;
 #define FILE_PATH	0
 #define FILE_TMPCHUNK	1
 			unsigned int content;
-			uint8_t digest[WEBROOT_DIGEST_LEN];
+			unsigned int nr_enc;
+			/* identity first, then by WEBROOT_ENC_* */
+			struct repr repr[NR_REPR];
 		} file;
 		struct {
 			char *uri;
-			uint32_t strtab_off;
+			uint64_t strtab_off;
 			int code;
 		} redirect;
 	}o_u;
@@ -96,6 +134,8 @@ struct webroot {
 	struct list_head r_redirect;
 	struct list_head r_file;
 	struct list_head r_mime_type;
+	struct object **r_ino_hash; /* files by dev/ino, for hard links */
+	unsigned int r_ino_hash_sz;
 	hgang_t r_uri_mem;
 	hgang_t r_obj_mem;
 	hgang_t r_mime_mem;
@@ -103,6 +143,7 @@ struct webroot {
 	fobuf_t r_tmpchunks;
 	const char *r_base;
 	trie_t r_trie;
+	chd_t r_hash;
 	struct trie_entry *r_trie_ent;
 	magic_t r_magic;
 	uint64_t r_files_sz;
@@ -110,8 +151,12 @@ struct webroot {
 	unsigned int r_num_uri;
 	unsigned int r_num_redirect;
 	unsigned int r_num_file;
-	unsigned int r_mimetab_sz;
-	unsigned int r_redirtab_sz;
+	uint64_t r_mimetab_sz;
+	uint64_t r_redirtab_sz;
+	uint64_t r_hdrtab_sz;
+	unsigned int r_inline_sz;
+	unsigned int r_num_enc;
+	uint64_t r_enc_saved;
 };
 
 static char *path_splice(const char *dir, const char *path)
@@ -226,8 +271,10 @@ static void webroot_free(struct webroot *r)
 		hgang_free(r->r_mime_mem);
 		strpool_free(r->r_str_mem);
 		magic_close(r->r_magic);
+		free(r->r_ino_hash);
 		free(r->r_trie_ent);
 		trie_free(r->r_trie);
+		chd_free(r->r_hash);
 		free(r);
 	}
 }
@@ -298,12 +345,249 @@ static int sort_objects(struct webroot *r)
 	return 1;
 }
 
+static uint32_t modified(time_t mtime)
+{
+	return mtime;
+}
+
+/* Format the constant part of the response headers for one
+ * representation of a file, with NULL buf it just returns the length.
+ * The length doesn't depend on the digest so the table can be laid out
+ * before the files are hashed.
+ */
+static size_t file_hdr(struct object *f, struct repr *rp, unsigned int code,
+			char *buf, size_t sz)
+{
+	char etag[WEBROOT_DIGEST_LEN * 2 + 1];
+	char enc[64] = "";
+	const char *vary;
+	char mtime[64];
+	unsigned int i;
+	struct tm tm;
+	time_t mt;
+
+	for(i = 0; i < WEBROOT_DIGEST_LEN; i++) {
+		static const char hex[] = "0123456789abcdef";
+		etag[i * 2] = hex[rp->digest[i] >> 4];
+		etag[i * 2 + 1] = hex[rp->digest[i] & 0xf];
+	}
+	etag[i * 2] = '\0';
+
+	mt = modified(f->o_u.file.mtime);
+	gmtime_r(&mt, &tm);
+	strftime(mtime, sizeof(mtime), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	/* every representation varies if there's more than one */
+	vary = (f->o_u.file.nr_enc) ? "Vary: Accept-Encoding\r\n" : "";
+	if ( rp->encoding )
+		snprintf(enc, sizeof(enc), "Content-Encoding: %s\r\n",
+			rp->encoding);
+
+	if ( code == 304 ) {
+		return snprintf(buf, sz,
+			"HTTP/1.1 304 Not Modified\r\n"
+			"ETag: %s\r\n"
+			"Last-Modified: %s\r\n"
+			"%s"
+			"Server: ashttpd\r\n",
+			etag, mtime, vary);
+	}
+
+	return snprintf(buf, sz,
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: %s\r\n"
+		"%s"
+		"Content-Length: %"PRIu64"\r\n"
+		"ETag: %s\r\n"
+		"Last-Modified: %s\r\n"
+		"%s"
+		"Accept-Ranges: bytes\r\n"
+		"Server: ashttpd\r\n",
+		f->o_u.file.type->m_type,
+		enc,
+		rp->size,
+		etag, mtime, vary);
+}
+
+static int compressible(const char *mime)
+{
+	unsigned int i;
+
+	if ( !strncmp(mime, "text/", 5) )
+		return 1;
+
+	for(i = 0; i < ARRAY_SIZE(compress_types); i++) {
+		if ( !strcmp(mime, compress_types[i]) )
+			return 1;
+	}
+
+	return 0;
+}
+
+static int read_all(int fd, uint64_t off, uint8_t *buf, size_t len,
+			const char *name)
+{
+	ssize_t ret;
+
+	while ( len ) {
+		ret = pread(fd, buf, len, off);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 ) {
+			fprintf(stderr, "%s: %s: read: %s\n", cmd, name,
+				(ret) ? os_err() : "short file");
+			return 0;
+		}
+		buf += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 1;
+}
+
+/* Store each variant which is a worthwhile saving in the tmpchunks
+ * file, for mkroot to lay out and write just like the original
+ */
+static int compress_file(struct webroot *r, struct object *f)
+{
+	uint64_t len = f->o_u.file.repr[0].size;
+	const char *name = "tmpchunks";
+	uint8_t *buf, *cbuf;
+	struct repr *rp;
+	unsigned int i;
+	size_t clen;
+	int fd, ok;
+
+	if ( !compressible(f->o_u.file.type->m_type) )
+		return 1;
+	if ( len < COMPRESS_MIN || len > COMPRESS_MAX )
+		return 1;
+
+	buf = malloc(len);
+	if ( NULL == buf ) {
+		fprintf(stderr, "%s: malloc: %s\n", cmd, os_err());
+		return 0;
+	}
+
+	if ( f->o_u.file.content == FILE_PATH ) {
+		name = f->o_u.file.u.path;
+		fd = open(name, O_RDONLY);
+		if ( fd < 0 ) {
+			fprintf(stderr, "%s: %s: open: %s\n",
+				cmd, name, os_err());
+			free(buf);
+			return 0;
+		}
+		ok = read_all(fd, 0, buf, len, name);
+		close(fd);
+	}else{
+		fd = fobuf_fd(r->r_tmpchunks);
+		ok = read_all(fd, f->o_u.file.u.tmpoff, buf, len, name);
+	}
+
+	if ( !ok ) {
+		free(buf);
+		return 0;
+	}
+
+	for(i = 0; i < WEBROOT_NUM_ENC; i++) {
+		if ( !compress_available(i) )
+			continue;
+		if ( !compress_buf(i, buf, len, &cbuf, &clen) ) {
+			fprintf(stderr, "%s: %s: %s failed\n",
+				cmd, name, compress_name(i));
+			continue;
+		}
+
+		/* must save at least an eighth */
+		if ( clen > len - (len >> 3) ) {
+			free(cbuf);
+			continue;
+		}
+
+		rp = &f->o_u.file.repr[1 + i];
+		rp->encoding = compress_name(i);
+		rp->size = clen;
+		rp->tmpoff = r->r_tmpoff;
+		ok = fobuf_write(r->r_tmpchunks, cbuf, clen);
+		free(cbuf);
+		if ( !ok ) {
+			fprintf(stderr, "%s: fobuf_write: %s\n",
+				cmd, os_err());
+			free(buf);
+			return 0;
+		}
+
+		r->r_tmpoff += clen;
+		r->r_enc_saved += len - clen;
+		r->r_num_enc++;
+		f->o_u.file.nr_enc++;
+	}
+
+	free(buf);
+	return 1;
+}
+
+static int compress_files(struct webroot *r)
+{
+	struct object *obj;
+
+	if ( !precompress )
+		return 1;
+
+	/* compress_file() reads generated files back */
+	if ( !fobuf_flush(r->r_tmpchunks) )
+		return 0;
+
+	list_for_each_entry(obj, &r->r_file, o_list) {
+		if ( !compress_file(r, obj) )
+			return 0;
+	}
+
+	printf("%s: %u compressed variants, saving %"PRIu64" bytes\n",
+		cmd, r->r_num_enc, r->r_enc_saved);
+	return 1;
+}
+
+/* Variants which weren't worth it have no encoding */
+#define for_each_repr(f, rp) \
+	for(rp = (f)->o_u.file.repr; rp < (f)->o_u.file.repr + NR_REPR; rp++) \
+		if ( rp != (f)->o_u.file.repr && NULL == rp->encoding ) \
+			continue; \
+		else
+
+static uint64_t layout_hdrs(struct webroot *r, struct object *f,
+				struct repr *rp, uint64_t off)
+{
+	rp->hdr200_off = off;
+	rp->hdr200_len = file_hdr(f, rp, 200, NULL, 0);
+	off += rp->hdr200_len;
+	r->r_hdrtab_sz += rp->hdr200_len;
+
+	if ( rp->size < inline_max &&
+		r->r_inline_sz + rp->size <= INLINE_TOTAL ) {
+		rp->inline_data = 1;
+		rp->off = off;
+		off += rp->size;
+		r->r_hdrtab_sz += rp->size;
+		r->r_inline_sz += rp->size;
+	}
+
+	rp->hdr304_off = off;
+	rp->hdr304_len = file_hdr(f, rp, 304, NULL, 0);
+	off += rp->hdr304_len;
+	r->r_hdrtab_sz += rp->hdr304_len;
+	return off;
+}
+
 static int webroot_prep(struct webroot *r)
 {
 	struct mime_type *m;
 	struct trie_entry *ent;
 	struct object *obj;
 	unsigned int i = 0;
+	struct repr *rp;
 	struct uri *u;
 	uint64_t off;
 	int ret = 0;
@@ -315,6 +599,9 @@ static int webroot_prep(struct webroot *r)
 	if ( !sort_objects(r) )
 		goto out;
 
+	if ( !compress_files(r) )
+		goto out;
+
 	ent = malloc(sizeof(*ent) * r->r_num_uri);
 	if ( NULL == ent )
 		goto out;
@@ -340,9 +627,20 @@ static int webroot_prep(struct webroot *r)
 	r->r_trie = t;
 	r->r_trie_ent = ent;
 
+	/* And the hash for exact matches */
+	r->r_hash = chd_new(ent, r->r_num_uri);
+	if ( NULL == r->r_hash ) {
+		fprintf(stderr, "%s: failed to build URI hash\n", cmd);
+		goto out;
+	}
+
+	printf("%s: index: hash=%"PRId64" bytes\n",
+		cmd, chd_size(r->r_hash));
+
 	/* Layout mime and redirect string tables */
 	off = sizeof(struct webroot_hdr) +
 		trie_trie_size(r->r_trie) +
+		chd_size(r->r_hash) +
 		sizeof(struct webroot_redirect) * r->r_num_redirect +
 		sizeof(struct webroot_file) * r->r_num_file;
 
@@ -361,12 +659,26 @@ static int webroot_prep(struct webroot *r)
 		}
 	}
 
+	/* Small files go in the header table right after their 200 header
+	 * so that httpd can send both straight out of the mapping
+	 */
+	r->r_hdrtab_sz = 0;
+	r->r_inline_sz = 0;
+	list_for_each_entry(obj, &r->r_file, o_list) {
+		for_each_repr(obj, rp)
+			off = layout_hdrs(r, obj, rp, off);
+	}
+
 	/* Calculate files size */
 	r->r_files_sz = 0;
 	list_for_each_entry(obj, &r->r_file, o_list) {
-		obj->o_u.file.off = off;
-		off += obj->o_u.file.size;
-		r->r_files_sz += obj->o_u.file.size;
+		for_each_repr(obj, rp) {
+			if ( rp->inline_data )
+				continue;
+			rp->off = off;
+			off += rp->size;
+			r->r_files_sz += rp->size;
+		}
 	}
 
 	/* success */
@@ -387,7 +699,8 @@ static void etag(uint8_t digest[WEBROOT_DIGEST_LEN], uint8_t sha[20])
 	memcpy(digest, sha, 20);
 }
 
-static int write_file(struct webroot *r, struct object *f, fobuf_t out)
+static int write_file(struct webroot *r, struct object *f, struct repr *rp,
+			fobuf_t out)
 {
 	uint8_t buf[BUFFER_SIZE];
 	blk_SHA_CTX ctx;
@@ -397,7 +710,14 @@ static int write_file(struct webroot *r, struct object *f, fobuf_t out)
 	int rc = 0;
 	int fd;
 
-	if ( f->o_u.file.content == FILE_PATH ) {
+	if ( rp != f->o_u.file.repr ) {
+		/* compressed variants are all in tmpchunks */
+		fd = fobuf_fd(r->r_tmpchunks);
+		if ( lseek(fd, rp->tmpoff, SEEK_SET) < 0 ) {
+			fprintf(stderr, "%s: lseek: %s\n", cmd, os_err());
+			return 0;
+		}
+	}else if ( f->o_u.file.content == FILE_PATH ) {
 		fd = open(f->o_u.file.u.path, O_RDONLY);
 		if ( fd < 0 ) {
 			fprintf(stderr, "%s: %s: open: %s\n",
@@ -415,7 +735,7 @@ static int write_file(struct webroot *r, struct object *f, fobuf_t out)
 	}
 
 	blk_SHA1_Init(&ctx);
-	len = f->o_u.file.size;
+	len = rp->size;
 again:
 	ret = read(fd, buf, (len > sizeof(buf)) ? sizeof(buf) : len);
 	if ( ret < 0 ) {
@@ -437,18 +757,19 @@ again:
 		goto again;
 
 	blk_SHA1_Final(sha, &ctx);
-	etag(f->o_u.file.digest, sha);
+	etag(rp->digest, sha);
 	if ( !len ) {
 		rc = 1;
 	}else{
 		/* should never happen to tmpchunks */
-		assert(f->o_u.file.content == FILE_PATH);
+		assert(f->o_u.file.content == FILE_PATH &&
+			rp == f->o_u.file.repr);
 		fprintf(stderr, "%s: %s size was modified during scan\n",
 			cmd, f->o_u.file.u.path);
 	}
 
 out_close:
-	if ( f->o_u.file.content == FILE_PATH ) {
+	if ( f->o_u.file.content == FILE_PATH && rp == f->o_u.file.repr ) {
 		close(fd);
 	}
 out:
@@ -458,18 +779,15 @@ out:
 static int write_files(struct webroot *r, fobuf_t out)
 {
 	struct object *obj;
-
-	/* make sure the tmpchunks data is actually flushed
-	 * from buffers and in to the file, since the fobuf
-	 * cache has no way of doing coherancy because we're
-	 * reading with read(2) behind its back
-	 */
-	if ( !fobuf_flush(r->r_tmpchunks) )
-		return 0;
+	struct repr *rp;
 
 	list_for_each_entry(obj, &r->r_file, o_list) {
-		if ( !write_file(r, obj, out) )
-			return 0;
+		for_each_repr(obj, rp) {
+			if ( rp->inline_data )
+				continue;
+			if ( !write_file(r, obj, rp, out) )
+				return 0;
+		}
 	}
 	return 1;
 }
@@ -501,6 +819,69 @@ static int write_redirtab(struct webroot *r, fobuf_t out)
 	return 1;
 }
 
+/* Inline data is written, and hashed, on the first pass only. When the
+ * table is rewritten with the etags we just skip over it.
+ */
+static int skip_inline(struct repr *rp, fobuf_t out)
+{
+	if ( !fobuf_flush(out) )
+		return 0;
+	if ( lseek(fobuf_fd(out), rp->size, SEEK_CUR) < 0 ) {
+		fprintf(stderr, "%s: lseek: %s\n", cmd, os_err());
+		return 0;
+	}
+	return 1;
+}
+
+static int write_hdrs(struct webroot *r, struct object *f, struct repr *rp,
+			fobuf_t out, int data)
+{
+	char buf[1024];
+	size_t len;
+
+	len = rp->hdr200_len + 1;
+	if ( len > sizeof(buf) )
+		goto toobig;
+	file_hdr(f, rp, 200, buf, len);
+	if ( !fobuf_write(out, buf, rp->hdr200_len) )
+		return 0;
+
+	if ( rp->inline_data ) {
+		if ( data && !write_file(r, f, rp, out) )
+			return 0;
+		if ( !data && !skip_inline(rp, out) )
+			return 0;
+	}
+
+	len = rp->hdr304_len + 1;
+	if ( len > sizeof(buf) )
+		goto toobig;
+	file_hdr(f, rp, 304, buf, len);
+	if ( !fobuf_write(out, buf, rp->hdr304_len) )
+		return 0;
+
+	return 1;
+toobig:
+	fprintf(stderr, "%s: %s: response header too big\n",
+		cmd, f->o_u.file.type->m_type);
+	return 0;
+}
+
+static int write_hdrtab(struct webroot *r, fobuf_t out, int data)
+{
+	struct object *obj;
+	struct repr *rp;
+
+	list_for_each_entry(obj, &r->r_file, o_list) {
+		for_each_repr(obj, rp) {
+			if ( !write_hdrs(r, obj, rp, out, data) )
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
 static int write_header(struct webroot *r, fobuf_t out)
 {
 	struct webroot_hdr hdr;
@@ -509,17 +890,21 @@ static int write_header(struct webroot *r, fobuf_t out)
 	hdr.h_num_redirect = r->r_num_redirect;
 	hdr.h_num_file = r->r_num_file;
 	hdr.h_strtab_sz = r->r_mimetab_sz +
-				r->r_redirtab_sz;
+				r->r_redirtab_sz +
+				r->r_hdrtab_sz;
 	hdr.h_magic = WEBROOT_MAGIC;
 	hdr.h_vers = WEBROOT_CURRENT_VER;
+	chd_header(r->r_hash, &hdr);
 
 	/* provides simple way to map all index data */
 	hdr.h_files_begin = sizeof(struct webroot_hdr) +
 		trie_trie_size(r->r_trie) +
+		chd_size(r->r_hash) +
 		sizeof(struct webroot_redirect) * r->r_num_redirect +
 		sizeof(struct webroot_file) * r->r_num_file +
 		r->r_mimetab_sz +
-		r->r_redirtab_sz;
+		r->r_redirtab_sz +
+		r->r_hdrtab_sz;
 
 	return fobuf_write(out, &hdr, sizeof(hdr));
 }
@@ -544,23 +929,43 @@ static int write_redirect_objs(struct webroot *r, fobuf_t out)
 	return 1;
 }
 
-static uint32_t modified(time_t mtime)
-{
-	return mtime;
-}
-
 static int write_file_objs(struct webroot *r, fobuf_t out)
 {
 	struct webroot_file wf;
 	struct object *obj;
+	struct repr *rp;
+	unsigned int i;
 
 	list_for_each_entry(obj, &r->r_file, o_list) {
-		wf.f_off = obj->o_u.file.off;
-		wf.f_len = obj->o_u.file.size;
+		rp = obj->o_u.file.repr;
+		wf.f_off = rp->off;
+		wf.f_len = rp->size;
 		wf.f_type = obj->o_u.file.type->m_strtab_off;
 		wf.f_type_len = strlen(obj->o_u.file.type->m_type);
 		wf.f_modified = modified(obj->o_u.file.mtime);
-		memcpy(wf.f_digest, obj->o_u.file.digest, WEBROOT_DIGEST_LEN);
+		memcpy(wf.f_digest, rp->digest, WEBROOT_DIGEST_LEN);
+		wf.f_hdr200 = rp->hdr200_off;
+		wf.f_hdr200_len = rp->hdr200_len;
+		wf.f_hdr304 = rp->hdr304_off;
+		wf.f_hdr304_len = rp->hdr304_len;
+
+		memset(wf.f_enc, 0, sizeof(wf.f_enc));
+		for(i = 0; i < WEBROOT_NUM_ENC; i++) {
+			struct webroot_enc *e = &wf.f_enc[i];
+
+			rp = &obj->o_u.file.repr[1 + i];
+			if ( NULL == rp->encoding )
+				continue;
+
+			e->e_off = rp->off;
+			e->e_len = rp->size;
+			memcpy(e->e_digest, rp->digest, WEBROOT_DIGEST_LEN);
+			e->e_hdr200 = rp->hdr200_off;
+			e->e_hdr200_len = rp->hdr200_len;
+			e->e_hdr304 = rp->hdr304_off;
+			e->e_hdr304_len = rp->hdr304_len;
+		}
+
 		if ( !fobuf_write(out, &wf, sizeof(wf)) )
 			return 0;
 	}
@@ -581,21 +986,42 @@ static int write_etags(struct webroot *r, fobuf_t out)
 	fd = fobuf_fd(out);
 	off = sizeof(struct webroot_hdr) +
 		trie_trie_size(r->r_trie) +
+		chd_size(r->r_hash) +
 		sizeof(struct webroot_redirect) * r->r_num_redirect;
 	if ( lseek(fd, off, SEEK_SET) < 0 ) {
 		fprintf(stderr, "%s: lseek: %s\n", cmd, os_err());
 		return 0;
 	}
 
-	return write_file_objs(r, out);
+	if ( !write_file_objs(r, out) )
+		return 0;
+
+	/* the headers have the etags in them too, the string tables in
+	 * between are rewritten as-is to get there
+	 */
+	if ( !write_mimetab(r, out) )
+		return 0;
+	if ( !write_redirtab(r, out) )
+		return 0;
+	return write_hdrtab(r, out, 0);
 }
 
 static int webroot_write(struct webroot *r, fobuf_t out)
 {
+	/* make sure the tmpchunks data is actually flushed
+	 * from buffers and in to the file, since the fobuf
+	 * cache has no way of doing coherancy because we're
+	 * reading with read(2) behind its back
+	 */
+	if ( !fobuf_flush(r->r_tmpchunks) )
+		return 0;
+
 	if ( !write_header(r, out) )
 		return 0;
 	if ( !trie_write_trie(r->r_trie, out) )
 		return 0;
+	if ( !chd_write(r->r_hash, out) )
+		return 0;
 	if ( !write_redirect_objs(r, out) )
 		return 0;
 	if ( !write_file_objs(r, out) )
@@ -604,6 +1030,8 @@ static int webroot_write(struct webroot *r, fobuf_t out)
 		return 0;
 	if ( !write_redirtab(r, out) )
 		return 0;
+	if ( !write_hdrtab(r, out, 1) )
+		return 0;
 
 #if WRITE_FILES
 	printf("%s: Writing files\n", cmd);
@@ -663,10 +1091,12 @@ static uint64_t webroot_output_size(struct webroot *r)
 {
 	return sizeof(struct webroot_hdr) +
 		trie_trie_size(r->r_trie) +
+		chd_size(r->r_hash) +
 		sizeof(struct webroot_redirect) * r->r_num_redirect +
 		sizeof(struct webroot_file) * r->r_num_file +
 		r->r_mimetab_sz +
 		r->r_redirtab_sz +
+		r->r_hdrtab_sz +
 		r->r_files_sz;
 }
 
@@ -732,6 +1162,40 @@ static struct object *obj_code(struct webroot *r, int code)
 	return obj;
 }
 
+static unsigned int ino_bucket(struct webroot *r, dev_t dev, ino_t ino)
+{
+	uint64_t h = ((uint64_t)dev << 32) ^ ino;
+
+	h *= 0x9e3779b97f4a7c15ULL;
+	return (h >> 32) & (r->r_ino_hash_sz - 1);
+}
+
+/* Double the table once there's as many files as buckets */
+static int ino_grow(struct webroot *r)
+{
+	struct object **new, *obj;
+	unsigned int sz, b;
+
+	sz = (r->r_ino_hash_sz) ? r->r_ino_hash_sz * 2 : 1024;
+	new = calloc(sz, sizeof(*new));
+	if ( NULL == new ) {
+		fprintf(stderr, "%s: calloc: %s\n", cmd, os_err());
+		return 0;
+	}
+
+	free(r->r_ino_hash);
+	r->r_ino_hash = new;
+	r->r_ino_hash_sz = sz;
+
+	list_for_each_entry(obj, &r->r_file, o_list) {
+		b = ino_bucket(r, obj->o_u.file.dev, obj->o_u.file.ino);
+		obj->o_u.file.ino_next = new[b];
+		new[b] = obj;
+	}
+
+	return 1;
+}
+
 static struct object *obj_file(struct webroot *r,
 				dev_t dev,
 				ino_t ino,
@@ -739,11 +1203,13 @@ static struct object *obj_file(struct webroot *r,
 				uint64_t size)
 {
 	struct object *obj;
+	unsigned int b;
 
-	/* TODO: use a hash table, benchmarked at causing 200ms
-	 * slowdown for 5,000 files. Dwarfed by I/O and SHA1.
-	 */
-	list_for_each_entry(obj, &r->r_file, o_list) {
+	if ( r->r_num_file >= r->r_ino_hash_sz && !ino_grow(r) )
+		return NULL;
+
+	b = ino_bucket(r, dev, ino);
+	for(obj = r->r_ino_hash[b]; obj; obj = obj->o_u.file.ino_next) {
 		if ( dev == obj->o_u.file.dev &&
 			ino == obj->o_u.file.ino ) {
 			return obj;
@@ -756,11 +1222,13 @@ static struct object *obj_file(struct webroot *r,
 
 	obj->o_type = OBJ_TYPE_FILE;
 
-	obj->o_u.file.size = size;
+	obj->o_u.file.repr[0].size = size;
 	obj->o_u.file.dev = dev;
 	obj->o_u.file.ino = ino;
 	obj->o_u.file.mtime = mtime;
 	obj->o_u.file.content = FILE_PATH;
+	obj->o_u.file.ino_next = r->r_ino_hash[b];
+	r->r_ino_hash[b] = obj;
 
 	list_add_tail(&obj->o_list, &r->r_file);
 	r->r_num_file++;
@@ -783,6 +1251,10 @@ static struct object *obj_file_path(struct webroot *r,
 	if ( NULL == obj )
 		return NULL;
 
+	/* another link to a file we already have */
+	if ( obj->o_u.file.type )
+		return obj;
+
 	obj->o_u.file.content = FILE_PATH;
 
 	obj->o_u.file.u.path = webroot_strdup(r, path);
@@ -1000,7 +1472,7 @@ static struct object *index_dir(struct webroot *r, struct stat *st,
 
 	if ( NULL == r->r_tmpchunks )
 		return NULL;
-	obj->o_u.file.size = r->r_tmpoff - obj->o_u.file.u.tmpoff;
+	obj->o_u.file.repr[0].size = r->r_tmpoff - obj->o_u.file.u.tmpoff;
 	return obj;
 }
 
@@ -1117,6 +1589,7 @@ out:
 static int do_mkroot(const char *dir, const char *outfn)
 {
 	struct webroot *r;
+	char *tmpfn;
 	fobuf_t out;
 	int ret = 0;
 	int fd;
@@ -1134,13 +1607,22 @@ static int do_mkroot(const char *dir, const char *outfn)
 	if ( !webroot_prep(r) )
 		goto out_free;
 
-	printf("%s: num_uri=%u num_redirect=%u num_file=%u\n",
-		cmd, r->r_num_uri, r->r_num_redirect, r->r_num_file);
+	printf("%s: num_uri=%u num_redirect=%u num_file=%u inline=%u bytes\n",
+		cmd, r->r_num_uri, r->r_num_redirect, r->r_num_file,
+		r->r_inline_sz);
 
-	fd = open(outfn, O_WRONLY|O_CREAT|O_TRUNC, 0600);
-	if ( fd < 0 ) {
-		fprintf(stderr, "%s: %s: open: %s\n", cmd, outfn, os_err());
+	/* httpd may have the old one mapped, so it's never rewritten in
+	 * place, the new one is renamed over it
+	 */
+	tmpfn = malloc(strlen(outfn) + sizeof(".XXXXXX"));
+	if ( NULL == tmpfn )
 		goto out_free;
+	sprintf(tmpfn, "%s.XXXXXX", outfn);
+
+	fd = mkstemp(tmpfn);
+	if ( fd < 0 ) {
+		fprintf(stderr, "%s: %s: mkstemp: %s\n", cmd, tmpfn, os_err());
+		goto out_free_tmp;
 	}
 
 #if WRITE_FILES
@@ -1158,17 +1640,27 @@ static int do_mkroot(const char *dir, const char *outfn)
 
 	if ( !webroot_write(r, out) ) {
 		fobuf_abort(out);
-		goto out;
+		goto out_close;
 	}
 
 	printf("%s: syncing %s\n", cmd, outfn);
 	if ( !fobuf_close(out) )
-		goto out_close;
+		goto out_unlink;
+
+	if ( rename(tmpfn, outfn) ) {
+		fprintf(stderr, "%s: %s: rename: %s\n", cmd, outfn, os_err());
+		goto out_unlink;
+	}
 
 	ret = 1;
+	goto out_free_tmp;
 
 out_close:
 	close(fd);
+out_unlink:
+	unlink(tmpfn);
+out_free_tmp:
+	free(tmpfn);
 out_free:
 	webroot_free(r);
 out:
@@ -1178,7 +1670,11 @@ out:
 static _noreturn void usage(const char *msg, int e)
 {
 	fprintf(stderr, "%s: Usage\n", cmd);
-	fprintf(stderr, "\t%s [dir] [output]\n", cmd);
+	fprintf(stderr, "\t%s [-z] [-i inline-max] [dir] [output]\n", cmd);
+	fprintf(stderr, "\t -i files smaller than this many bytes are "
+			"stored in the index (default %u, 0 disables)\n",
+			INLINE_MAX);
+	fprintf(stderr, "\t -z don't store precompressed variants\n");
 	exit(e);
 }
 
@@ -1195,16 +1691,33 @@ static void rstrip_slashes(char *path)
 int main(int argc, char **argv)
 {
 	const char *dir, *outfn;
+	int c;
 
 	if ( argc )
 		cmd = argv[0];
 
-	if ( argc < 3 )
+	while ( (c = getopt(argc, argv, "i:z")) != -1 ) {
+		switch(c) {
+		case 'i':
+			inline_max = strtoull(optarg, NULL, 0);
+			break;
+		case 'z':
+			precompress = 0;
+			break;
+		default:
+			usage(NULL, EXIT_FAILURE);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if ( argc < 2 )
 		usage(NULL, EXIT_FAILURE);
 
-	rstrip_slashes(argv[1]);
-	dir = argv[1];
-	outfn = argv[2];
+	rstrip_slashes(argv[0]);
+	dir = argv[0];
+	outfn = argv[1];
 
 	if ( !do_mkroot(dir, outfn) ) {
 		fprintf(stderr, "%s: FAILED\n", cmd);
@@ -0,0 +1,173 @@
+/*
+ * Differential fuzz of the nads_normalize() fast path against the full
+ * normalizer. Random URLs, biased towards the characters the normalizer
+ * cares about, plus mutations of plain ones, must come out the same
+ * either way. Then times both over URLs which take the fast path.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <compiler.h>
+#include <normalize.h>
+
+#define FUZZ_ITERS	20000000
+#define BENCH_ROUNDS	2000000
+#define FUZZ_MAX_LEN	80
+
+struct result {
+	int		ret;
+	unsigned int	err;
+	size_t		uri_len;
+	char		uri[NADS_MAX_URI];
+	int		has_query;
+	char		query[NADS_MAX_URI];
+};
+
+static const char * const plain[] = {
+	"/",
+	"/index.html",
+	"/static/css/main.4f3b2a1c.css",
+	"/images/hero@2x.jpg",
+	"/blog/2024/04/some-article-title/",
+	"/search?q=foo+bar&page=2",
+	"/api/v1/users/12345/posts?limit=20&offset=40",
+	"/media/intro.mp4",
+	"/favicon.ico",
+	"/fonts/inter-var-latin.woff2?v=3.19",
+};
+
+#define NR_PLAIN	(sizeof(plain)/sizeof(*plain))
+
+static void run(int (*fn)(struct nads *), struct result *r,
+		const char *buf, size_t len)
+{
+	struct nads n;
+
+	n.buf = buf;
+	n.buf_len = len;
+	r->ret = (*fn)(&n);
+	r->err = nads_errno();
+	r->uri_len = n.uri_len;
+	strcpy(r->uri, n.uri);
+	r->has_query = (NULL != n.query);
+	if ( n.query )
+		strcpy(r->query, n.query);
+}
+
+static int same(const struct result *a, const struct result *b)
+{
+	if ( a->ret != b->ret || a->err != b->err )
+		return 0;
+	if ( a->uri_len != b->uri_len || strcmp(a->uri, b->uri) )
+		return 0;
+	if ( a->has_query != b->has_query )
+		return 0;
+	if ( a->has_query && strcmp(a->query, b->query) )
+		return 0;
+	return 1;
+}
+
+static size_t random_url(char *buf)
+{
+	static const char alpha[] = "//////....??%%\\abcXYZ019_-~=&+";
+	size_t len, i;
+
+	if ( rand() & 1 ) {
+		/* mutate a plain one */
+		const char *p = plain[rand() % NR_PLAIN];
+		len = strlen(p);
+		memcpy(buf, p, len);
+		for(i = rand() % 3; i; i--) {
+			size_t pos = rand() % len;
+			switch(rand() % 4) {
+			case 0:
+				buf[pos] = alpha[rand() % (sizeof(alpha) - 1)];
+				break;
+			case 1:
+				buf[pos] = rand() & 0xff;
+				break;
+			default:
+				if ( len < FUZZ_MAX_LEN ) {
+					memmove(buf + pos + 1, buf + pos,
+						len - pos);
+					buf[pos] = alpha[rand() %
+							(sizeof(alpha) - 1)];
+					len++;
+				}
+				break;
+			}
+		}
+		return len;
+	}
+
+	len = rand() % FUZZ_MAX_LEN;
+	for(i = 0; i < len; i++) {
+		if ( rand() % 16 )
+			buf[i] = alpha[rand() % (sizeof(alpha) - 1)];
+		else
+			buf[i] = rand() & 0xff;
+	}
+	if ( len && (rand() & 3) )
+		buf[0] = '/';
+	return len;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char *label, int (*fn)(struct nads *))
+{
+	struct nads n;
+	unsigned int i, j;
+	double start, secs;
+
+	start = now();
+	for(i = 0; i < BENCH_ROUNDS; i++) {
+		for(j = 0; j < NR_PLAIN; j++) {
+			n.buf = plain[j];
+			n.buf_len = strlen(plain[j]);
+			(*fn)(&n);
+		}
+	}
+	secs = now() - start;
+
+	printf("%-6s %6.1f ns/url\n", label,
+		secs * 1e9 / ((double)BENCH_ROUNDS * NR_PLAIN));
+}
+
+int main(int argc, char **argv)
+{
+	static struct result a, b;
+	char buf[FUZZ_MAX_LEN];
+	unsigned long i, ok = 0;
+	size_t len;
+
+	srand((argc > 1) ? atoi(argv[1]) : 0);
+
+	for(i = 0; i < FUZZ_ITERS; i++) {
+		len = random_url(buf);
+		run(nads_normalize, &a, buf, len);
+		run(nads_normalize_full, &b, buf, len);
+		if ( !same(&a, &b) ) {
+			fprintf(stderr, "mismatch on '%.*s' (%zu bytes)\n",
+				(int)len, buf, len);
+			fprintf(stderr, " fast: %d '%s'\n", a.ret, a.uri);
+			fprintf(stderr, " full: %d '%s'\n", b.ret, b.uri);
+			return EXIT_FAILURE;
+		}
+		ok += a.ret;
+	}
+
+	printf("%u urls, %lu normalized ok, all matched\n",
+		FUZZ_ITERS, ok);
+	bench("full", nads_normalize_full);
+	bench("fast", nads_normalize);
+	return EXIT_SUCCESS;
+}
@@ -19,39 +19,103 @@
 #include <nbio.h>
 #include <os.h>
 
+/* fds stay registered for their whole lifetime, ev_priv.poll records
+ * what the kernel has so that moving between the active and inactive
+ * lists costs nothing unless the wait mask actually changed.
+ */
+#define EP_REGISTERED	(1 << 8)
+#define EP_MIN_EVENTS	256
+#define EP_MAX_EVENTS	4096
+
+struct epoll_priv {
+	int fd;
+	unsigned int max_ev;
+	struct epoll_event *ev;
+};
+
+static int upsize_evset(struct epoll_priv *p, unsigned int max)
+{
+	struct epoll_event *new;
+
+	new = realloc(p->ev, max * sizeof(*p->ev));
+	if ( new == NULL )
+		return 0;
+
+	p->max_ev = max;
+	p->ev = new;
+	return 1;
+}
+
 static int epoll_init(struct iothread *t)
 {
-	t->priv.epoll = epoll_create(1);
-	if ( t->priv.epoll < 0 )
+	struct epoll_priv *p;
+
+	p = calloc(1, sizeof(*p));
+	if ( p == NULL )
 		return 0;
+
+	if ( !upsize_evset(p, EP_MIN_EVENTS) )
+		goto err_free;
+
+	p->fd = epoll_create1(EPOLL_CLOEXEC);
+	if ( p->fd < 0 )
+		goto err_free_ev;
+
+	t->priv.ptr = p;
 	return 1;
+
+err_free_ev:
+	free(p->ev);
+err_free:
+	free(p);
+	return 0;
 }
 
 static void epoll_fini(struct iothread *t)
 {
-	while ( close(t->priv.epoll) && (errno == EINTR) )
+	struct epoll_priv *p = t->priv.ptr;
+
+	while ( close(p->fd) && (errno == EINTR) )
 		/* do nothing */;
+	free(p->ev);
+	free(p);
 }
 
+/* Nothing to do on the way to the active list, the registration stays
+ * and any events which come in are filtered in epoll_pump().
+ */
 static void epoll_active(struct iothread *t, struct nbio *n)
 {
-	if ( n->ev_priv.poll == 0 )
-		return;
-	if ( n->fd < 0 )
-		return;
+}
+
+/* A deleted nbio is taken out before its dtor since we can't be sure
+ * that's going to close the last reference to the file. If it's already
+ * been closed then so has the registration.
+ */
+static int epoll_release(struct iothread *t, struct nbio *n)
+{
+	struct epoll_priv *p = t->priv.ptr;
+
+	if ( !(n->ev_priv.poll & EP_REGISTERED) )
+		return 1;
 
 	n->ev_priv.poll = 0;
-	epoll_ctl(t->priv.epoll, EPOLL_CTL_DEL, n->fd, NULL);
+	if ( n->fd < 0 )
+		return 1;
+	t->nr_ctl++;
+	epoll_ctl(p->fd, EPOLL_CTL_DEL, n->fd, NULL);
+	return 1;
 }
 
 static void epoll_pump(struct iothread *t, int mto)
 {
-	struct epoll_event ev[8];
+	struct epoll_priv *p = t->priv.ptr;
+	nbio_flags_t flags;
 	struct nbio *n;
 	int nfd, i;
 
 again:
-	nfd = epoll_wait(t->priv.epoll, ev, sizeof(ev)/sizeof(*ev), mto);
+	nfd = epoll_wait(p->fd, p->ev, p->max_ev, mto);
 	if ( nfd < 0 ) {
 		if ( errno == EINTR )
 			goto again;
@@ -60,24 +124,47 @@ again:
 	}
 
 	for(i=0; i < nfd; i++) {
-		n = ev[i].data.ptr;
-		n->flags = 0;
-		if ( ev[i].events & (EPOLLIN|EPOLLHUP) )
-			n->flags |= NBIO_READ;
-		if ( ev[i].events & EPOLLOUT )
-			n->flags |= NBIO_WRITE;
-		if ( ev[i].events & EPOLLERR )
-			n->flags |= NBIO_ERROR;
-
-		list_move_tail(&n->list, &t->active);
+		n = p->ev[i].data.ptr;
+
+		/* Parked on a waitqueue or deleted, it's edge triggered
+		 * but that's ok since whoever wakes it up will try the
+		 * I/O until EAGAIN before going back to inactive.
+		 */
+		if ( n->mask == NBIO_DELETED || 0 == n->mask )
+			continue;
+
+		flags = 0;
+		if ( p->ev[i].events & (EPOLLIN|EPOLLHUP) )
+			flags |= NBIO_READ;
+		if ( p->ev[i].events & EPOLLOUT )
+			flags |= NBIO_WRITE;
+		if ( p->ev[i].events & EPOLLERR )
+			flags |= NBIO_ERROR;
+
+		/* may already be on the active list if it's still busy
+		 * with the other direction
+		 */
+		n->flags |= flags;
+		if ( n->flags & (n->mask | NBIO_ERROR) )
+			list_move_tail(&n->list, &t->active);
 	}
+
+	/* If we filled it, there's probably more, take bigger bites */
+	if ( (unsigned int)nfd == p->max_ev && p->max_ev < EP_MAX_EVENTS )
+		upsize_evset(p, p->max_ev * 2);
 }
 
 static void epoll_inactive(struct iothread *t, struct nbio *n)
 {
+	struct epoll_priv *p = t->priv.ptr;
 	struct epoll_event ev;
+	int want, op;
+
+	if ( n->fd < 0 )
+		return;
 
-	if ( n->ev_priv.poll == 1 )
+	want = EP_REGISTERED | (n->mask & (NBIO_READ|NBIO_WRITE));
+	if ( n->ev_priv.poll == want )
 		return;
 
 	memset(&ev, 0, sizeof(ev));
@@ -89,12 +176,15 @@ static void epoll_inactive(struct iothread *t, struct nbio *n)
 	if ( n->mask & NBIO_WRITE )
 		ev.events |= EPOLLOUT;
 
+	op = (n->ev_priv.poll & EP_REGISTERED) ?
+		EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
 	/* Eeek */
-	if ( epoll_ctl(t->priv.epoll, EPOLL_CTL_ADD, n->fd, &ev) )
+	t->nr_ctl++;
+	if ( epoll_ctl(p->fd, op, n->fd, &ev) )
 		return;
 
-	n->ev_priv.poll = 1;
-
+	n->ev_priv.poll = want;
 }
 
 static struct eventloop eventloop_epoll = {
@@ -104,6 +194,7 @@ static struct eventloop eventloop_epoll = {
 	.inactive = epoll_inactive,
 	.active = epoll_active,
 	.pump = epoll_pump,
+	.release = epoll_release,
 };
 
 void _eventloop_epoll_ctor(void)
@@ -26,6 +26,7 @@ struct _listener {
 	listener_cbfn_t cbfn;
 	listener_oom_t oom;
 	void *priv;
+	int multishot;
 };
 
 void listener_wake(struct iothread *t, struct nbio *io)
@@ -40,6 +41,12 @@ static void listener_read(struct iothread *t, struct nbio *io)
 	socklen_t salen = sizeof(sa);
 	int fd;
 
+	/* accepts come in via listener_accepted() */
+	if ( l->multishot ) {
+		nbio_inactive(t, &l->io, NBIO_READ);
+		return;
+	}
+
 again:
 #if HAVE_ACCEPT4
 	fd = accept4(l->io.fd, (struct sockaddr *)&sa, &salen,
@@ -82,6 +89,25 @@ again:
 	goto again;
 }
 
+static void listener_accepted(struct iothread *t, struct nbio *io, int fd)
+{
+	struct _listener *l = (struct _listener *)io;
+
+	if ( fd < 0 ) {
+		switch(-fd) {
+		case ENFILE:
+		case EMFILE:
+		case ENOMEM:
+		case ENOBUFS:
+			(*l->oom)(t, io);
+			break;
+		}
+		return;
+	}
+
+	(*l->cbfn)(t, fd, l->priv);
+}
+
 static void listener_dtor(struct iothread *t, struct nbio *io)
 {
 	close(io->fd);
@@ -91,70 +117,109 @@ static void listener_dtor(struct iothread *t, struct nbio *io)
 static struct nbio_ops listener_ops = {
 	.read = listener_read,
 	.dtor = listener_dtor,
+	.accepted = listener_accepted,
 };
 
-listener_t listener_inet(struct iothread *t, int type, int proto,
-				uint32_t addr, uint16_t port,
-				listener_cbfn_t cb, void *priv,
-				listener_oom_t oom)
+/* Create a bound, listening, non-blocking socket, this is separate from
+ * listener_inet() so that sockets can be created once and then handed
+ * to multiple processes.
+ */
+int listener_inet_socket(int type, int proto, uint32_t addr, uint16_t port)
 {
 	struct sockaddr_in sa;
-	struct _listener *l;
+	int fd;
 
-	l = calloc(1, sizeof(*l));
-	if ( l == NULL )
+	fd = socket(PF_INET, type, proto);
+	if ( fd < 0 )
 		goto out;
 
-	INIT_LIST_HEAD(&l->io.list);
-
-	l->cbfn = cb;
-	l->oom = oom;
-	l->priv = priv;
-
-	l->io.fd = socket(PF_INET, type, proto);
-	if ( l->io.fd < 0 )
-		goto out_free;
-
 #if 1
 	do{
 		int val = 1;
-		setsockopt(l->io.fd, SOL_SOCKET, SO_REUSEADDR,
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+				&val, sizeof(val));
+	}while(0);
+#endif
+#ifdef SO_REUSEPORT
+	/* lets each iothread have its own listening socket on the same
+	 * port, the kernel load-balances connections between them
+	 */
+	do{
+		int val = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
 				&val, sizeof(val));
 	}while(0);
 #endif
 #ifdef TCP_FASTOPEN
 	do{
 		int q = 64;
-		setsockopt(l->io.fd, SOL_TCP, TCP_FASTOPEN,
+		setsockopt(fd, SOL_TCP, TCP_FASTOPEN,
 				&q, sizeof(q));
 	}while(0);
 #endif
 
-	if ( !fd_block(l->io.fd, 0) )
+	if ( !fd_block(fd, 0) )
 		goto out_close;
 
 	sa.sin_family = AF_INET;
 	sa.sin_addr.s_addr = htonl(addr);
 	sa.sin_port = htons(port);
 
-	if ( bind(l->io.fd, (struct sockaddr *)&sa, sizeof(sa)) )
+	if ( bind(fd, (struct sockaddr *)&sa, sizeof(sa)) )
 		goto out_close;
 
-	if ( listen(l->io.fd, 64) )
+	if ( listen(fd, 64) )
 		goto out_close;
 
-	l->io.ops = &listener_ops;
-
-	nbio_add(t, &l->io, NBIO_READ);
-
 	/* success */
 	goto out;
 
 out_close:
-	close(l->io.fd);
-out_free:
-	free(l);
-	l = NULL;
+	close(fd);
+	fd = -1;
 out:
+	return fd;
+}
+
+/* Wrap an already listening socket in a listener, takes ownership of fd */
+listener_t listener_fd(struct iothread *t, int fd,
+			listener_cbfn_t cb, void *priv,
+			listener_oom_t oom)
+{
+	struct _listener *l;
+
+	l = calloc(1, sizeof(*l));
+	if ( l == NULL )
+		return NULL;
+
+	INIT_LIST_HEAD(&l->io.list);
+
+	l->cbfn = cb;
+	l->oom = oom;
+	l->priv = priv;
+	l->io.fd = fd;
+	l->io.ops = &listener_ops;
+
+	nbio_add(t, &l->io, NBIO_READ);
+	l->multishot = nbio_accept(t, &l->io);
+	return l;
+}
+
+listener_t listener_inet(struct iothread *t, int type, int proto,
+				uint32_t addr, uint16_t port,
+				listener_cbfn_t cb, void *priv,
+				listener_oom_t oom)
+{
+	listener_t l;
+	int fd;
+
+	fd = listener_inet_socket(type, proto, addr, port);
+	if ( fd < 0 )
+		return NULL;
+
+	l = listener_fd(t, fd, cb, priv, oom);
+	if ( NULL == l )
+		close(fd);
+
 	return l;
 }
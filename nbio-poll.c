@@ -86,10 +86,11 @@ again:
 
 		pfd = &p->pfd[n->ev_priv.poll];
 
+		/* compact the set as we go, keeping the index up to date */
 		if ( pfd->revents == 0 ) {
 			p->pfd[p->num_pfd].fd = pfd->fd;
 			p->pfd[p->num_pfd].events = pfd->events;
-			p->num_pfd++;
+			n->ev_priv.poll = p->num_pfd++;
 			continue;
 		}
 
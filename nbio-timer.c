@@ -0,0 +1,216 @@
+/*
+ * Hierarchical timer wheel, one per iothread. Millisecond ticks, four
+ * levels of 64 slots each cover about four and a half hours, anything
+ * further out is clamped. Timers in the upper levels are cascaded down
+ * as the lower levels wrap, so they're only ever touched once per level.
+*/
+#include <compiler.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <list.h>
+#include <nbio.h>
+#include <nbio-timer.h>
+
+#define WHEEL_BITS	6
+#define WHEEL_SLOTS	(1U << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS	4
+#define WHEEL_MAX	((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct nbio_wheel {
+	/* next tick to be run, everything before it has expired */
+	uint64_t		w_base;
+	/* time as of the last nbio_pump() */
+	uint64_t		w_now;
+	unsigned int		w_count;
+	struct list_head	w_slot[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned int slot_idx(uint64_t when, unsigned int lvl)
+{
+	return (when >> (lvl * WHEEL_BITS)) & WHEEL_MASK;
+}
+
+static void wheel_insert(struct nbio_wheel *w, struct nbio_timer *tm)
+{
+	uint64_t delta;
+	unsigned int lvl;
+
+	if ( tm->tm_expires < w->w_base )
+		tm->tm_expires = w->w_base;
+
+	delta = tm->tm_expires - w->w_base;
+	if ( delta > WHEEL_MAX ) {
+		tm->tm_expires = w->w_base + WHEEL_MAX;
+		delta = WHEEL_MAX;
+	}
+
+	for(lvl = 0; lvl < WHEEL_LEVELS - 1; lvl++) {
+		if ( delta < (1ULL << ((lvl + 1) * WHEEL_BITS)) )
+			break;
+	}
+
+	list_add_tail(&tm->tm_list,
+			&w->w_slot[lvl][slot_idx(tm->tm_expires, lvl)]);
+}
+
+void nbio_timer_init(struct nbio_timer *tm, nbio_timer_cb_t cb)
+{
+	INIT_LIST_HEAD(&tm->tm_list);
+	tm->tm_expires = 0;
+	tm->tm_cb = cb;
+}
+
+void nbio_timer_arm(struct iothread *t, struct nbio_timer *tm,
+			unsigned int msec)
+{
+	struct nbio_wheel *w = t->wheel;
+
+	if ( nbio_timer_armed(tm) )
+		list_del(&tm->tm_list);
+	else
+		w->w_count++;
+
+	tm->tm_expires = w->w_now + msec;
+	wheel_insert(w, tm);
+}
+
+void nbio_timer_disarm(struct iothread *t, struct nbio_timer *tm)
+{
+	if ( !nbio_timer_armed(tm) )
+		return;
+	list_del(&tm->tm_list);
+	t->wheel->w_count--;
+}
+
+/* Re-file everything in a slot in to the lower levels */
+static void cascade(struct nbio_wheel *w, unsigned int lvl)
+{
+	struct nbio_timer *tm, *tmp;
+	LIST_HEAD(q);
+
+	list_splice(&w->w_slot[lvl][slot_idx(w->w_base, lvl)], &q);
+	list_for_each_entry_safe(tm, tmp, &q, tm_list) {
+		list_del(&tm->tm_list);
+		wheel_insert(w, tm);
+	}
+}
+
+void _nbio_timers_run(struct iothread *t)
+{
+	struct nbio_wheel *w = t->wheel;
+	struct nbio_timer *tm;
+	unsigned int lvl;
+	LIST_HEAD(q);
+
+	w->w_now = now_ms();
+
+	/* nothing armed, catch up in one go */
+	if ( 0 == w->w_count ) {
+		w->w_base = w->w_now + 1;
+		return;
+	}
+
+	while ( w->w_base <= w->w_now ) {
+		for(lvl = 1; lvl < WHEEL_LEVELS; lvl++) {
+			if ( slot_idx(w->w_base, lvl - 1) )
+				break;
+			cascade(w, lvl);
+		}
+
+		list_splice(&w->w_slot[0][slot_idx(w->w_base, 0)], &q);
+		w->w_base++;
+
+		/* callbacks are free to re-arm, or free the timer */
+		while ( !list_empty(&q) ) {
+			tm = list_entry(q.next, struct nbio_timer, tm_list);
+			list_del(&tm->tm_list);
+			w->w_count--;
+			(*tm->tm_cb)(t, tm);
+		}
+	}
+}
+
+/* When the earliest timer which might be in a given slot is due */
+static uint64_t slot_time(struct nbio_wheel *w, unsigned int lvl,
+				unsigned int idx)
+{
+	unsigned int shift = lvl * WHEEL_BITS;
+	unsigned int cur = slot_idx(w->w_base, lvl);
+	uint64_t low = w->w_base & ((1ULL << shift) - 1);
+	uint64_t ret;
+
+	ret = (w->w_base >> (shift + WHEEL_BITS)) << (shift + WHEEL_BITS);
+	ret += (uint64_t)idx << shift;
+
+	/* already cascaded this slot, so it's for next time round */
+	if ( idx < cur || (idx == cur && low) )
+		ret += 1ULL << (shift + WHEEL_BITS);
+
+	return ret;
+}
+
+/* Clamp the eventloop timeout so that we wake for the next expiry,
+ * upper levels are approximate so we might wake early just to cascade.
+ */
+int _nbio_timers_mto(struct iothread *t, int mto)
+{
+	struct nbio_wheel *w = t->wheel;
+	uint64_t next = UINT64_MAX, when;
+	unsigned int lvl, i, idx;
+
+	if ( 0 == w->w_count )
+		return mto;
+
+	for(lvl = 0; lvl < WHEEL_LEVELS; lvl++) {
+		for(i = 0; i < WHEEL_SLOTS; i++) {
+			idx = (slot_idx(w->w_base, lvl) + i) & WHEEL_MASK;
+			if ( list_empty(&w->w_slot[lvl][idx]) )
+				continue;
+			when = slot_time(w, lvl, idx);
+			if ( when < next )
+				next = when;
+		}
+	}
+
+	w->w_now = now_ms();
+	if ( next <= w->w_now )
+		return 0;
+	if ( mto < 0 || next - w->w_now < (uint64_t)mto )
+		return next - w->w_now;
+	return mto;
+}
+
+int _nbio_timers_init(struct iothread *t)
+{
+	struct nbio_wheel *w;
+	unsigned int lvl, i;
+
+	w = calloc(1, sizeof(*w));
+	if ( NULL == w )
+		return 0;
+
+	for(lvl = 0; lvl < WHEEL_LEVELS; lvl++)
+		for(i = 0; i < WHEEL_SLOTS; i++)
+			INIT_LIST_HEAD(&w->w_slot[lvl][i]);
+
+	w->w_now = now_ms();
+	w->w_base = w->w_now;
+	t->wheel = w;
+	return 1;
+}
+
+void _nbio_timers_fini(struct iothread *t)
+{
+	free(t->wheel);
+	t->wheel = NULL;
+}
@@ -0,0 +1,782 @@
+/*
+ * io_uring based eventloop
+ *
+ * Readiness is done with one-shot poll requests, armed when an nbio goes
+ * inactive and cancelled when it goes active. On top of that, listeners
+ * can switch to multishot accept and connections to multishot recv into
+ * a ring of kernel provided buffers, and sends can be queued as SQEs. All
+ * the SQEs queued while running the active list go to the kernel in one
+ * io_uring_enter() which also waits for the next completions.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <stdio.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+
+#include <compiler.h>
+#include <list.h>
+#include <nbio.h>
+#include <hgang.h>
+#include <uring.h>
+#include <os.h>
+
+#if 0
+#define dprintf printf
+#else
+#define dprintf(x...) do {} while(0)
+#endif
+
+#define URING_ENTRIES	256
+
+/* provided buffers for multishot recv */
+#define URING_NR_BUFS	512
+#define URING_BUF_SZ	2048
+#define URING_BGID	0
+#define BID_NONE	0xffff
+
+/* user_data is the slot pointer with the op and a generation number in
+ * the top 16 bits, the generation is needed to ignore stale polls which
+ * were cancelled then re-armed before the cancellation completed.
+ */
+#define UD_PTR_MASK	((1ULL << 48) - 1)
+#define UD_OP_SHIFT	56
+#define UD_GEN_SHIFT	48
+#define OP_POLL		1
+#define OP_ACCEPT	2
+#define OP_RECV		3
+#define OP_SEND		4
+
+#define SLOT_ACCEPT	1
+#define SLOT_RECV	2
+
+#define SLOT_WAITING	(1 << 0)
+#define SLOT_RX_ARMED	(1 << 1)
+#define SLOT_RX_CANCEL	(1 << 2)
+#define SLOT_TX		(1 << 3)
+#define SLOT_DEAD	(1 << 4)
+#define SLOT_RX_HELD	(1 << 5)
+
+/* The eventloops view of an nbio, hangs off ev_priv.ptr */
+struct uslot {
+	struct nbio		*s_nbio;
+	struct list_head	s_list;
+	unsigned int		s_inflight;
+	uint32_t		s_poll;
+	uint8_t			s_gen;
+	uint8_t			s_mode;
+	uint8_t			s_flags;
+
+	/* received data not yet taken by recvd(), and EOF/error which
+	 * has to be reported after it. s_rx_res is 1 if there's none.
+	 */
+	uint16_t		s_park_head;
+	uint16_t		s_park_tail;
+	uint16_t		s_park_off;
+	int			s_rx_res;
+};
+
+struct ubuf {
+	uint32_t		b_len;
+	uint16_t		b_next;
+};
+
+struct uloop {
+	struct uring		l_ring;
+	hgang_t			l_slots;
+
+	struct io_uring_buf_ring *l_br;
+	size_t			l_br_sz;
+	uint8_t			*l_bufs;
+	uint16_t		l_br_tail;
+	unsigned int		l_bufs_out;
+	struct ubuf		l_buf[URING_NR_BUFS];
+
+	/* slots which need their rx side looked at before we sleep */
+	struct list_head	l_rxq;
+
+	/* released with I/O still in flight, waiting to call dtor */
+	struct list_head	l_dead;
+};
+
+static uint64_t mkud(struct uslot *s, unsigned int op, uint8_t gen)
+{
+	return (uint64_t)(uintptr_t)s |
+		((uint64_t)op << UD_OP_SHIFT) |
+		((uint64_t)gen << UD_GEN_SHIFT);
+}
+
+static struct uslot *get_slot(struct uloop *l, struct nbio *n)
+{
+	struct uslot *s = n->ev_priv.ptr;
+
+	if ( likely(NULL != s) )
+		return s;
+
+	s = hgang_alloc0(l->l_slots);
+	if ( NULL == s )
+		return NULL;
+
+	s->s_nbio = n;
+	INIT_LIST_HEAD(&s->s_list);
+	s->s_park_head = s->s_park_tail = BID_NONE;
+	s->s_rx_res = 1;
+	n->ev_priv.ptr = s;
+	return s;
+}
+
+static void put_slot(struct uloop *l, struct uslot *s)
+{
+	list_del(&s->s_list);
+	s->s_nbio->ev_priv.ptr = NULL;
+	hgang_return(l->l_slots, s);
+}
+
+static int slot_alive(struct uslot *s)
+{
+	return !(s->s_flags & SLOT_DEAD) && s->s_nbio->mask != NBIO_DELETED;
+}
+
+static struct io_uring_sqe *get_sqe(struct uloop *l)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(&l->l_ring);
+	if ( NULL == sqe )
+		fprintf(stderr, "uring: submission queue full\n");
+	return sqe;
+}
+
+static void cancel(struct uloop *l, uint64_t ud)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(l);
+	if ( NULL == sqe )
+		return;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = ud;
+	sqe->user_data = 0;
+}
+
+static void buf_recycle(struct uloop *l, uint16_t bid)
+{
+	struct io_uring_buf *b;
+
+	b = &l->l_br->bufs[l->l_br_tail & (URING_NR_BUFS - 1)];
+	b->addr = (uint64_t)(uintptr_t)(l->l_bufs + bid * URING_BUF_SZ);
+	b->len = URING_BUF_SZ;
+	b->bid = bid;
+	l->l_br_tail++;
+	__atomic_store_n(&l->l_br->tail, l->l_br_tail, __ATOMIC_RELEASE);
+	l->l_bufs_out--;
+}
+
+static void park_flush(struct uloop *l, struct uslot *s)
+{
+	uint16_t bid;
+
+	while ( s->s_park_head != BID_NONE ) {
+		bid = s->s_park_head;
+		s->s_park_head = l->l_buf[bid].b_next;
+		buf_recycle(l, bid);
+	}
+	s->s_park_tail = BID_NONE;
+	s->s_park_off = 0;
+}
+
+static void park_push(struct uloop *l, struct uslot *s,
+			uint16_t bid, uint32_t len)
+{
+	l->l_buf[bid].b_len = len;
+	l->l_buf[bid].b_next = BID_NONE;
+	if ( s->s_park_tail == BID_NONE )
+		s->s_park_head = bid;
+	else
+		l->l_buf[s->s_park_tail].b_next = bid;
+	s->s_park_tail = bid;
+}
+
+static void rx_want(struct uloop *l, struct uslot *s)
+{
+	if ( list_empty(&s->s_list) )
+		list_add_tail(&s->s_list, &l->l_rxq);
+}
+
+static int rx_arm(struct uloop *l, struct uslot *s)
+{
+	struct io_uring_sqe *sqe;
+	struct nbio *n = s->s_nbio;
+
+	/* wait for some buffers to come back */
+	if ( s->s_mode == SLOT_RECV && l->l_bufs_out >= URING_NR_BUFS )
+		return 0;
+
+	sqe = get_sqe(l);
+	if ( NULL == sqe )
+		return 0;
+
+	sqe->fd = n->fd;
+	if ( s->s_mode == SLOT_ACCEPT ) {
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK|SOCK_CLOEXEC;
+		sqe->user_data = mkud(s, OP_ACCEPT, 0);
+	}else{
+		sqe->opcode = IORING_OP_RECV;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
+		sqe->user_data = mkud(s, OP_RECV, 0);
+	}
+
+	s->s_flags |= SLOT_RX_ARMED;
+	s->s_inflight++;
+	return 1;
+}
+
+/* Hand parked data, and then any EOF or error, to recvd() until it stops
+ * taking it. Returns 1 if recvd() was called at all.
+ */
+static int rx_deliver(struct iothread *t, struct uloop *l, struct uslot *s)
+{
+	struct nbio *n = s->s_nbio;
+	struct ubuf *b;
+	uint16_t bid;
+	size_t len, used;
+	int ret = 0;
+
+	while ( s->s_park_head != BID_NONE ) {
+		bid = s->s_park_head;
+		b = &l->l_buf[bid];
+		len = b->b_len - s->s_park_off;
+
+		used = n->ops->recvd(t, n, l->l_bufs + bid * URING_BUF_SZ +
+					s->s_park_off, len);
+		ret = 1;
+
+		if ( !slot_alive(s) ) {
+			park_flush(l, s);
+			return ret;
+		}
+
+		if ( used < len ) {
+			/* backpressure, stop receiving until they
+			 * want more
+			 */
+			s->s_park_off += used;
+			s->s_flags |= SLOT_RX_HELD;
+			if ( (s->s_flags & (SLOT_RX_ARMED|SLOT_RX_CANCEL)) ==
+					SLOT_RX_ARMED ) {
+				cancel(l, mkud(s, OP_RECV, 0));
+				s->s_flags |= SLOT_RX_CANCEL;
+			}
+			return ret;
+		}
+
+		s->s_park_head = b->b_next;
+		if ( s->s_park_head == BID_NONE )
+			s->s_park_tail = BID_NONE;
+		s->s_park_off = 0;
+		buf_recycle(l, bid);
+	}
+
+	if ( s->s_rx_res <= 0 ) {
+		int res = s->s_rx_res;
+		s->s_rx_res = 1;
+		n->ops->recvd(t, n, NULL, res);
+		ret = 1;
+	}
+
+	return ret;
+}
+
+/* Returns 1 if any callbacks were made */
+static int rx_service(struct iothread *t, struct uloop *l)
+{
+	struct uslot *s;
+	LIST_HEAD(q);
+	int ret = 0;
+
+	/* callbacks may add things back on */
+	list_splice(&l->l_rxq, &q);
+
+	while ( !list_empty(&q) ) {
+		s = list_entry(q.next, struct uslot, s_list);
+		list_del(&s->s_list);
+
+		if ( !slot_alive(s) || !(s->s_flags & SLOT_WAITING) ||
+				!(s->s_nbio->mask & NBIO_READ) )
+			continue;
+
+		if ( s->s_park_head != BID_NONE || s->s_rx_res <= 0 ) {
+			s->s_flags &= ~SLOT_RX_HELD;
+			ret |= rx_deliver(t, l, s);
+			if ( !slot_alive(s) || !(s->s_flags & SLOT_WAITING) ||
+					s->s_park_head != BID_NONE )
+				continue;
+		}
+
+		if ( s->s_flags & SLOT_RX_ARMED )
+			continue;
+
+		if ( !rx_arm(l, s) )
+			rx_want(l, s);
+	}
+
+	return ret;
+}
+
+static void poll_cancel(struct uloop *l, struct uslot *s)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(l);
+	if ( NULL == sqe )
+		return;
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = mkud(s, OP_POLL, s->s_gen);
+	sqe->user_data = 0;
+
+	s->s_poll = 0;
+	s->s_gen++;
+}
+
+static void poll_arm(struct uloop *l, struct uslot *s, uint32_t events)
+{
+	struct io_uring_sqe *sqe;
+
+	if ( s->s_poll == events )
+		return;
+	if ( s->s_poll )
+		poll_cancel(l, s);
+
+	sqe = get_sqe(l);
+	if ( NULL == sqe )
+		return;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = s->s_nbio->fd;
+	sqe->poll32_events = events;
+	sqe->user_data = mkud(s, OP_POLL, s->s_gen);
+
+	s->s_poll = events;
+	s->s_inflight++;
+}
+
+static void uring_inactive(struct iothread *t, struct nbio *n)
+{
+	struct uloop *l = t->priv.ptr;
+	struct uslot *s;
+	uint32_t ev = 0;
+
+	s = get_slot(l, n);
+	if ( NULL == s ) {
+		fprintf(stderr, "uring: %s\n", os_err());
+		return;
+	}
+
+	s->s_flags |= SLOT_WAITING;
+
+	if ( n->mask & NBIO_READ ) {
+		if ( s->s_mode )
+			rx_want(l, s);
+		else
+			ev |= POLLIN;
+	}
+	if ( n->mask & NBIO_WRITE )
+		ev |= POLLOUT;
+
+	if ( ev )
+		poll_arm(l, s, ev);
+}
+
+static void uring_active(struct iothread *t, struct nbio *n)
+{
+	struct uloop *l = t->priv.ptr;
+	struct uslot *s = n->ev_priv.ptr;
+
+	if ( NULL == s )
+		return;
+
+	s->s_flags &= ~SLOT_WAITING;
+	if ( s->s_poll )
+		poll_cancel(l, s);
+}
+
+static int uring_accept(struct iothread *t, struct nbio *n)
+{
+	struct uslot *s;
+
+	s = get_slot(t->priv.ptr, n);
+	if ( NULL == s )
+		return 0;
+
+	s->s_mode = SLOT_ACCEPT;
+	return 1;
+}
+
+static int uring_recv(struct iothread *t, struct nbio *n)
+{
+	struct uslot *s;
+
+	s = get_slot(t->priv.ptr, n);
+	if ( NULL == s )
+		return 0;
+
+	s->s_mode = SLOT_RECV;
+	return 1;
+}
+
+static int uring_send(struct iothread *t, struct nbio *n,
+			const void *buf, size_t len, int flags)
+{
+	struct uloop *l = t->priv.ptr;
+	struct io_uring_sqe *sqe;
+	struct uslot *s;
+
+	s = get_slot(l, n);
+	if ( NULL == s || (s->s_flags & SLOT_TX) )
+		return 0;
+
+	sqe = get_sqe(l);
+	if ( NULL == sqe )
+		return 0;
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = n->fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->msg_flags = flags;
+	sqe->user_data = mkud(s, OP_SEND, 0);
+
+	s->s_flags |= SLOT_TX;
+	s->s_inflight++;
+	return 1;
+}
+
+static int uring_release(struct iothread *t, struct nbio *n)
+{
+	struct uloop *l = t->priv.ptr;
+	struct uslot *s = n->ev_priv.ptr;
+
+	if ( NULL == s )
+		return 1;
+
+	s->s_flags |= SLOT_DEAD;
+	list_del(&s->s_list);
+	park_flush(l, s);
+
+	if ( s->s_poll )
+		poll_cancel(l, s);
+	if ( s->s_flags & SLOT_RX_ARMED )
+		cancel(l, mkud(s, (s->s_mode == SLOT_ACCEPT) ?
+					OP_ACCEPT : OP_RECV, 0));
+	if ( s->s_flags & SLOT_TX )
+		cancel(l, mkud(s, OP_SEND, 0));
+
+	if ( s->s_inflight ) {
+		list_add_tail(&s->s_list, &l->l_dead);
+		return 0;
+	}
+
+	put_slot(l, s);
+	return 1;
+}
+
+static void do_poll(struct iothread *t, struct uslot *s,
+			const struct io_uring_cqe *cqe, uint8_t gen)
+{
+	struct nbio *n = s->s_nbio;
+
+	if ( gen != s->s_gen || !s->s_poll )
+		return;
+
+	s->s_poll = 0;
+	s->s_flags &= ~SLOT_WAITING;
+
+	n->flags = 0;
+	if ( cqe->res < 0 ) {
+		n->flags |= NBIO_ERROR;
+	}else{
+		if ( cqe->res & (POLLIN|POLLHUP) )
+			n->flags |= NBIO_READ;
+		if ( cqe->res & POLLOUT )
+			n->flags |= NBIO_WRITE;
+		if ( cqe->res & POLLERR )
+			n->flags |= NBIO_ERROR;
+	}
+
+	list_move_tail(&n->list, &t->active);
+}
+
+static void do_accept(struct iothread *t, struct uloop *l, struct uslot *s,
+			const struct io_uring_cqe *cqe, int more)
+{
+	struct nbio *n = s->s_nbio;
+
+	if ( !more )
+		s->s_flags &= ~(SLOT_RX_ARMED|SLOT_RX_CANCEL);
+
+	if ( !slot_alive(s) ) {
+		if ( cqe->res >= 0 )
+			close(cqe->res);
+		return;
+	}
+
+	if ( cqe->res != -ECANCELED )
+		n->ops->accepted(t, n, cqe->res);
+
+	/* re-arm unless the listener backed off */
+	if ( !more && slot_alive(s) && (s->s_flags & SLOT_WAITING) &&
+			(n->mask & NBIO_READ) )
+		rx_want(l, s);
+}
+
+static void do_recv(struct iothread *t, struct uloop *l, struct uslot *s,
+			const struct io_uring_cqe *cqe, int more)
+{
+	if ( !more )
+		s->s_flags &= ~(SLOT_RX_ARMED|SLOT_RX_CANCEL);
+
+	if ( cqe->flags & IORING_CQE_F_BUFFER ) {
+		uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+		l->l_bufs_out++;
+		if ( cqe->res > 0 && slot_alive(s) )
+			park_push(l, s, bid, cqe->res);
+		else
+			buf_recycle(l, bid);
+	}else if ( cqe->res == -ENOBUFS ) {
+		/* out of buffers, try again when some come back */
+		rx_want(l, s);
+	}else if ( cqe->res <= 0 && cqe->res != -ECANCELED ) {
+		s->s_rx_res = cqe->res;
+	}
+
+	if ( !slot_alive(s) )
+		return;
+
+	/* if parked data is being held back, wait to be asked for it */
+	if ( s->s_flags & SLOT_RX_HELD )
+		return;
+
+	rx_deliver(t, l, s);
+
+	if ( !more && slot_alive(s) && (s->s_flags & SLOT_WAITING) &&
+			(s->s_nbio->mask & NBIO_READ) )
+		rx_want(l, s);
+}
+
+static void do_send(struct iothread *t, struct uslot *s,
+			const struct io_uring_cqe *cqe)
+{
+	struct nbio *n = s->s_nbio;
+
+	s->s_flags &= ~SLOT_TX;
+	if ( slot_alive(s) )
+		n->ops->sent(t, n, cqe->res);
+}
+
+static void dispatch(struct iothread *t, struct uloop *l,
+			const struct io_uring_cqe *cqe)
+{
+	struct uslot *s;
+	unsigned int op;
+	uint8_t gen;
+	int more;
+
+	s = (struct uslot *)(uintptr_t)(cqe->user_data & UD_PTR_MASK);
+	if ( NULL == s )
+		return;
+
+	op = cqe->user_data >> UD_OP_SHIFT;
+	gen = (cqe->user_data >> UD_GEN_SHIFT) & 0xff;
+	more = !!(cqe->flags & IORING_CQE_F_MORE);
+
+	if ( !more ) {
+		assert(s->s_inflight);
+		s->s_inflight--;
+	}
+
+	switch(op) {
+	case OP_POLL:
+		if ( slot_alive(s) )
+			do_poll(t, s, cqe, gen);
+		break;
+	case OP_ACCEPT:
+		do_accept(t, l, s, cqe, more);
+		break;
+	case OP_RECV:
+		do_recv(t, l, s, cqe, more);
+		break;
+	case OP_SEND:
+		do_send(t, s, cqe);
+		break;
+	default:
+		abort();
+	}
+
+	if ( (s->s_flags & SLOT_DEAD) && 0 == s->s_inflight ) {
+		struct nbio *n = s->s_nbio;
+		put_slot(l, s);
+		n->ops->dtor(t, n);
+	}
+}
+
+static void uring_pump(struct iothread *t, int mto)
+{
+	struct uloop *l = t->priv.ptr;
+	struct io_uring_cqe *cqe;
+
+	/* don't sleep if rx callbacks made anything runnable */
+	if ( rx_service(t, l) && !list_empty(&t->active) )
+		mto = 0;
+
+	/* Unlike epoll, we can wake up for completions which don't make
+	 * anything runnable (stale polls, sends on dead conns) so when
+	 * asked to block, keep going until there is actual work.
+	 */
+	do {
+		if ( uring_submit(&l->l_ring, 1, mto) < 0 )
+			return;
+
+		while ( (cqe = uring_peek_cqe(&l->l_ring)) ) {
+			struct io_uring_cqe c = *cqe;
+
+			/* free the CQ slot before callbacks queue more work */
+			uring_cqe_seen(&l->l_ring);
+			dispatch(t, l, &c);
+		}
+
+		if ( rx_service(t, l) )
+			break;
+	}while ( mto < 0 &&
+			list_empty(&t->active) &&
+			list_empty(&t->deleted) );
+}
+
+static int bufs_init(struct uloop *l)
+{
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+
+	l->l_br_sz = URING_NR_BUFS * sizeof(struct io_uring_buf);
+	l->l_br = mmap(NULL, l->l_br_sz, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if ( l->l_br == MAP_FAILED )
+		goto err;
+
+	l->l_bufs = mmap(NULL, URING_NR_BUFS * URING_BUF_SZ,
+			PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if ( l->l_bufs == MAP_FAILED )
+		goto err_unmap_ring;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)l->l_br;
+	reg.ring_entries = URING_NR_BUFS;
+	reg.bgid = URING_BGID;
+	if ( uring_register(&l->l_ring, IORING_REGISTER_PBUF_RING, &reg, 1) )
+		goto err_unmap_bufs;
+
+	/* recycle hands them all to the kernel */
+	l->l_bufs_out = URING_NR_BUFS;
+	for(i = 0; i < URING_NR_BUFS; i++)
+		buf_recycle(l, i);
+
+	return 1;
+
+err_unmap_bufs:
+	munmap(l->l_bufs, URING_NR_BUFS * URING_BUF_SZ);
+err_unmap_ring:
+	munmap(l->l_br, l->l_br_sz);
+err:
+	return 0;
+}
+
+static int loop_init(struct iothread *t)
+{
+	struct uloop *l;
+
+	l = calloc(1, sizeof(*l));
+	if ( NULL == l )
+		goto out;
+
+	INIT_LIST_HEAD(&l->l_rxq);
+	INIT_LIST_HEAD(&l->l_dead);
+
+	l->l_slots = hgang_new(sizeof(struct uslot), 0);
+	if ( NULL == l->l_slots )
+		goto out_free;
+
+	if ( !uring_init(&l->l_ring, URING_ENTRIES) )
+		goto out_free_slots;
+
+	/* need to be able to wait with a timeout */
+	if ( !(l->l_ring.u_features & IORING_FEAT_EXT_ARG) )
+		goto out_fini;
+
+	if ( !bufs_init(l) )
+		goto out_fini;
+
+	t->priv.ptr = l;
+	return 1;
+
+out_fini:
+	uring_fini(&l->l_ring);
+out_free_slots:
+	hgang_free(l->l_slots);
+out_free:
+	free(l);
+out:
+	return 0;
+}
+
+static void loop_fini(struct iothread *t)
+{
+	struct uloop *l = t->priv.ptr;
+	struct uslot *s, *tmp;
+
+	/* closing the ring cancels anything in flight */
+	uring_fini(&l->l_ring);
+
+	list_for_each_entry_safe(s, tmp, &l->l_dead, s_list) {
+		struct nbio *n = s->s_nbio;
+		put_slot(l, s);
+		n->ops->dtor(t, n);
+	}
+
+	munmap(l->l_bufs, URING_NR_BUFS * URING_BUF_SZ);
+	munmap(l->l_br, l->l_br_sz);
+	hgang_free(l->l_slots);
+	free(l);
+}
+
+static struct eventloop eventloop_uring = {
+	.name = "uring",
+	.init = loop_init,
+	.fini = loop_fini,
+	.inactive = uring_inactive,
+	.active = uring_active,
+	.pump = uring_pump,
+	.accept = uring_accept,
+	.recv = uring_recv,
+	.send = uring_send,
+	.release = uring_release,
+};
+
+void _eventloop_uring_ctor(void)
+{
+	eventloop_add(&eventloop_uring);
+}
@@ -12,6 +12,10 @@
  *  o nbio_pump() - Pump events
  *  o nbio_add() - Register an fd with read/write/error callbacks
  *  o nbio_del() - Remove an fd
+ *  o nbio_accept()/nbio_recv()/nbio_send() - Completion based I/O
+ *
+ * Timers live in nbio-timer.c, they're run at the start of each pump and
+ * the next expiry bounds how long the eventloop may sleep for.
 */
 #include <compiler.h>
 #include <stdlib.h>
@@ -21,11 +25,10 @@
 #include <list.h>
 #include <assert.h>
 #include <nbio.h>
+#include <nbio-timer.h>
 
 static struct eventloop *ev_list;
 
-#define NBIO_DELETED 0x80
-
 struct eventloop *eventloop_find(const char *name)
 {
 	struct eventloop *e;
@@ -64,15 +67,21 @@ int nbio_init(struct iothread *t, const char *plugin)
 	if ( NULL == t->plugin )
 		return 0;
 
+	if ( !_nbio_timers_init(t) )
+		return 0;
+
 	for ( ; !t->plugin->init(t); t->plugin = t->plugin->next ) {
-		if ( plugin || NULL == t->plugin->next )
+		if ( plugin || NULL == t->plugin->next ) {
+			_nbio_timers_fini(t);
 			return 0;
+		}
 	}
 
 	printf("nbio: using %s eventloop\n", t->plugin->name);
 	INIT_LIST_HEAD(&t->active);
 	INIT_LIST_HEAD(&t->inactive);
 	INIT_LIST_HEAD(&t->deleted);
+	t->nr_ctl = 0;
 	return 1;
 }
 
@@ -94,6 +103,7 @@ void nbio_fini(struct iothread *t)
 	}
 
 	t->plugin->fini(t);
+	_nbio_timers_fini(t);
 }
 
 void nbio_pump(struct iothread *t, int mto)
@@ -101,6 +111,8 @@ void nbio_pump(struct iothread *t, int mto)
 	struct nbio *n, *tmp;
 	struct nbio *d, *tmp2;
 
+	_nbio_timers_run(t);
+
 	while ( !list_empty(&t->active) ) {
 		list_for_each_entry_safe(n, tmp, &t->active, list) {
 			if ( NBIO_DELETED == n->mask )
@@ -117,6 +129,13 @@ void nbio_pump(struct iothread *t, int mto)
 			/* let read/write have a chance to determine
 			 * exact nature of the error
 			 */
+			if ( (n->flags & NBIO_ERROR) && n->ops->error &&
+					n->ops->error(t, n) ) {
+				n->flags &= ~NBIO_ERROR;
+				if ( n->mask && !(n->flags & n->mask) )
+					nbio_inactive(t, n, 0);
+				continue;
+			}
 			if ( n->flags & NBIO_ERROR ) {
 				n->mask = NBIO_DELETED;
 				n->flags = 0;
@@ -128,6 +147,8 @@ void nbio_pump(struct iothread *t, int mto)
 
 	list_for_each_entry_safe(d, tmp2, &t->deleted, list) {
 		list_del(&d->list);
+		if ( t->plugin->release && !t->plugin->release(t, d) )
+			continue;
 		d->ops->dtor(t, d);
 	}
 
@@ -138,7 +159,7 @@ void nbio_pump(struct iothread *t, int mto)
 #endif
 
 	if ( !list_empty(&t->inactive) )
-		t->plugin->pump(t, mto);
+		t->plugin->pump(t, _nbio_timers_mto(t, mto));
 }
 
 void nbio_del(struct iothread *t, struct nbio *n)
@@ -217,8 +238,35 @@ void nbio_add(struct iothread *t, struct nbio *io, nbio_flags_t wait)
 	do_set_wait(t, io, wait, NULL);
 }
 
+/* Switch n over to multishot accept, if the eventloop supports it */
+int nbio_accept(struct iothread *t, struct nbio *n)
+{
+	if ( NULL == t->plugin->accept )
+		return 0;
+	return t->plugin->accept(t, n);
+}
+
+/* Switch n over to multishot recv, if the eventloop supports it */
+int nbio_recv(struct iothread *t, struct nbio *n)
+{
+	if ( NULL == t->plugin->recv )
+		return 0;
+	return t->plugin->recv(t, n);
+}
+
+/* Queue a send, buf must remain valid until the sent() callback */
+int nbio_send(struct iothread *t, struct nbio *n,
+		const void *buf, size_t len, int flags)
+{
+	if ( NULL == t->plugin->send )
+		return 0;
+	return t->plugin->send(t, n, buf, len, flags);
+}
+
 static void __attribute__((constructor)) _ctor(void)
 {
+	/* last one registered is the default */
+	_eventloop_uring_ctor();
 	_eventloop_poll_ctor();
 	_eventloop_epoll_ctor();
 }
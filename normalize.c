@@ -23,6 +23,7 @@
  *  o n_path() - normalize file paths for /./ and /../
  *  o n_split() - split file path from query string
  *  o n_utf8() - normalize UTF-8 characters
+ *  o n_canonical() - check if a URL is already normalized
  *  o nads_normalize() - external API to normalize a URL
 */
 
@@ -36,6 +37,11 @@
 #include <compiler.h>
 #include <normalize.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_NADS_SIMD 1
+#endif
+
 static int nads_ws(unsigned long x)
 {
 	static const unsigned int flags = NADS_WS_CASE_SENSITIVE;
@@ -43,7 +49,7 @@ static int nads_ws(unsigned long x)
 }
 
 /* The actual error code, kinda like errno */
-static unsigned int nads_errcode;
+static __thread unsigned int nads_errcode;
 
 static const char *estr[]={
 	[ NADS_ERR_SUCCESS ] = "Success",
@@ -53,6 +59,7 @@ static const char *estr[]={
 	[ NADS_ERR_BAD_UTF8 ] = "Bad UTF-8 character sequence",
 	[ NADS_ERR_NULL ] = "NUL character insertion",
 	[ NADS_ERR_OOM ] = "Out of memory",
+	[ NADS_ERR_TOO_LONG ] = "URL too long",
 };
 
 /* nads_error:
@@ -100,7 +107,7 @@ const char *nads_errstr(void)
 {
 	return nads_strerror(nads_errcode);
 }
-static char uribuf[NADS_MAX_URI];
+static __thread char uribuf[NADS_MAX_URI];
 
 /* ===== Ctype like functions ===== */
 #define T_HEX (1<<0)
@@ -504,38 +511,193 @@ static int n_utf8(char *buf)
 	return 1;
 }
 
-/* nads_normalize:
+static int canonical_c(const uint8_t *p, size_t len, size_t *qpos)
+{
+	size_t i, q = len;
+
+	for(i = 0; i < len; i++) {
+		switch(p[i]) {
+		case '%':
+		case '\\':
+		case '\0':
+			return 0;
+		case '?':
+			if ( q == len )
+				q = i;
+			break;
+		case '/':
+			if ( i + 1 < len && (p[i + 1] == '/' || p[i + 1] == '.') )
+				return 0;
+			break;
+		default:
+			if ( p[i] & 0x80 )
+				return 0;
+			break;
+		}
+	}
+
+	*qpos = q;
+	return 1;
+}
+
+#if HAVE_NADS_SIMD
+__attribute__((target("sse2")))
+static int canonical_sse2(const uint8_t *p, size_t len, size_t *qpos)
+{
+	const __m128i pct = _mm_set1_epi8('%');
+	const __m128i bsl = _mm_set1_epi8('\\');
+	const __m128i slash = _mm_set1_epi8('/');
+	const __m128i dot = _mm_set1_epi8('.');
+	const __m128i qm = _mm_set1_epi8('?');
+	const __m128i nul = _mm_setzero_si128();
+	unsigned int bad, sl, q, carry = 0;
+	size_t i, q_off = len;
+	uint8_t tail[16];
+
+	for(i = 0; i < len; i += 16) {
+		const uint8_t *blk = p + i;
+		unsigned int valid = 0xffff;
+		__m128i v;
+
+		if ( len - i < 16 ) {
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, blk, len - i);
+			blk = tail;
+			valid = (1U << (len - i)) - 1;
+		}
+
+		v = _mm_loadu_si128((const __m128i *)blk);
+
+		/* top bit set is non-ASCII */
+		bad = _mm_movemask_epi8(v);
+		bad |= _mm_movemask_epi8(_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, pct),
+						_mm_cmpeq_epi8(v, bsl)),
+				_mm_cmpeq_epi8(v, nul)));
+
+		/* a '/' followed by '/' or '.' */
+		sl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, slash));
+		bad |= ((sl << 1) | carry) &
+			(sl | _mm_movemask_epi8(_mm_cmpeq_epi8(v, dot)));
+		carry = sl >> 15;
+
+		if ( bad & valid )
+			return 0;
+
+		q = _mm_movemask_epi8(_mm_cmpeq_epi8(v, qm)) & valid;
+		if ( q && q_off == len )
+			q_off = i + __builtin_ctz(q);
+	}
+
+	*qpos = q_off;
+	return 1;
+}
+#endif
+
+static int (*do_canonical)(const uint8_t *p, size_t len, size_t *qpos) =
+	canonical_c;
+
+static void __attribute__((constructor)) nads_ctor(void)
+{
+#if HAVE_NADS_SIMD
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports("sse2") )
+		do_canonical = canonical_sse2;
+#endif
+}
+
+/* n_canonical:
+ * @n: A nads struct with a valid buf
+ *
+ * Most URLs come out of the normalizer exactly as they went in. If this
+ * one starts with a '/' and has no '%', '\', NUL or non-ASCII bytes and
+ * no "//" or "/." anywhere then it's one of them, in which case it's
+ * copied out and split at the '?' just like n_split() does.
+ *
+ * Return value: 1 if the URL was canonical and has been copied out, 0 if
+ * it needs the full treatment.
+ */
+static int n_canonical(struct nads *n)
+{
+	size_t qpos;
+
+	if ( !n->buf_len || n->buf[0] != '/' )
+		return 0;
+
+	if ( !(*do_canonical)((const uint8_t *)n->buf, n->buf_len, &qpos) )
+		return 0;
+
+	memcpy(uribuf, n->buf, n->buf_len);
+	uribuf[n->buf_len] = '\0';
+	n->uri = uribuf;
+	n->uri_len = qpos;
+	if ( qpos < n->buf_len ) {
+		uribuf[qpos] = '\0';
+		n->query = uribuf + qpos + 1;
+	}else{
+		n->query = NULL;
+	}
+
+	return 1;
+}
+
+/* nads_normalize_full:
  * @n: A nads structure with buf set
  *
- * Normalizes a URL and passes it on to the signature detection engines
- * if necessary.
+ * Normalizes a URL the long way, regardless of whether it needs it.
  */
-int nads_normalize(struct nads *n)
+int nads_normalize_full(struct nads *n)
 {
+	int ret = NADS_FAIL;
+
+	/* n_split() needs room for the NULs */
+	if ( n->buf_len >= NADS_MAX_URI ) {
+		uribuf[0] = '\0';
+		n->uri = uribuf;
+		n->query = NULL;
+		nads_errcode = NADS_ERR_TOO_LONG;
+		goto out;
+	}
+
 	/* Can we hex encode the '?' */
 	n_split(n);
 
 	/* Process the URI */
 	if ( !n_hex(n->uri) )
-		return NADS_FAIL;
+		goto out;
 
 	if ( nads_ws(NADS_WS_DOUBLE_HEX) && !n_hex(n->uri) )
-		return NADS_FAIL;
+		goto out;
 
 	if ( !n_utf8(n->uri) )
-		return NADS_FAIL;
+		goto out;
 
 	if ( !n_path(n->uri) )
-		return NADS_FAIL;
+		goto out;
 
 	/* TODO: Process the query string if one exists */
-	if ( n->query == NULL )
-		goto finish;
-
-	if ( !n_hex(n->query) )
-		return NADS_FAIL;
+	if ( n->query && !n_hex(n->query) )
+		goto out;
 
-finish:
 	nads_errcode = NADS_ERR_SUCCESS;
-	return NADS_OK;
+	ret = NADS_OK;
+out:
+	n->uri_len = strlen(n->uri);
+	return ret;
+}
+
+/* nads_normalize:
+ * @n: A nads structure with buf set
+ *
+ * Normalizes a URL and passes it on to the signature detection engines
+ * if necessary.
+ */
+int nads_normalize(struct nads *n)
+{
+	if ( n->buf_len < NADS_MAX_URI && n_canonical(n) ) {
+		nads_errcode = NADS_ERR_SUCCESS;
+		return NADS_OK;
+	}
+
+	return nads_normalize_full(n);
 }
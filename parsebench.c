@@ -0,0 +1,220 @@
+/*
+ * Request header parsing throughput, the tokeniser against the byte at a
+ * time state machine it replaced, over the browser request corpus. Each
+ * request is also checked to make sure both parsers agree on it.
+*/
+#include <time.h>
+
+#include <ashttpd.h>
+#include <http-parse.h>
+#include <bench-corpus.h>
+
+#define BENCH_ROUNDS	200000
+
+/* The byte at a time parser, as it was */
+static void old_dispatch_hdr(struct http_hcb *dcb, size_t num_dcb,
+				struct ro_vec *k, struct ro_vec *v)
+{
+	unsigned int n;
+	struct http_hcb *d;
+
+	for(n = num_dcb, d = dcb; n; ) {
+		unsigned int i;
+		int ret;
+
+		i = (n / 2);
+		ret = vstrcmp_fast(k, d[i].label);
+		if ( ret < 0 ) {
+			n = i;
+		}else if ( ret > 0 ) {
+			d = d + (i + 1);
+			n = n - (i + 1);
+		}else{
+			d[i].fn(&d[i], v);
+			break;
+		}
+	}
+}
+
+static size_t old_decode_buf(struct http_hcb *d, size_t num_dcb,
+				const uint8_t *p, const uint8_t *end)
+{
+	const uint8_t *cur;
+	struct ro_vec hv[3];
+	struct ro_vec k,v;
+	int i = 0;
+	void *state = &&state0;
+	int ret = 0;
+
+	hv[0].v_len = 0;
+	hv[1].v_len = 0;
+	hv[2].v_len = 0;
+
+	for(cur = p; cur < end; cur++) {
+		goto *state;
+state0:
+		if ( *cur != ' ' ) {
+			state = &&state1;
+			hv[i].v_ptr = (void *)cur;
+			hv[i].v_len = 0;
+		}
+		continue;
+state1:
+		switch(*cur) {
+		case ' ':
+			if ( i < 2 ) {
+				hv[i].v_len = cur - hv[i].v_ptr;
+				state = &&state0;
+				i++;
+			}
+			break;
+		case '\n':
+			hv[i].v_len = cur - hv[i].v_ptr;
+			if ( hv[i].v_len && *(cur - 1) == '\r' )
+				hv[i].v_len--;
+			k.v_ptr = (void *)cur + 1;
+			k.v_len = 0;
+			state = &&state2;
+			ret = (cur - p) + 1;
+			break;
+		}
+		continue;
+state2:
+		if ( *cur == ':' ) {
+			k.v_len = (cur - k.v_ptr);
+			state = &&state3;
+		}else if ( *cur == '\n' ) {
+			ret = (cur - p) + 1;
+			cur = end;
+		}
+		continue;
+state3:
+		if ( *cur != ' ' ) {
+			v.v_ptr = (void *)cur;
+			v.v_len = 0;
+			state = &&state4;
+		}
+		continue;
+state4:
+		if ( *cur == '\n' ) {
+			v.v_len = (cur - v.v_ptr);
+			if ( v.v_len && *(cur-1) == '\r' )
+				v.v_len--;
+			old_dispatch_hdr(d + 3, num_dcb - 3, &k, &v);
+			k.v_ptr = (void *)cur + 1;
+			k.v_len = 0;
+			state = &&state2;
+		}
+		continue;
+	}
+
+	if ( !hv[0].v_len || !hv[1].v_len )
+		return 0;
+
+	d[0].fn(&d[0], &hv[0]);
+	d[1].fn(&d[1], &hv[1]);
+	d[2].fn(&d[2], &hv[2]);
+
+	return ret;
+}
+
+/* What http_req() picks out */
+#define NR_FIELDS	10
+struct fields {
+	struct ro_vec	f[NR_FIELDS];
+	int		clen;
+};
+
+typedef size_t (*decode_fn_t)(struct http_hcb *d, size_t num_dcb,
+				const uint8_t *p, const uint8_t *end);
+
+static size_t decode(decode_fn_t fn, struct fields *f, const char *req)
+{
+	struct http_hcb hcb[] = {
+		{"method", htype_string, {.vec = &f->f[0]}},
+		{"uri", htype_string, {.vec = &f->f[1]}},
+		{"protocol", htype_string, {.vec = &f->f[2]}},
+		{"Host", htype_string , {.vec = &f->f[3]}},
+		{"Range", htype_string, {.vec = &f->f[4]}},
+		{"If-Range", htype_string, {.vec = &f->f[5]}},
+		{"Connection", htype_string, { .vec = &f->f[6]}},
+		{"If-None-Match", htype_string, {.vec = &f->f[7]}},
+		{"Content-Length", htype_int, {.val = &f->clen}},
+		{"Accept-Encoding", htype_string, {.vec = &f->f[8]}},
+	};
+
+	memset(f, 0, sizeof(*f));
+	f->clen = -1;
+	return (*fn)(hcb, sizeof(hcb)/sizeof(*hcb), (const uint8_t *)req,
+			(const uint8_t *)req + strlen(req));
+}
+
+static int check(unsigned int idx)
+{
+	struct fields a, b;
+	size_t alen, blen;
+	unsigned int i;
+
+	alen = decode(old_decode_buf, &a, bench_corpus[idx]);
+	blen = decode(http_decode_buf, &b, bench_corpus[idx]);
+	if ( alen != blen || a.clen != b.clen )
+		goto bad;
+
+	for(i = 0; i < NR_FIELDS; i++) {
+		if ( a.f[i].v_len != b.f[i].v_len )
+			goto bad;
+		if ( a.f[i].v_len &&
+				memcmp(a.f[i].v_ptr, b.f[i].v_ptr, a.f[i].v_len) )
+			goto bad;
+	}
+
+	return 1;
+bad:
+	fprintf(stderr, "parsers disagree on request %u\n", idx);
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char *label, decode_fn_t fn, size_t bytes)
+{
+	struct fields f;
+	unsigned int i, j;
+	size_t ok = 0;
+	double start, secs;
+
+	start = now();
+	for(i = 0; i < BENCH_ROUNDS; i++) {
+		for(j = 0; j < bench_nr_corpus; j++)
+			ok += !!decode(fn, &f, bench_corpus[j]);
+	}
+	secs = now() - start;
+
+	assert(ok == (size_t)BENCH_ROUNDS * bench_nr_corpus);
+	printf("%-10s %6.2f GB/s %8.1f ns/request\n", label,
+		(double)bytes * BENCH_ROUNDS / secs / 1e9,
+		secs * 1e9 / ((double)BENCH_ROUNDS * bench_nr_corpus));
+}
+
+int main(int argc, char **argv)
+{
+	size_t bytes = 0;
+	unsigned int i;
+
+	for(i = 0; i < bench_nr_corpus; i++) {
+		if ( !check(i) )
+			return EXIT_FAILURE;
+		bytes += strlen(bench_corpus[i]);
+	}
+
+	printf("%u requests, %zu bytes, %u rounds\n",
+		bench_nr_corpus, bytes, BENCH_ROUNDS);
+	bench("old", old_decode_buf, bytes);
+	bench("tokenise", http_decode_buf, bytes);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,73 @@
+/*
+ * Pipes for splicing file data to sockets. Creating a pipe and growing it
+ * costs a few syscalls so they're kept around for the next response.
+*/
+#define _GNU_SOURCE
+#include <compiler.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <os.h>
+#include <pipepool.h>
+
+#define PIPE_POOL_SIZE	64
+
+/* bigger pipes mean fewer trips round the loop per response, if the
+ * limit in /proc/sys/fs/pipe-max-size is lower we live with the default
+ */
+#define PIPE_SIZE	(1 << 18)
+#define PIPE_DEFAULT	(1 << 16)
+
+struct pooled_pipe {
+	int	pp_fd[2];
+	size_t	pp_cap;
+};
+
+static __thread struct pooled_pipe pool[PIPE_POOL_SIZE];
+static __thread unsigned int pool_cnt;
+
+size_t pipepool_get(int p[2])
+{
+	int sz;
+
+	if ( pool_cnt ) {
+		pool_cnt--;
+		p[0] = pool[pool_cnt].pp_fd[0];
+		p[1] = pool[pool_cnt].pp_fd[1];
+		return pool[pool_cnt].pp_cap;
+	}
+
+	if ( pipe2(p, O_NONBLOCK|O_CLOEXEC) ) {
+		fprintf(stderr, "pipe2: %s\n", os_err());
+		return 0;
+	}
+
+	sz = fcntl(p[1], F_SETPIPE_SZ, PIPE_SIZE);
+	if ( sz < 0 )
+		sz = fcntl(p[1], F_GETPIPE_SZ);
+	return (sz > 0) ? (size_t)sz : PIPE_DEFAULT;
+}
+
+void pipepool_put(int p[2], size_t cap, int empty)
+{
+	if ( empty && pool_cnt < PIPE_POOL_SIZE ) {
+		pool[pool_cnt].pp_fd[0] = p[0];
+		pool[pool_cnt].pp_fd[1] = p[1];
+		pool[pool_cnt].pp_cap = cap;
+		pool_cnt++;
+	}else{
+		close(p[0]);
+		close(p[1]);
+	}
+	p[0] = p[1] = -1;
+}
+
+void pipepool_fini(void)
+{
+	while ( pool_cnt ) {
+		pool_cnt--;
+		close(pool[pool_cnt].pp_fd[0]);
+		close(pool[pool_cnt].pp_fd[1]);
+	}
+}
@@ -0,0 +1,229 @@
+/*
+ * TLS handshakes with OpenSSL, which hands the session keys to the kernel
+ * with setsockopt(SOL_TLS, TLS_TX/TLS_RX) as soon as they're ready. From
+ * then on sendfile(), splice() and plain send() on the socket all get
+ * encrypted in the kernel and the rest of httpd doesn't know the
+ * difference.
+*/
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include <ashttpd.h>
+#include <tls.h>
+
+#if 0
+#define dprintf printf
+#else
+#define dprintf(x...) do {} while(0)
+#endif
+
+/* only ciphers the kernel can do */
+#define TLS_CIPHERS	"ECDHE+AESGCM:ECDHE+CHACHA20"
+#define TLS_SUITES	"TLS_AES_128_GCM_SHA256:" \
+			"TLS_AES_256_GCM_SHA384:" \
+			"TLS_CHACHA20_POLY1305_SHA256"
+
+struct _tls_ctx {
+	SSL_CTX		*c_ctx;
+};
+
+struct _tls {
+	SSL		*t_ssl;
+};
+
+static void tls_err(const char *what)
+{
+	unsigned long e;
+
+	while ( (e = ERR_get_error()) ) {
+		char buf[256];
+		ERR_error_string_n(e, buf, sizeof(buf));
+		fprintf(stderr, "tls: %s: %s\n", what, buf);
+	}
+}
+
+/* Attaching the ULP loads the tls module if need be, it's only refused
+ * for not being connected yet if the kernel has it.
+ */
+static int ktls_available(void)
+{
+	int fd, ret;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if ( fd < 0 )
+		return 0;
+
+	ret = setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls"));
+	ret = (!ret || errno == ENOTCONN);
+	close(fd);
+	return ret;
+}
+
+tls_ctx_t tls_ctx_new(const char *cert, const char *key)
+{
+	struct _tls_ctx *c;
+
+	/* no point going on if the kernel can't take over */
+	if ( !ktls_available() ) {
+		fprintf(stderr, "tls: kernel TLS unavailable, "
+				"is the tls module loaded?\n");
+		return NULL;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if ( NULL == c )
+		goto out;
+
+	c->c_ctx = SSL_CTX_new(TLS_server_method());
+	if ( NULL == c->c_ctx ) {
+		tls_err("SSL_CTX_new");
+		goto out_free;
+	}
+
+	SSL_CTX_set_min_proto_version(c->c_ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(c->c_ctx, SSL_OP_ENABLE_KTLS |
+					SSL_OP_NO_RENEGOTIATION |
+					SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+	/* tickets would go out after the handshake, once we're not
+	 * looking, so no resumption other than the session cache
+	 */
+	SSL_CTX_set_num_tickets(c->c_ctx, 0);
+
+	if ( !SSL_CTX_set_cipher_list(c->c_ctx, TLS_CIPHERS) ||
+			!SSL_CTX_set_ciphersuites(c->c_ctx, TLS_SUITES) ) {
+		tls_err("ciphers");
+		goto out_free_ctx;
+	}
+
+	if ( !SSL_CTX_use_certificate_chain_file(c->c_ctx, cert) ) {
+		tls_err(cert);
+		goto out_free_ctx;
+	}
+
+	if ( !SSL_CTX_use_PrivateKey_file(c->c_ctx, key, SSL_FILETYPE_PEM) ||
+			!SSL_CTX_check_private_key(c->c_ctx) ) {
+		tls_err(key);
+		goto out_free_ctx;
+	}
+
+	goto out; /* success */
+
+out_free_ctx:
+	SSL_CTX_free(c->c_ctx);
+out_free:
+	free(c);
+	c = NULL;
+out:
+	return c;
+}
+
+tls_t tls_new(tls_ctx_t ctx, int fd)
+{
+	struct _tls *tls;
+
+	tls = calloc(1, sizeof(*tls));
+	if ( NULL == tls )
+		return NULL;
+
+	tls->t_ssl = SSL_new(ctx->c_ctx);
+	if ( NULL == tls->t_ssl ) {
+		tls_err("SSL_new");
+		free(tls);
+		return NULL;
+	}
+
+	/* socket BIO doesn't take ownership of the fd */
+	if ( !SSL_set_fd(tls->t_ssl, fd) ) {
+		tls_err("SSL_set_fd");
+		tls_free(tls);
+		return NULL;
+	}
+
+	SSL_set_accept_state(tls->t_ssl);
+	return tls;
+}
+
+/* Returns 1 when done, 0 on error and -1 if it needs to wait on the
+ * socket, in which case *wait says which way.
+ */
+int tls_handshake(tls_t tls, nbio_flags_t *wait)
+{
+	int ret;
+
+	ret = SSL_do_handshake(tls->t_ssl);
+	if ( ret == 1 ) {
+		/* checked for in tls_ctx_new(), so not worth a message */
+		if ( !BIO_get_ktls_send(SSL_get_wbio(tls->t_ssl)) ) {
+			dprintf("tls: kernel didn't take the tx keys\n");
+			return 0;
+		}
+		dprintf("tls: %s %s, rx %s\n",
+			SSL_get_version(tls->t_ssl),
+			SSL_get_cipher_name(tls->t_ssl),
+			(tls_offloaded(tls)) ? "kernel" : "user");
+		return 1;
+	}
+
+	switch(SSL_get_error(tls->t_ssl, ret)) {
+	case SSL_ERROR_WANT_READ:
+		*wait = NBIO_READ;
+		return -1;
+	case SSL_ERROR_WANT_WRITE:
+		*wait = NBIO_WRITE;
+		return -1;
+	default:
+		/* mostly clients going away, don't spam */
+		ERR_clear_error();
+		return 0;
+	}
+}
+
+/* Kernel has the rx keys too, the SSL object is no longer needed */
+int tls_offloaded(tls_t tls)
+{
+	return BIO_get_ktls_recv(SSL_get_rbio(tls->t_ssl));
+}
+
+/* Plaintext OpenSSL has already decrypted, which the socket won't
+ * signal for
+ */
+int tls_pending(tls_t tls)
+{
+	return SSL_pending(tls->t_ssl) > 0;
+}
+
+/* Like recv(), EAGAIN if there's nothing to read */
+ssize_t tls_recv(tls_t tls, void *buf, size_t len)
+{
+	size_t ret;
+
+	if ( SSL_read_ex(tls->t_ssl, buf, len, &ret) )
+		return ret;
+
+	switch(SSL_get_error(tls->t_ssl, 0)) {
+	case SSL_ERROR_WANT_READ:
+		errno = EAGAIN;
+		return -1;
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	default:
+		ERR_clear_error();
+		errno = EIO;
+		return -1;
+	}
+}
+
+void tls_free(tls_t tls)
+{
+	if ( tls ) {
+		SSL_free(tls->t_ssl);
+		free(tls);
+	}
+}
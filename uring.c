@@ -0,0 +1,224 @@
+/*
+ * Minimal io_uring wrapper using the raw syscalls, we don't depend on
+ * liburing.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <compiler.h>
+#include <uring.h>
+#include <os.h>
+
+#define load_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+				unsigned int min_complete, unsigned int flags,
+				void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, arg, argsz);
+}
+
+int uring_register(struct uring *u, unsigned int op,
+			void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, u->u_fd, op, arg, nr_args);
+}
+
+int uring_init(struct uring *u, unsigned int entries)
+{
+	struct io_uring_params p;
+	unsigned int *array, i;
+	uint8_t *sq, *cq;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+
+	/* Make the CQ bigger than the SQ, multishot requests can post a
+	 * lot more completions than we submit
+	 */
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = entries * 4;
+
+	u->u_fd = sys_io_uring_setup(entries, &p);
+	if ( u->u_fd < 0 )
+		goto out;
+
+	u->u_features = p.features;
+
+	u->u_sq_map_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->u_cq_map_sz = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+		if ( u->u_cq_map_sz > u->u_sq_map_sz )
+			u->u_sq_map_sz = u->u_cq_map_sz;
+		u->u_cq_map_sz = u->u_sq_map_sz;
+	}
+
+	u->u_sq_map = mmap(NULL, u->u_sq_map_sz, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_POPULATE, u->u_fd,
+				IORING_OFF_SQ_RING);
+	if ( u->u_sq_map == MAP_FAILED )
+		goto out_close;
+
+	if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+		u->u_cq_map = u->u_sq_map;
+	}else{
+		u->u_cq_map = mmap(NULL, u->u_cq_map_sz,
+					PROT_READ|PROT_WRITE,
+					MAP_SHARED|MAP_POPULATE, u->u_fd,
+					IORING_OFF_CQ_RING);
+		if ( u->u_cq_map == MAP_FAILED )
+			goto out_unmap_sq;
+	}
+
+	u->u_sqe_map_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->u_sqes = mmap(NULL, u->u_sqe_map_sz, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_POPULATE, u->u_fd,
+				IORING_OFF_SQES);
+	if ( u->u_sqes == MAP_FAILED )
+		goto out_unmap_cq;
+
+	sq = u->u_sq_map;
+	u->u_sq_head = (unsigned int *)(sq + p.sq_off.head);
+	u->u_sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	u->u_sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	u->u_sq_entries = *(unsigned int *)(sq + p.sq_off.ring_entries);
+	u->u_sq_local = *u->u_sq_tail;
+
+	/* identity mapping, sqes are always used in ring order */
+	array = (unsigned int *)(sq + p.sq_off.array);
+	for(i = 0; i < u->u_sq_entries; i++)
+		array[i] = i;
+
+	cq = u->u_cq_map;
+	u->u_cq_head = (unsigned int *)(cq + p.cq_off.head);
+	u->u_cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	u->u_cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	u->u_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 1;
+
+out_unmap_cq:
+	if ( u->u_cq_map != u->u_sq_map )
+		munmap(u->u_cq_map, u->u_cq_map_sz);
+out_unmap_sq:
+	munmap(u->u_sq_map, u->u_sq_map_sz);
+out_close:
+	close(u->u_fd);
+out:
+	u->u_fd = -1;
+	return 0;
+}
+
+void uring_fini(struct uring *u)
+{
+	if ( u->u_fd < 0 )
+		return;
+	munmap(u->u_sqes, u->u_sqe_map_sz);
+	if ( u->u_cq_map != u->u_sq_map )
+		munmap(u->u_cq_map, u->u_cq_map_sz);
+	munmap(u->u_sq_map, u->u_sq_map_sz);
+	close(u->u_fd);
+	u->u_fd = -1;
+}
+
+/* Returns a zeroed sqe, if the SQ is full then what we have so far is
+ * submitted first.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+
+	if ( u->u_sq_local - load_acquire(u->u_sq_head) >= u->u_sq_entries ) {
+		uring_submit(u, 0, 0);
+		if ( u->u_sq_local - load_acquire(u->u_sq_head) >=
+				u->u_sq_entries )
+			return NULL;
+	}
+
+	sqe = &u->u_sqes[u->u_sq_local & u->u_sq_mask];
+	u->u_sq_local++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/* Submit everything queued and optionally wait for at least wait_nr
+ * completions or mto milliseconds, whichever comes first. Returns -1
+ * only on hard errors, timeouts and signals are not errors.
+ */
+int uring_submit(struct uring *u, unsigned int wait_nr, int mto)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int to_submit, flags = 0;
+	void *argp = NULL;
+	size_t argsz = 0;
+	int ret;
+
+	/* anything the kernel didn't take last time is still queued */
+	to_submit = u->u_sq_local - load_acquire(u->u_sq_head);
+	store_release(u->u_sq_tail, u->u_sq_local);
+
+	if ( wait_nr ) {
+		flags |= IORING_ENTER_GETEVENTS;
+		if ( mto >= 0 ) {
+			ts.tv_sec = mto / 1000;
+			ts.tv_nsec = (mto % 1000) * 1000000;
+			memset(&arg, 0, sizeof(arg));
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+			argp = &arg;
+			argsz = sizeof(arg);
+			flags |= IORING_ENTER_EXT_ARG;
+		}
+	}else if ( 0 == to_submit ) {
+		return 0;
+	}
+
+	ret = sys_io_uring_enter(u->u_fd, to_submit, wait_nr,
+					flags, argp, argsz);
+	if ( ret < 0 ) {
+		switch(errno) {
+		case EINTR:
+		case ETIME:
+			return 0;
+		case EAGAIN:
+		case EBUSY:
+			/* CQ overflowed, caller needs to reap */
+			return 0;
+		default:
+			fprintf(stderr, "io_uring_enter: %s\n", os_err());
+			return -1;
+		}
+	}
+
+	return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *u)
+{
+	unsigned int head = *u->u_cq_head;
+
+	if ( head == load_acquire(u->u_cq_tail) )
+		return NULL;
+
+	return &u->u_cqes[head & u->u_cq_mask];
+}
+
+void uring_cqe_seen(struct uring *u)
+{
+	store_release(u->u_cq_head, *u->u_cq_head + 1);
+}
@@ -8,6 +8,9 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
+#include <limits.h>
+#include <stddef.h>
+#include <signal.h>
 
 #include <ashttpd.h>
 #include <ashttpd-conn.h>
@@ -28,13 +31,126 @@ struct _vhosts {
 	const char *dirname;
 	webroot_t vdefault;
 	nbnotify_t notify;
+
+	/* master: sockets to each worker */
+	struct vhost_replica *replicas;
+	unsigned int num_replicas;
+};
+
+struct vhost_replica {
+	int	r_fd;
+	pid_t	r_pid;
+};
+
+/* Message sent from master to workers when a vhost changes, for
+ * VHOST_MSG_ADD the webroot fd is passed along with it.
+ */
+#define VHOST_MSG_ADD	0
+#define VHOST_MSG_DEL	1
+struct vhost_msg {
+	uint8_t		m_op;
+	char		m_name[NAME_MAX + 1];
+};
+
+struct vhost_follower {
+	struct nbio	f_nbio;
+	struct _vhosts	*f_vhosts;
 };
 
+static void replicate(struct _vhosts *v, unsigned int op,
+			const char *name, webroot_t w)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct vhost_msg m;
+	struct msghdr mh;
+	struct iovec iov;
+	unsigned int i;
+	ssize_t ret;
+	size_t len;
+
+	len = strlen(name);
+	if ( len > NAME_MAX )
+		return;
+
+	m.m_op = op;
+	memcpy(m.m_name, name, len);
+
+	iov.iov_base = &m;
+	iov.iov_len = offsetof(struct vhost_msg, m_name) + len;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	if ( op == VHOST_MSG_ADD ) {
+		struct cmsghdr *cmsg;
+		int fd = webroot_get_fd(w);
+
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+	}
+
+	for(i = 0; i < v->num_replicas; i++) {
+		struct vhost_replica *r = v->replicas + i;
+
+		ret = sendmsg(r->r_fd, &mh, MSG_DONTWAIT|MSG_NOSIGNAL);
+		if ( ret == (ssize_t)iov.iov_len )
+			continue;
+
+		/* Worker is wedged or dead. Either way it's missed a change
+		 * so it's killed and the master reaps it and forks a
+		 * replacement with an up to date copy of the vhosts.
+		 */
+		fprintf(stderr, "vhosts: replicate to pid %d: %s\n",
+			(int)r->r_pid, (ret < 0) ? os_err() : "short send");
+		kill(r->r_pid, SIGKILL);
+		*r = v->replicas[--v->num_replicas];
+		i--;
+	}
+}
+
+/* Takes ownership of the reference to w, w may be NULL for delete */
+static void vhost_set(struct _vhosts *v, const char *name, webroot_t w)
+{
+	webroot_t old = NULL;
+	void **pptr;
+
+	if ( !strcmp(name, "__default__") ) {
+		webroot_unref(v->vdefault);
+		v->vdefault = w;
+	}else if ( w ) {
+		if ( !cb_insert(&v->vhosts, name, &pptr) ) {
+			webroot_unref(w);
+			return;
+		}
+
+		if ( *pptr ) {
+			printf(" - closing old\n");
+			old = *pptr;
+		}
+
+		*pptr = w;
+	}else{
+		if ( !cb_delete(&v->vhosts, name, (void **)&old) ) {
+			printf(" - not found\n");
+		}
+	}
+
+	webroot_unref(old);
+
+	if ( v->num_replicas )
+		replicate(v, (w) ? VHOST_MSG_ADD : VHOST_MSG_DEL, name, w);
+}
+
 static void vhost_add(void *priv, const char *name, unsigned isdir)
 {
 	struct _vhosts *v = priv;
 	char fn[strlen(v->dirname) + strlen(name) + 2];
-	void **pptr;
 	webroot_t w;
 
 	if ( isdir )
@@ -47,43 +163,18 @@ static void vhost_add(void *priv, const char *name, unsigned isdir)
 	if ( NULL == w )
 		return;
 
-	if ( !strcmp(name, "__default__") ) {
-		webroot_unref(v->vdefault);
-		v->vdefault = w;
-		return;
-	}
-
-	if ( !cb_insert(&v->vhosts, name, &pptr) )
-		return;
-
-	if ( *pptr ) {
-		printf(" - closing old\n");
-		webroot_unref(*pptr);
-	}
-
-	*pptr = w;
+	vhost_set(v, name, w);
 }
 
 static void vhost_del(void *priv, const char *name, unsigned isdir)
 {
 	struct _vhosts *v = priv;
-	webroot_t w;
 
 	if ( isdir )
 		return;
 	printf("del vhost: %s\n", name);
 
-	if ( !strcmp(name, "__default__") ) {
-		webroot_unref(v->vdefault);
-		v->vdefault = NULL;
-		return;
-	}
-
-	if ( !cb_delete(&v->vhosts, name, (void **)&w) ) {
-		printf(" - not found\n");
-	}
-
-	webroot_unref(w);
+	vhost_set(v, name, NULL);
 }
 
 static void server_quit(void *priv)
@@ -106,7 +197,7 @@ static void dtor(void *priv)
 	webroot_unref(w);
 }
 
-struct _vhosts *vhosts_new(struct iothread *t, const char *dirname)
+struct _vhosts *vhosts_scan(const char *dirname)
 {
 	struct _vhosts *v = NULL;
 	struct dirent *de;
@@ -135,21 +226,11 @@ struct _vhosts *vhosts_new(struct iothread *t, const char *dirname)
 		vhost_add(v, de->d_name, 0);
 	}
 
-	v->notify = nbio_inotify_new(t);
-	if ( NULL == v->notify )
-		goto out_closedir;
-
-	if ( !nbio_inotify_watch_dir(v->notify, dirname, &vhost_ops, v) )
-		goto out_denotify;
+	closedir(dir);
 
 	/* sucess */
 	goto out;
 
-out_denotify:
-	nbio_notify_free(t, v->notify);
-out_closedir:
-	cb_free(&v->vhosts, dtor);
-	closedir(dir);
 out_free:
 	free(v);
 	v = NULL;
@@ -157,6 +238,195 @@ out:
 	return v;
 }
 
+int vhosts_watch(struct iothread *t, vhosts_t v)
+{
+	v->notify = nbio_inotify_new(t);
+	if ( NULL == v->notify )
+		return 0;
+
+	if ( !nbio_inotify_watch_dir(v->notify, v->dirname, &vhost_ops, v) ) {
+		nbio_notify_free(t, v->notify);
+		v->notify = NULL;
+		return 0;
+	}
+
+	return 1;
+}
+
+struct _vhosts *vhosts_new(struct iothread *t, const char *dirname)
+{
+	struct _vhosts *v;
+
+	v = vhosts_scan(dirname);
+	if ( NULL == v )
+		return NULL;
+
+	if ( !vhosts_watch(t, v) ) {
+		cb_free(&v->vhosts, dtor);
+		webroot_unref(v->vdefault);
+		free(v);
+		return NULL;
+	}
+
+	return v;
+}
+
+/* Master side: send all future changes down fd to the worker pid */
+int vhosts_replicate(vhosts_t v, int fd, pid_t pid)
+{
+	struct vhost_replica *new;
+
+	new = realloc(v->replicas, sizeof(*new) * (v->num_replicas + 1));
+	if ( NULL == new )
+		return 0;
+
+	new[v->num_replicas].r_fd = fd;
+	new[v->num_replicas].r_pid = pid;
+	v->num_replicas++;
+	v->replicas = new;
+	return 1;
+}
+
+void vhosts_unreplicate(vhosts_t v, int fd)
+{
+	unsigned int i;
+
+	for(i = 0; i < v->num_replicas; i++) {
+		if ( v->replicas[i].r_fd != fd )
+			continue;
+		v->replicas[i] = v->replicas[--v->num_replicas];
+		return;
+	}
+}
+
+static void follow_msg(struct _vhosts *v, const struct vhost_msg *m,
+			size_t len, int fd)
+{
+	char name[NAME_MAX + 1];
+	webroot_t w;
+
+	len -= offsetof(struct vhost_msg, m_name);
+	memcpy(name, m->m_name, len);
+	name[len] = '\0';
+
+	switch(m->m_op) {
+	case VHOST_MSG_ADD:
+		if ( fd < 0 )
+			break;
+		dprintf("follow add vhost: %s\n", name);
+		w = webroot_fdopen(fd, name);
+		fd = -1;
+		if ( w )
+			vhost_set(v, name, w);
+		break;
+	case VHOST_MSG_DEL:
+		dprintf("follow del vhost: %s\n", name);
+		vhost_set(v, name, NULL);
+		break;
+	default:
+		fprintf(stderr, "vhosts: bad message %u\n", m->m_op);
+		break;
+	}
+
+	if ( fd >= 0 )
+		close(fd);
+}
+
+static void follow_read(struct iothread *t, struct nbio *n)
+{
+	struct vhost_follower *f = (struct vhost_follower *)n;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct vhost_msg m;
+	struct msghdr mh;
+	struct iovec iov;
+	ssize_t ret;
+	int fd;
+
+again:
+	iov.iov_base = &m;
+	iov.iov_len = sizeof(m);
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+
+	ret = recvmsg(n->fd, &mh, MSG_CMSG_CLOEXEC);
+	if ( ret < 0 ) {
+		if ( errno == EAGAIN ) {
+			nbio_inactive(t, n, NBIO_READ);
+			return;
+		}
+		if ( errno == EINTR )
+			goto again;
+		fprintf(stderr, "vhosts: follow: %s\n", os_err());
+		nbio_del(t, n);
+		return;
+	}else if ( ret == 0 ) {
+		/* master went away */
+		nbio_del(t, n);
+		return;
+	}
+
+	fd = -1;
+	for(cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if ( cmsg->cmsg_level == SOL_SOCKET &&
+				cmsg->cmsg_type == SCM_RIGHTS )
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+	}
+
+	if ( (size_t)ret > offsetof(struct vhost_msg, m_name) ) {
+		follow_msg(f->f_vhosts, &m, ret, fd);
+	}else if ( fd >= 0 ) {
+		close(fd);
+	}
+
+	goto again;
+}
+
+static void follow_dtor(struct iothread *t, struct nbio *n)
+{
+	close(n->fd);
+	free(n);
+}
+
+static const struct nbio_ops follow_ops = {
+	.read = follow_read,
+	.dtor = follow_dtor,
+};
+
+/* Worker side: apply changes sent by the master on fd, v is the copy
+ * of the masters vhosts which was inherited across fork()
+ */
+int vhosts_follow(struct iothread *t, vhosts_t v, int fd)
+{
+	struct vhost_follower *f;
+
+	f = calloc(1, sizeof(*f));
+	if ( NULL == f )
+		return 0;
+
+	if ( !fd_block(fd, 0) ) {
+		free(f);
+		return 0;
+	}
+
+	/* these belong to the master */
+	v->notify = NULL;
+	while ( v->num_replicas )
+		close(v->replicas[--v->num_replicas].r_fd);
+	free(v->replicas);
+	v->replicas = NULL;
+	v->num_replicas = 0;
+
+	f->f_vhosts = v;
+	f->f_nbio.fd = fd;
+	f->f_nbio.ops = &follow_ops;
+	nbio_add(t, &f->f_nbio, NBIO_READ);
+	return 1;
+}
+
 webroot_t vhosts_lookup(vhosts_t v, const char *host)
 {
 	webroot_t w;
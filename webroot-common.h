@@ -6,15 +6,29 @@ struct _webroot {
 	unsigned int r_ref;
 	const void *r_map;
 	size_t r_map_sz;
+	/* whole file, only mapped if the I/O model wants it */
+	const uint8_t *r_data;
+	size_t r_data_sz;
 
 	unsigned int r_num_edges;
 	unsigned int r_num_redirect;
 	unsigned int r_num_oid;
+	uint32_t r_hash_seed;
+	uint32_t r_hash_buckets;
+	uint32_t r_hash_keys;
 
 	const struct trie_dedge *r_trie;
+	const struct webroot_hdisp *r_hash_disp;
+	const struct webroot_hslot *r_hash_slot;
+	const uint8_t *r_hash_strtab;
 	const struct webroot_redirect *r_redir;
 	const struct webroot_file *r_file;
 	const uint8_t *r_strtab;
 };
 
+_private gidx_oid_t webroot_trie_query(struct _webroot *r,
+					const struct ro_vec *uri);
+_private gidx_oid_t webroot_hash_query(struct _webroot *r,
+					const struct ro_vec *uri);
+
 #endif /* _WEBROOT_COMMON_H */
@@ -35,7 +35,14 @@ static gidx_oid_t trie_query(struct _webroot *r,
 		match = *str;
 		match.v_len = re[i].re_strlen;
 
-		cmp = memcmp(match.v_ptr, re[i].re_str, match.v_len);
+		/* a prefix of the edge sorts before it */
+		if ( str->v_len < match.v_len ) {
+			cmp = memcmp(match.v_ptr, re[i].re_str, str->v_len);
+			if ( !cmp )
+				cmp = -1;
+		}else{
+			cmp = memcmp(match.v_ptr, re[i].re_str, match.v_len);
+		}
 		dprintf("'%.*s' vs '%.*s' (idx[%lu] / %u) = %d\n",
 			(int)match.v_len,
 			match.v_ptr,
@@ -70,6 +77,36 @@ static gidx_oid_t trie_query(struct _webroot *r,
 	return GIDX_INVALID_OID;
 }
 
+/* Only fsckroot searches the trie, webroot_find() uses the hash */
+gidx_oid_t webroot_trie_query(struct _webroot *r, const struct ro_vec *uri)
+{
+	struct ro_vec match = *uri;
+	return trie_query(r, r->r_trie, 1, &match);
+}
+
+/* Exact match, every URI is in the hash so a miss here is a miss */
+gidx_oid_t webroot_hash_query(struct _webroot *r, const struct ro_vec *uri)
+{
+	const struct webroot_hslot *s;
+	uint64_t h[2];
+	uint32_t bkt;
+
+	if ( !r->r_hash_keys )
+		return GIDX_INVALID_OID;
+
+	webroot_hash(uri->v_ptr, uri->v_len, r->r_hash_seed, h);
+	bkt = webroot_hash_bucket(h, r->r_hash_buckets);
+	s = r->r_hash_slot + webroot_hash_slot(h, r->r_hash_disp + bkt,
+						r->r_hash_keys);
+
+	if ( s->s_tag != webroot_hash_tag(h) || s->s_len != uri->v_len )
+		return GIDX_INVALID_OID;
+	if ( memcmp(r->r_hash_strtab + s->s_key, uri->v_ptr, uri->v_len) )
+		return GIDX_INVALID_OID;
+
+	return s->s_oid;
+}
+
 static int map_webroot(struct _webroot *r, uint64_t sz)
 {
 	struct stat st;
@@ -90,7 +127,10 @@ static int map_webroot(struct _webroot *r, uint64_t sz)
 	return 1;
 }
 
-webroot_t webroot_open(const char *fn)
+/* Takes ownership of fd, which is closed on error. fn is only used
+ * for error messages.
+ */
+webroot_t webroot_fdopen(int fd, const char *fn)
 {
 	struct _webroot *r;
 	struct webroot_hdr hdr;
@@ -99,17 +139,18 @@ webroot_t webroot_open(const char *fn)
 	int eof;
 
 	r = calloc(1, sizeof(*r));
-	if ( NULL == r )
+	if ( NULL == r ) {
+		close(fd);
 		goto out;
-
-	r->r_fd = open(fn, O_RDONLY);
-	if ( r->r_fd < 0 ) {
-		fprintf(stderr, "webroot: %s: %s\n", fn, os_err());
-		goto out_free;
 	}
 
+	r->r_fd = fd;
+
+	/* fd may have been passed to us by another process */
 	sz = sizeof(hdr);
-	if ( !fd_read(r->r_fd, &hdr, &sz, &eof) || eof || sz != sizeof(hdr) ) {
+	eof = 0;
+	if ( !fd_pread(r->r_fd, 0, &hdr, &sz, &eof) || eof ||
+			sz != sizeof(hdr) ) {
 		fprintf(stderr, "webroot: %s: failed to read header\n", fn);
 		goto out_close;
 	}
@@ -129,12 +170,24 @@ webroot_t webroot_open(const char *fn)
 	r->r_num_edges = hdr.h_num_edges;
 	r->r_num_redirect = hdr.h_num_redirect;
 	r->r_num_oid = hdr.h_num_redirect + hdr.h_num_file;
+	r->r_hash_seed = hdr.h_hash_seed;
+	r->r_hash_buckets = hdr.h_hash_buckets;
+	r->r_hash_keys = hdr.h_hash_keys;
 
 	ptr = r->r_map + sizeof(hdr);
 
 	r->r_trie = (struct trie_dedge *)ptr;
 	ptr += hdr.h_num_edges * sizeof(*r->r_trie);
 
+	r->r_hash_disp = (struct webroot_hdisp *)ptr;
+	ptr += (size_t)hdr.h_hash_buckets * sizeof(*r->r_hash_disp);
+
+	r->r_hash_slot = (struct webroot_hslot *)ptr;
+	ptr += (size_t)hdr.h_hash_keys * sizeof(*r->r_hash_slot);
+
+	r->r_hash_strtab = ptr;
+	ptr += hdr.h_hash_strtab_sz;
+
 	r->r_redir = (struct webroot_redirect *)ptr;
 	ptr += hdr.h_num_redirect * sizeof(*r->r_redir);
 
@@ -156,26 +209,112 @@ out_unmap:
 	munmap((void *)r->r_map, r->r_map_sz);
 out_close:
 	close(r->r_fd);
-out_free:
 	free(r);
 	r = NULL;
 out:
 	return r;
 }
 
+webroot_t webroot_open(const char *fn)
+{
+	int fd;
+
+	fd = open(fn, O_RDONLY);
+	if ( fd < 0 ) {
+		fprintf(stderr, "webroot: %s: %s\n", fn, os_err());
+		return NULL;
+	}
+
+	return webroot_fdopen(fd, fn);
+}
+
 int webroot_get_fd(webroot_t r)
 {
 	return r->r_fd;
 }
 
+/* Inline file data can be sent straight out of the mapping */
+const uint8_t *webroot_inline(webroot_t r, off_t off, size_t len)
+{
+	if ( (uint64_t)off + len > r->r_map_sz )
+		return NULL;
+	return (const uint8_t *)r->r_map + off;
+}
+
+static const char * const enc_names[WEBROOT_NUM_ENC] = {
+	[WEBROOT_ENC_GZIP] = "gzip",
+	[WEBROOT_ENC_BROTLI] = "br",
+	[WEBROOT_ENC_ZSTD] = "zstd",
+};
+
+/* The smallest variant the client will take, if any */
+static void pick_encoding(webroot_t r, const struct webroot_file *file,
+				unsigned int accept, struct webroot_name *out)
+{
+	const struct webroot_enc *e, *best = NULL;
+	unsigned int i, enc = 0;
+
+	for(i = 0; i < WEBROOT_NUM_ENC; i++) {
+		e = &file->f_enc[i];
+		if ( !(accept & (1U << i)) || !e->e_len )
+			continue;
+		if ( NULL == best || e->e_len < best->e_len ) {
+			best = e;
+			enc = i;
+		}
+	}
+
+	if ( NULL == best )
+		return;
+
+	out->u.data.f_ofs = best->e_off;
+	out->u.data.f_len = best->e_len;
+	memcpy(out->u.data.f_etag, best->e_digest, ETAG_SZ);
+	out->u.data.f_hdr200.v_ptr = r->r_map + best->e_hdr200;
+	out->u.data.f_hdr200.v_len = best->e_hdr200_len;
+	out->u.data.f_hdr304.v_ptr = r->r_map + best->e_hdr304;
+	out->u.data.f_hdr304.v_len = best->e_hdr304_len;
+	out->u.data.f_encoding = enc_names[enc];
+}
+
+static int map_data(struct _webroot *r)
+{
+	struct stat st;
+	void *map;
+
+	if ( fstat(r->r_fd, &st) )
+		return 0;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, r->r_fd, 0);
+	if ( map == MAP_FAILED ) {
+		fprintf(stderr, "webroot: mmap: %s\n", os_err());
+		return 0;
+	}
+
+	r->r_data = map;
+	r->r_data_sz = st.st_size;
+	return 1;
+}
+
+/* File data straight from memory, the whole file is mapped on first use.
+ * Webroots belong to a single iothread so there's no race here.
+ */
+const uint8_t *webroot_data(webroot_t r, off_t off, size_t len)
+{
+	if ( NULL == r->r_data && !map_data(r) )
+		return NULL;
+	if ( (uint64_t)off + len > r->r_data_sz )
+		return NULL;
+	return r->r_data + off;
+}
+
 int webroot_find(webroot_t r, const struct ro_vec *uri,
-				struct webroot_name *out)
+			unsigned int accept, struct webroot_name *out)
 {
-	struct ro_vec match = *uri;
 	gidx_oid_t idx;
 
-	dprintf("matching %.*s\n", (int)match.v_len, match.v_ptr);
-	idx = trie_query(r, r->r_trie, 1, &match);
+	dprintf("matching %.*s\n", (int)uri->v_len, uri->v_ptr);
+	idx = webroot_hash_query(r, uri);
 	if ( idx == GIDX_INVALID_OID ) {
 		dprintf("NOPE\n\n");
 		return 0;
@@ -220,6 +359,13 @@ int webroot_find(webroot_t r, const struct ro_vec *uri,
 		 * smaller than or equal to the size of the digest
 		*/
 		memcpy(out->u.data.f_etag, file->f_digest, ETAG_SZ);
+		out->u.data.f_hdr200.v_ptr = r->r_map + file->f_hdr200;
+		out->u.data.f_hdr200.v_len = file->f_hdr200_len;
+		out->u.data.f_hdr304.v_ptr = r->r_map + file->f_hdr304;
+		out->u.data.f_hdr304.v_len = file->f_hdr304_len;
+		out->u.data.f_encoding = NULL;
+		if ( accept )
+			pick_encoding(r, file, accept, out);
 	}
 
 	dprintf("\n");
@@ -231,6 +377,8 @@ static void dtor(webroot_t r)
 {
 	if ( r ) {
 		munmap((void *)r->r_map, r->r_map_sz);
+		if ( r->r_data )
+			munmap((void *)r->r_data, r->r_data_sz);
 		close(r->r_fd);
 		free(r);
 	}